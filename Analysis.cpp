@@ -1,4 +1,11 @@
 #include "Analysis.hpp"
+#include "BamReader.hpp"
+#include "MethylCache.hpp"
+#include "Profiler.hpp"
+#include "ReadDecoder.hpp"
+#include "RecordRing.hpp"
+#include "ReferenceGenome.hpp"
+#include "SimdKernels.hpp"
 #include "htslib/sam.h"  // 用於解析 BAM 標籤
 #include <iostream>
 #include <cmath>
@@ -7,230 +14,1383 @@
 #include <vector>
 #include <sstream>
 #include <string>
-#include <tuple>
-#include <map>
-
-//--------------------------------------------------
-// 將 read 序列對應到參考座標 (1-based)
-//--------------------------------------------------
-static std::vector<int> buildReadToRefMap(const bam1_t* aln) {
-    int readLength = aln->core.l_qseq;
-    std::vector<int> readToRef(readLength + 1, -1);
-    int refPos = aln->core.pos + 1; // 1-based
-    uint32_t *cigar = bam_get_cigar(aln);
-    int nCigar = aln->core.n_cigar;
-    int readPos = 1; // 1-based read 座標
-
-    for (int i = 0; i < nCigar; i++) {
-        int op = cigar[i] & BAM_CIGAR_MASK;
-        int len = cigar[i] >> BAM_CIGAR_SHIFT;
-        switch (op) {
-            case BAM_CMATCH:
-            case BAM_CEQUAL:
-            case BAM_CDIFF:
-                for (int j = 0; j < len; j++) {
-                    if (readPos <= readLength)
-                        readToRef[readPos] = refPos;
-                    readPos++;
-                    refPos++;
-                }
-                break;
-            case BAM_CINS:
-            case BAM_CSOFT_CLIP:
-                readPos += len;
-                break;
-            case BAM_CDEL:
-            case BAM_CREF_SKIP:
-                refPos += len;
-                break;
-            default:
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <memory>
+
+//--------------------------------------------------
+// 查詢區塊：同一 contig 上視窗重疊的 somatic site 合併為一次 BAM 查詢
+//--------------------------------------------------
+struct SiteBlock {
+    int tid;
+    int start;              // 1-based，含
+    int end;                // 1-based，含
+    std::vector<int> sites; // somaticSites 的索引，依位置遞增
+};
+
+// 合併後單一區塊的最大跨度，避免整條染色體合併成一個無法平行的區塊
+static const int kMaxBlockSpan = 1000000;
+
+static int windowStart(int pos, int window) {
+    return (pos - window > 0) ? pos - window : 1;
+}
+
+static std::vector<SiteBlock> buildSiteBlocks(const std::vector<SomaticSite>& somaticSites,
+                                              sam_hdr_t *header, int window, bool sweep) {
+    std::vector<int> tids(somaticSites.size());
+    for (size_t i = 0; i < somaticSites.size(); i++)
+        tids[i] = sam_hdr_name2tid(header, somaticSites[i].chr.c_str());
+
+    std::vector<int> order(somaticSites.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = static_cast<int>(i);
+    // sweep 模式依 (contig, 位置) 排序後合併；否則保持 VCF 順序，每個 site 一個區塊
+    if (sweep) {
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            if (tids[a] != tids[b])
+                return tids[a] < tids[b];
+            return somaticSites[a].pos < somaticSites[b].pos;
+        });
+    }
+
+    std::vector<SiteBlock> blocks;
+    for (int idx : order) {
+        // 不在 BAM header 中的 contig 無法查詢，結果維持空白
+        if (tids[idx] < 0)
+            continue;
+        int regionStart = windowStart(somaticSites[idx].pos, window);
+        int regionEnd = somaticSites[idx].pos + window;
+        if (sweep && !blocks.empty()) {
+            SiteBlock &last = blocks.back();
+            if (last.tid == tids[idx] && regionStart <= last.end &&
+                regionEnd - last.start < kMaxBlockSpan) {
+                last.end = std::max(last.end, regionEnd);
+                last.sites.push_back(idx);
+                continue;
+            }
+        }
+        SiteBlock block;
+        block.tid = tids[idx];
+        block.start = regionStart;
+        block.end = regionEnd;
+        block.sites.push_back(idx);
+        blocks.push_back(block);
+    }
+    return blocks;
+}
+
+//--------------------------------------------------
+// 以視窗相對位置索引的甲基化聚合表
+// 每個 (CpG 位置, allele) 只保留 ML 總和與筆數，記憶體與 read 深度無關
+//--------------------------------------------------
+struct MethylCell {
+    uint32_t qualSum;   // ML 值 (0 ~ 255) 的整數總和
+    uint32_t count;
+};
+
+class WindowAggregator {
+public:
+    WindowAggregator() : origin(0), width(0) {}
+
+    // 視窗涵蓋 [sitePos - window, sitePos + window]
+    void reset(int sitePos, int window) {
+        origin = sitePos - window;
+        width = 2 * window + 1;
+        alleles.clear();
+        cells.clear();
+    }
+
+    void add(int refPos, char allele, int qual) {
+        MethylCell &cell = slot(allele)[refPos - origin];
+        cell.qualSum += qual;
+        cell.count++;
+    }
+
+    // 合併同一視窗的另一份聚合表 (分段處理的結果)，allele 依首次出現順序附加
+    void merge(const WindowAggregator &other) {
+        for (size_t b = 0; b < other.alleles.size(); b++) {
+            MethylCell *dst = slot(other.alleles[b]);
+            const MethylCell *src = &other.cells[b * width];
+            for (int offset = 0; offset < width; offset++) {
+                dst[offset].qualSum += src[offset].qualSum;
+                dst[offset].count += src[offset].count;
+            }
+        }
+    }
+
+    // 依位置遞增輸出所有有資料的 (位置, allele)
+    void emit(int contig, int sitePos, MethylTable &out) const {
+        for (int offset = 0; offset < width; offset++) {
+            for (size_t a = 0; a < alleles.size(); a++) {
+                const MethylCell &cell = cells[a * width + offset];
+                if (cell.count == 0)
+                    continue;
+                out.push(contig, packMethylKey(origin + offset, sitePos, alleles[a]),
+                         cell.qualSum, cell.count);
+            }
+        }
+    }
+
+private:
+    // 每個觀察到的 allele 一段長度為 width 的連續區塊，首次出現時才配置
+    MethylCell *slot(char allele) {
+        size_t a = 0;
+        while (a < alleles.size() && alleles[a] != allele)
+            a++;
+        if (a == alleles.size()) {
+            alleles.push_back(allele);
+            cells.resize(alleles.size() * width, MethylCell{0, 0});
+        }
+        return &cells[a * width];
+    }
+
+    int origin;
+    int width;
+    std::vector<char> alleles;
+    std::vector<MethylCell> cells;
+};
+
+//--------------------------------------------------
+// --max-depth 抽樣：每個 site 保留名稱雜湊最小的 maxDepth 條 read (bottom-k)
+// 只依 read 名稱決定，與執行緒數、分段及快取無關，tumor 與 normal 使用相同規則
+//--------------------------------------------------
+struct SampledRead {
+    uint64_t hash;      // ReadDecoder::readNameHash
+    uint32_t order;     // read 順序 (BAM 順序)，雜湊相同時較早的 read 優先
+    char allele;
+    std::vector<MethylationRecord> calls; // 此 site 視窗內的甲基化記錄
+};
+
+static bool sampledBefore(const SampledRead &a, const SampledRead &b) {
+    return (a.hash != b.hash) ? a.hash < b.hash : a.order < b.order;
+}
+
+//--------------------------------------------------
+// 單一 site 的 allele 與甲基化統計
+//--------------------------------------------------
+struct SiteAccumulator {
+    // read 的 site 標記等於 refLabel / altLabel 時計入 ref / alt，其餘 (其他 ALT、其他鹼基、未覆蓋) 皆不計入
+    char refLabel = 0, altLabel = 0;
+    int refCount = 0, altCount = 0;
+    int depth = 0;      // 覆蓋視窗的 read 數 (抽樣前)
+    double refMethSum = 0.0, altMethSum = 0.0;
+    // 分段處理時暫存每條 read 的平均甲基化，合併後依 read 順序加總，結果與不分段完全相同
+    bool deferSums = false;
+    std::vector<double> refMeth, altMeth;
+    WindowAggregator methyl; // 此 site 視窗內的 methylation 聚合
+    // --max-depth：目前保留的 read (以 sampledBefore 排列的 max-heap)，全部讀完後才累加
+    std::vector<SampledRead> sampled;
+};
+
+// 設定 site 的 ref / alt 標記：SNV 為大寫鹼基 (與 decodeRead 的 site 鹼基比較)；
+// indel、MNV 等另建立 alleles 供 decodeRead 比對，標記為 allele 序號。回傳是否為後者
+static bool prepareSite(const SomaticSite &site, SiteAccumulator &acc, AlleleSet &alleles) {
+    const std::string &alts = site.alts.empty() ? site.alt : site.alts;
+    if (!alleles.build(site.ref, alts)) {
+        acc.refLabel = site.ref.empty() ? 0 : static_cast<char>(toupper(site.ref[0]));
+        acc.altLabel = site.alt.empty() ? 0 : static_cast<char>(toupper(site.alt[0]));
+        return false;
+    }
+    acc.refLabel = alleleLabel(0);
+    acc.altLabel = 0;
+    // alt 在記錄 ALT 中的序號 (1-based)；超過 kMaxAlleles 的 ALT 不比對
+    int index = 1;
+    size_t begin = 0;
+    while (begin <= alts.size() && index < kMaxAlleles) {
+        size_t end = alts.find(',', begin);
+        if (end == std::string::npos)
+            end = alts.size();
+        if (alts.compare(begin, end - begin, site.alt) == 0) {
+            acc.altLabel = alleleLabel(index);
+            break;
+        }
+        index++;
+        begin = end + 1;
+    }
+    return true;
+}
+
+// [first, last) 為此 read 落在 site 視窗內的甲基化記錄
+static void accumulateRead(const MethylationRecord* first, const MethylationRecord* last,
+                           char observedAllele, bool collectMethyl, SiteAccumulator& acc) {
+    // 統計 ref 與 alt 的讀數及甲基化累計；ML 值以整數加總後一次換算為機率，與 MethylTable::score 相同
+    const char label = static_cast<char>(toupper(observedAllele));
+    if (label == acc.refLabel || label == acc.altLabel) {
+        double avgMethyl = 0.0;
+        if (first != last)
+            avgMethyl = SimdKernels::sumQual(first, last) / (255.0 * (last - first));
+        if (label == acc.altLabel) {
+            acc.altCount++;
+            if (acc.deferSums)
+                acc.altMeth.push_back(avgMethyl);
+            else
+                acc.altMethSum += avgMethyl;
+        } else {
+            acc.refCount++;
+            if (acc.deferSums)
+                acc.refMeth.push_back(avgMethyl);
+            else
+                acc.refMethSum += avgMethyl;
+        }
+    }
+
+    // 累加至視窗聚合表
+    if (collectMethyl) {
+        for (const MethylationRecord* rec = first; rec != last; ++rec)
+            acc.methyl.add(rec->refPos, observedAllele, rec->qual);
+    }
+}
+
+// 此 read 是否在 site 目前保留的 maxDepth 條之內；不在其中的 read 不必解析 MM/ML
+static bool sampleAdmits(const SiteAccumulator &acc, int maxDepth, uint64_t hash, uint32_t order) {
+    if (acc.sampled.size() < static_cast<size_t>(maxDepth))
+        return true;
+    const SampledRead &worst = acc.sampled.front();
+    return (hash != worst.hash) ? hash < worst.hash : order < worst.order;
+}
+
+// 保留一條 read 的解碼結果，已滿時取代雜湊最大者 (重複使用其記錄的配置)
+static void sampleInsert(SiteAccumulator &acc, int maxDepth, uint64_t hash, uint32_t order, char allele,
+                         const MethylationRecord* first, const MethylationRecord* last) {
+    if (acc.sampled.size() < static_cast<size_t>(maxDepth))
+        acc.sampled.push_back(SampledRead());
+    else
+        std::pop_heap(acc.sampled.begin(), acc.sampled.end(), sampledBefore);
+    SampledRead &read = acc.sampled.back();
+    read.hash = hash;
+    read.order = order;
+    read.allele = allele;
+    read.calls.assign(first, last);
+    std::push_heap(acc.sampled.begin(), acc.sampled.end(), sampledBefore);
+}
+
+// 依 read 順序累加保留的 read，結果與未抽樣時只讀取這些 read 相同
+static void accumulateSampled(SiteAccumulator &acc, bool collectMethyl) {
+    std::sort(acc.sampled.begin(), acc.sampled.end(),
+              [](const SampledRead &a, const SampledRead &b) { return a.order < b.order; });
+    for (const auto &read : acc.sampled)
+        accumulateRead(read.calls.data(), read.calls.data() + read.calls.size(), read.allele,
+                       collectMethyl, acc);
+    acc.sampled.clear();
+}
+
+//--------------------------------------------------
+// 每個執行緒獨立的結果分片，平行迴圈結束後再依區塊順序合併
+//--------------------------------------------------
+struct ShardSegment {
+    int block;       // 區塊索引 (快取模式為 site 索引)
+    int site;        // 輸出此段資料列的 site 索引
+    size_t offset;   // 在分片中的起始位置
+    size_t length;
+};
+
+struct ResultShard {
+    MethylTable methyl;
+    std::vector<ShardSegment> segments;
+};
+
+// 依 block 順序合併各執行緒的分片並清空分片，並記錄各 site 的資料列範圍
+// 同一區塊的 site 由同一執行緒依序輸出，穩定排序後維持區塊內的順序
+static void mergeShards(std::vector<ResultShard> &shards, int nThreads, MethylTable &dst,
+                        std::vector<MethylRange> &siteRanges) {
+    struct MergeItem {
+        const ResultShard *shard;
+        ShardSegment segment;
+        size_t dest;
+    };
+    std::vector<MergeItem> items;
+    for (const auto &shard : shards)
+        for (const auto &segment : shard.segments)
+            items.push_back({&shard, segment, 0});
+    std::stable_sort(items.begin(), items.end(), [](const MergeItem &a, const MergeItem &b) {
+        return a.segment.block < b.segment.block;
+    });
+    size_t total = 0;
+    for (auto &item : items) {
+        item.dest = total;
+        total += item.segment.length;
+        siteRanges[item.segment.site] = MethylRange{item.dest, item.segment.length};
+    }
+    dst.resize(total);
+    #pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+    for (int m = 0; m < static_cast<int>(items.size()); m++) {
+        const MergeItem &item = items[m];
+        const MethylTable &src = item.shard->methyl;
+        const size_t from = item.segment.offset;
+        const size_t to = from + item.segment.length;
+        std::copy(src.contig.begin() + from, src.contig.begin() + to, dst.contig.begin() + item.dest);
+        std::copy(src.key.begin() + from, src.key.begin() + to, dst.key.begin() + item.dest);
+        std::copy(src.qualSum.begin() + from, src.qualSum.begin() + to, dst.qualSum.begin() + item.dest);
+        std::copy(src.count.begin() + from, src.count.begin() + to, dst.count.begin() + item.dest);
+    }
+    shards.clear();
+}
+
+// indel、MNV 等以 allele 序號標記的 site，其 methylation 資料列依記錄的 ref 與 ALT 區分；SNV 為空字串
+static std::string numberedAlleleKey(const SomaticSite &site) {
+    const std::string &alts = site.alts.empty() ? site.alt : site.alts;
+    AlleleSet alleles;
+    if (!alleles.build(site.ref, alts))
+        return std::string();
+    return site.ref + '\t' + alts;
+}
+
+std::string Analysis::methylSiteKey(const SomaticSite &site) {
+    std::string key = site.chr + '\t' + std::to_string(site.pos);
+    const std::string alleles = numberedAlleleKey(site);
+    if (!alleles.empty())
+        key += '\t' + alleles;
+    return key;
+}
+
+// methylSiteKey 相同的 site 視窗、read 與 allele 標記完全相同，只有第一筆輸出 methylation 資料
+static std::vector<char> firstOccurrenceMask(const std::vector<SomaticSite>& somaticSites) {
+    std::vector<char> mask(somaticSites.size(), 1);
+    std::vector<int> order(somaticSites.size());
+    std::vector<std::string> alleleKeys(somaticSites.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = static_cast<int>(i);
+        alleleKeys[i] = numberedAlleleKey(somaticSites[i]);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        if (somaticSites[a].pos != somaticSites[b].pos)
+            return somaticSites[a].pos < somaticSites[b].pos;
+        if (somaticSites[a].chr != somaticSites[b].chr)
+            return somaticSites[a].chr < somaticSites[b].chr;
+        return alleleKeys[a] < alleleKeys[b];
+    });
+    for (size_t k = 1; k < order.size(); k++) {
+        const int prev = order[k - 1];
+        const int cur = order[k];
+        if (somaticSites[prev].pos == somaticSites[cur].pos && somaticSites[prev].chr == somaticSites[cur].chr &&
+            alleleKeys[prev] == alleleKeys[cur])
+            mask[cur] = 0;
+    }
+    return mask;
+}
+
+// --verify-mods 的統計 (跨執行緒以 atomic 累加)
+struct DecodeCounters {
+    long long verifiedReads;
+    long long modMismatches;
+};
+
+//--------------------------------------------------
+// 單一工作的查詢範圍
+//--------------------------------------------------
+struct BlockQuery {
+    int contig;          // 此 BAM 的 contig ID
+    int readBegin;       // 只處理起點 (0-based) 落在 [readBegin, readEnd) 的 read
+    int readEnd;
+    bool collectMethyl;  // false (normal) 時只統計 allele 與平均甲基化
+    bool deferSums;      // 分段工作：暫存每條 read 的平均甲基化 (或抽樣的 read)，待合併時加總
+    int refContig;       // 參考基因組中的 contig 索引 (未使用 -r 時不使用)
+};
+
+// --profile 未啟用 (prof 為 NULL) 時不讀取時鐘
+static inline double profileClock(const ThreadProfile *prof) {
+    return prof ? omp_get_wtime() : 0.0;
+}
+
+// 逐條記錄的篩選結果
+enum RecordAction {
+    kRecordUse,     // 交給 BlockProcessor
+    kRecordSkip,
+    kRecordStop     // 之後的 read 起點都在本段之後
+};
+
+// 僅處理主對齊；分段工作只處理起點在本段內的 read
+static RecordAction filterRecord(const bam1_t *aln, const BlockQuery &query) {
+    if ((aln->core.flag & BAM_FSECONDARY) || (aln->core.flag & BAM_FSUPPLEMENTARY))
+        return kRecordSkip;
+    if (aln->core.pos < query.readBegin)
+        return kRecordSkip;
+    if (aln->core.pos >= query.readEnd)
+        return kRecordStop;
+    return kRecordUse;
+}
+
+// 起點在 readBegin 之後且與區塊重疊的 read，必與 [max(readBegin, 區塊起點), 區塊終點) 重疊
+static hts_itr_t *queryBlock(BamReader &reader, const BlockQuery &query, const SiteBlock &block,
+                             ThreadProfile *prof) {
+    double clock = profileClock(prof);
+    hts_itr_t *iter = sam_itr_queryi(reader.index, query.contig,
+                                     std::max(query.readBegin, block.start - 1), block.end);
+    if (prof)
+        prof->querySeconds += omp_get_wtime() - clock;
+    return iter;
+}
+
+// 讀取一條記錄；prof 非 NULL 時累加讀取耗時與位元組數
+static int readRecord(BamReader &reader, hts_itr_t *iter, bam1_t *aln, ThreadProfile *prof) {
+    double clock = profileClock(prof);
+    int status = sam_itr_next(reader.file, iter, aln);
+    if (prof) {
+        prof->readSeconds += omp_get_wtime() - clock;
+        if (status >= 0) {
+            prof->readsSeen++;
+            // 磁碟上的記錄：block_size (4) + 固定欄位 (32) + 變動長度資料
+            prof->recordBytes += 36 + aln->l_data;
+        }
+    }
+    return status;
+}
+
+//--------------------------------------------------
+// 將單一區塊的 read 依 BAM 順序逐條累加至各 site (accs)，全部加入後呼叫 finish()
+// 直接讀取 (processBlock) 與預讀管線 (--prefetch-threads) 共用，結果完全相同
+//--------------------------------------------------
+class BlockProcessor {
+public:
+    BlockProcessor(const BlockQuery &query, const SiteBlock &block,
+                   const std::vector<SomaticSite>& somaticSites, const AnalysisOptions &options,
+                   ModDecodeState &modState, DecodeCounters &counters,
+                   std::vector<SiteAccumulator> &accs, ThreadProfile *prof)
+        : query(query), block(block), somaticSites(somaticSites), options(options),
+          modState(modState), counters(counters), accs(accs), prof(prof),
+          nSites(block.sites.size()), firstSite(0), readsUsed(0), hasAlleles(false),
+          alleleSets(nSites), decodeSites(nSites), sitePos(nSites), siteBase(nSites), siteAlleles(nSites) {
+        cpg = {options.reference, query.refContig, options.collapseStrands};
+        accs.assign(nSites, SiteAccumulator());
+        for (size_t k = 0; k < nSites; k++) {
+            if (prepareSite(somaticSites[block.sites[k]], accs[k], alleleSets[k]))
+                hasAlleles = true;
+            accs[k].deferSums = query.deferSums;
+            if (query.collectMethyl)
+                accs[k].methyl.reset(somaticSites[block.sites[k]].pos, options.window);
+        }
+    }
+
+    // aln 須已通過 filterRecord，且依起點遞增加入
+    void add(const bam1_t *aln) {
+        const int window = options.window;
+        const int maxDepth = options.maxDepth;
+        // read 依起點遞增，視窗已在 read 起點之前結束的 site 不會再被覆蓋
+        int readStart = static_cast<int>(aln->core.pos) + 1;
+        int readEnd = static_cast<int>(bam_endpos(aln));
+        while (firstSite < nSites && somaticSites[block.sites[firstSite]].pos + window < readStart)
+            firstSite++;
+        size_t lastSite = firstSite;
+        while (lastSite < nSites && windowStart(somaticSites[block.sites[lastSite]].pos, window) <= readEnd)
+            lastSite++;
+        if (lastSite == firstSite) {
+            if (prof)
+                prof->readsSkipped++;
+            return;
+        }
+        const uint32_t order = static_cast<uint32_t>(readsUsed++);
+
+        // --max-depth：只解碼至少被一個 site 保留的 read，名稱雜湊不需解析任何標籤
+        int nCovered = 0;
+        uint64_t hash = 0;
+        if (maxDepth > 0)
+            hash = ReadDecoder::readNameHash(aln);
+        for (size_t s = firstSite; s < lastSite; s++) {
+            accs[s].depth++;
+            if (maxDepth == 0 || sampleAdmits(accs[s], maxDepth, hash, order))
+                decodeSites[nCovered++] = static_cast<int>(s);
+        }
+        if (nCovered == 0) {
+            if (prof)
+                prof->readsDownsampled++;
+            return;
+        }
+
+        // 每條 read 只解碼一次，再分配給其覆蓋的所有 site
+        double clock = profileClock(prof);
+        for (int k = 0; k < nCovered; k++) {
+            sitePos[k] = somaticSites[block.sites[decodeSites[k]]].pos;
+            if (hasAlleles) {
+                const AlleleSet &alleles = alleleSets[decodeSites[k]];
+                siteAlleles[k] = alleles.empty() ? NULL : &alleles;
+            }
+        }
+        if (options.verifyMods) {
+            bool same = ReadDecoder::verifyCpGMods(aln, modState);
+            #pragma omp atomic
+            counters.verifiedReads++;
+            if (!same) {
+                #pragma omp atomic
+                counters.modMismatches++;
+            }
+        }
+        ReadDecoder::decodeRead(aln, sitePos.data(), nCovered, siteBase.data(),
+                                sitePos[0] - window, sitePos[nCovered - 1] + window,
+                                modState, calls, options.reference ? &cpg : NULL,
+                                hasAlleles ? siteAlleles.data() : NULL);
+        if (prof) {
+            const double now = omp_get_wtime();
+            prof->decodeSeconds += now - clock;
+            prof->callsEmitted += calls.size();
+            clock = now;
+        }
+        for (int k = 0; k < nCovered; k++) {
+            // calls 依 refPos 遞增，視窗內的記錄為連續區段
+            const MethylationRecord *callsBegin = calls.data();
+            const MethylationRecord *callsEnd = callsBegin + calls.size();
+            const MethylationRecord *first = std::lower_bound(callsBegin, callsEnd,
+                sitePos[k] - window,
+                [](const MethylationRecord &rec, int pos) { return rec.refPos < pos; });
+            const MethylationRecord *last = std::upper_bound(first, callsEnd,
+                sitePos[k] + window,
+                [](int pos, const MethylationRecord &rec) { return pos < rec.refPos; });
+            SiteAccumulator &acc = accs[decodeSites[k]];
+            if (maxDepth > 0)
+                sampleInsert(acc, maxDepth, hash, order, siteBase[k], first, last);
+            else
+                accumulateRead(first, last, siteBase[k], query.collectMethyl, acc);
+        }
+        if (prof)
+            prof->accumulateSeconds += omp_get_wtime() - clock;
+    }
+
+    // 回傳實際使用 (覆蓋至少一個 site 視窗) 的 read 數
+    long long finish() {
+        // 分段工作的抽樣須跨段選取，由 mergeParts 累加
+        if (options.maxDepth > 0 && !query.deferSums) {
+            double clock = profileClock(prof);
+            for (size_t k = 0; k < nSites; k++)
+                accumulateSampled(accs[k], query.collectMethyl);
+            if (prof)
+                prof->accumulateSeconds += omp_get_wtime() - clock;
+        }
+        return readsUsed;
+    }
+
+private:
+    const BlockQuery &query;
+    const SiteBlock &block;
+    const std::vector<SomaticSite> &somaticSites;
+    const AnalysisOptions &options;
+    ModDecodeState &modState;
+    DecodeCounters &counters;
+    std::vector<SiteAccumulator> &accs;
+    ThreadProfile *prof;
+    const size_t nSites;
+    size_t firstSite;
+    long long readsUsed;
+    CpGContext cpg;
+    bool hasAlleles;                      // 區塊內是否有非 SNV site；全為 SNV 時不比對 allele
+    std::vector<AlleleSet> alleleSets;    // 各 site 的 allele 序列 (SNV 為空)
+    // 每條 read 重複使用的解碼暫存
+    std::vector<int> decodeSites;
+    std::vector<int> sitePos;
+    std::vector<char> siteBase;
+    std::vector<const AlleleSet *> siteAlleles;
+    std::vector<MethylationRecord> calls;
+};
+
+//--------------------------------------------------
+// 讀取單一區塊的 read 並累加至各 site；查詢失敗時 accs 為空白統計
+// 回傳實際使用 (覆蓋至少一個 site 視窗) 的 read 數；prof 非 NULL 時累加剖析計數
+//--------------------------------------------------
+static long long processBlock(BamReader &reader, const BlockQuery &query, const SiteBlock &block,
+                              const std::vector<SomaticSite>& somaticSites,
+                              const AnalysisOptions &options,
+                              ModDecodeState &modState, DecodeCounters &counters,
+                              std::vector<SiteAccumulator> &accs, ThreadProfile *prof) {
+    BlockProcessor processor(query, block, somaticSites, options, modState, counters, accs, prof);
+    hts_itr_t *iter = queryBlock(reader, query, block, prof);
+    if (!iter)
+        return 0;
+    bam1_t *aln = bam_init1();
+    while (readRecord(reader, iter, aln, prof) >= 0) {
+        RecordAction action = filterRecord(aln, query);
+        if (action != kRecordUse) {
+            if (prof)
+                prof->readsSkipped++;
+            if (action == kRecordStop)
                 break;
+            continue;
         }
+        processor.add(aln);
     }
-    return readToRef;
+    bam_destroy1(aln);
+    hts_itr_destroy(iter);
+    return processor.finish();
 }
 
 //--------------------------------------------------
-// 解析 BAM 中的 MM/ML 標籤，取得甲基化記錄
+// 預讀管線 (--prefetch-threads)
+// I/O 端讀取並篩選記錄，依 BAM 順序填入 ring 的批次；計算端依序取出批次交給 BlockProcessor
 //--------------------------------------------------
-struct MethylationRecord {
-    int refPos;    // 1-based 參考座標
-    double prob;   // 修飾機率 (0 ~ 1)
+// 每批的記錄數：長讀段的記錄較大，批次不宜過大以免 ring 佔用過多記憶體
+static const int kPrefetchBatchRecords = 64;
+
+// I/O 端：讀取工作 task 的所有 read；等待空批次的時間累加至 prof (backpressure)
+static void prefetchBlock(BamReader &reader, const BlockQuery &query, const SiteBlock &block,
+                          int task, RecordRing &ring, ThreadProfile *prof) {
+    hts_itr_t *iter = queryBlock(reader, query, block, prof);
+    if (iter) {
+        double stallSeconds = 0.0;
+        RecordBatch *batch = ring.acquire(task, stallSeconds);
+        while (readRecord(reader, iter, batch->records[batch->count], prof) >= 0) {
+            RecordAction action = filterRecord(batch->records[batch->count], query);
+            if (action != kRecordUse) {
+                if (prof)
+                    prof->readsSkipped++;
+                if (action == kRecordStop)
+                    break;
+                continue;
+            }
+            if (++batch->count == static_cast<int>(batch->records.size())) {
+                ring.publish(task, batch);
+                batch = ring.acquire(task, stallSeconds);
+            }
+        }
+        ring.publish(task, batch);
+        hts_itr_destroy(iter);
+        if (prof)
+            prof->backpressureSeconds += stallSeconds;
+    }
+    ring.endTask(task);
+}
+
+// 計算端：處理工作 task 的所有批次；等待批次的時間累加至 waitSeconds
+static long long consumeBlock(RecordRing &ring, int task, const BlockQuery &query, const SiteBlock &block,
+                              const std::vector<SomaticSite>& somaticSites,
+                              const AnalysisOptions &options,
+                              ModDecodeState &modState, DecodeCounters &counters,
+                              std::vector<SiteAccumulator> &accs, ThreadProfile *prof,
+                              double &waitSeconds) {
+    BlockProcessor processor(query, block, somaticSites, options, modState, counters, accs, prof);
+    while (RecordBatch *batch = ring.next(task, waitSeconds)) {
+        for (int r = 0; r < batch->count; r++)
+            processor.add(batch->records[r]);
+        ring.recycle(batch);
+    }
+    return processor.finish();
+}
+
+//--------------------------------------------------
+// 工作排程
+// 每個工作的成本以 BAM index 估計：查詢區段涵蓋的壓縮位元組數。工作依成本由高到低
+// 排序 (LPT)，由 dynamic 排程依序領取；成本遠高於平均的區塊依 read 起點切成數段，
+// 閒置的執行緒可分別領取，最後一段完成的執行緒依順序合併各段結果
+//--------------------------------------------------
+struct BlockTask {
+    int block;
+    int sample;          // 樣本索引
+    bool normal;
+    int group;           // 分段群組索引，-1 表示未分段
+    int part;            // 在群組中的段序
+    int readBegin;
+    int readEnd;
+    int64_t cost;
 };
 
-static std::vector<MethylationRecord> parseMethylation(const bam1_t* aln) {
-    std::vector<MethylationRecord> records;
-    hts_base_mod_state *modState = hts_base_mod_state_alloc();
-    int ret = bam_parse_basemod(aln, modState);
-    if (ret < 0) {
-        hts_base_mod_state_free(modState);
-        return records;
-    }
-    auto readToRef = buildReadToRefMap(aln);
-    int readLength = aln->core.l_qseq;
-    hts_base_mod mods[5];
-    int readPos0;
-    int n = bam_next_basemod(aln, modState, mods, 5, &readPos0);
-    while (n > 0) {
-        for (int i = 0; i < n; i++) {
-            int readPos1 = readPos0 + 1; // 轉為 1-based
-            if (readPos1 >= 1 && readPos1 <= readLength) {
-                int refPos = readToRef[readPos1];
-                if (refPos > 0) {
-                    double prob = mods[i].qual / 255.0;
-                    records.push_back({refPos, prob});
-                }
+struct SplitGroup {
+    std::vector<std::vector<SiteAccumulator>> parts;
+    int remaining;       // 尚未完成的段數
+};
+
+// 每個工作至少分得平均成本的幾分之一才值得切分
+static const int kTasksPerThread = 4;
+// 分段後每段的最小 read 起點跨度 (bp)
+static const int kMinPartSpan = 1000;
+
+// 查詢區段涵蓋的壓縮位元組數 (至少為 1)
+// CRAM index 只記錄 container 的檔案位移，無法界定區段的位元組數，改以區段長度 (bp) 估計
+static int64_t estimateCost(BamReader &reader, int contig, int beg, int end) {
+    hts_itr_t *iter = sam_itr_queryi(reader.index, contig, beg, end);
+    if (!iter)
+        return 1;
+    if (iter->is_cram) {
+        hts_itr_destroy(iter);
+        return std::max(1, end - beg);
+    }
+    int64_t bytes = 1;
+    for (int c = 0; c < iter->n_off; c++)
+        bytes += static_cast<int64_t>(iter->off[c].v >> 16) - static_cast<int64_t>(iter->off[c].u >> 16);
+    hts_itr_destroy(iter);
+    return bytes;
+}
+
+// 與區塊重疊的第一條 read 的起點 (0-based)；沒有 read 時回傳區塊起點
+static int firstReadStart(BamReader &reader, int contig, const SiteBlock &block) {
+    int start = block.start - 1;
+    hts_itr_t *iter = sam_itr_queryi(reader.index, contig, block.start - 1, block.end);
+    if (!iter)
+        return start;
+    bam1_t *aln = bam_init1();
+    if (sam_itr_next(reader.file, iter, aln) >= 0)
+        start = std::min(start, static_cast<int>(aln->core.pos));
+    bam_destroy1(aln);
+    hts_itr_destroy(iter);
+    return start;
+}
+
+// 各段保留的 read 依段序串接並重新編號為區塊內的 read 順序
+static void appendSampled(std::vector<SampledRead> &src, std::vector<SampledRead> &dst) {
+    std::sort(src.begin(), src.end(),
+              [](const SampledRead &a, const SampledRead &b) { return a.order < b.order; });
+    for (auto &read : src) {
+        read.order = static_cast<uint32_t>(dst.size());
+        dst.push_back(std::move(read));
+    }
+    src.clear();
+}
+
+// 依段序合併分段結果；暫存的平均甲基化依 read 順序加總
+// 使用 --max-depth 時，各段保留的 read 聯集中雜湊最小的 maxDepth 條即為不分段時保留的 read
+static void mergeParts(SplitGroup &group, std::vector<SiteAccumulator> &merged, int maxDepth,
+                       bool collectMethyl) {
+    merged.swap(group.parts[0]);
+    std::vector<std::vector<SampledRead>> sampled(merged.size());
+    for (size_t k = 0; k < merged.size(); k++)
+        appendSampled(merged[k].sampled, sampled[k]);
+    for (size_t p = 1; p < group.parts.size(); p++) {
+        for (size_t k = 0; k < merged.size(); k++) {
+            SiteAccumulator &dst = merged[k];
+            SiteAccumulator &src = group.parts[p][k];
+            dst.refCount += src.refCount;
+            dst.altCount += src.altCount;
+            dst.depth += src.depth;
+            dst.refMeth.insert(dst.refMeth.end(), src.refMeth.begin(), src.refMeth.end());
+            dst.altMeth.insert(dst.altMeth.end(), src.altMeth.begin(), src.altMeth.end());
+            dst.methyl.merge(src.methyl);
+            appendSampled(src.sampled, sampled[k]);
+        }
+    }
+    for (size_t k = 0; k < merged.size(); k++) {
+        SiteAccumulator &acc = merged[k];
+        for (double value : acc.refMeth)
+            acc.refMethSum += value;
+        for (double value : acc.altMeth)
+            acc.altMethSum += value;
+        acc.deferSums = false;
+        if (maxDepth > 0) {
+            std::vector<SampledRead> &reads = sampled[k];
+            if (reads.size() > static_cast<size_t>(maxDepth)) {
+                std::nth_element(reads.begin(), reads.begin() + maxDepth, reads.end(), sampledBefore);
+                reads.resize(maxDepth);
             }
+            acc.sampled.swap(reads);
+            accumulateSampled(acc, collectMethyl);
+        }
+    }
+    group.parts.clear();
+}
+
+// 各 contig 在參考基因組中的索引；使用 -r 時，有 site 的 contig (hasSites) 必須存在於參考基因組
+static std::vector<int> mapReferenceContigs(const AnalysisOptions &options,
+                                            const std::vector<std::string> &contigNames,
+                                            const std::vector<char> &hasSites) {
+    std::vector<int> refContigs(contigNames.size(), -1);
+    if (!options.reference)
+        return refContigs;
+    for (size_t c = 0; c < contigNames.size(); c++) {
+        refContigs[c] = options.reference->contigId(contigNames[c]);
+        if (hasSites[c] && refContigs[c] < 0) {
+            std::cerr << "錯誤：參考基因組中沒有 contig " << contigNames[c] << std::endl;
+            exit(EXIT_FAILURE);
         }
-        n = bam_next_basemod(aln, modState, mods, 5, &readPos0);
     }
-    hts_base_mod_state_free(modState);
-    return records;
+    return refContigs;
 }
 
 //--------------------------------------------------
 // 分析每個 somatic site，統計 allele 與甲基化資訊
+// 有 normal BAM 時，同一區塊的 tumor 與 normal 為相鄰的兩個工作，
+// 由不同執行緒同時讀取，normal 幾乎不增加總執行時間
 //--------------------------------------------------
 AnalysisResult Analysis::compute(const std::vector<SomaticSite>& somaticSites,
-                                   const std::string &tumorBamFile,
-                                   const std::string &normalBamFile,
-                                   int window) {
-    AnalysisResult result;
-    result.somaticData.resize(somaticSites.size());
-    
-    // 使用 OpenMP 平行處理各個 somatic site
-    #pragma omp parallel for schedule(dynamic)
-    for (int i = 0; i < static_cast<int>(somaticSites.size()); i++) {
-        const auto& site = somaticSites[i];
-        // 每個 thread 分別開啟 BAM 檔案
-        samFile *bamFile = sam_open(tumorBamFile.c_str(), "r");
-        if (!bamFile) continue;
-        bam_hdr_t *header = sam_hdr_read(bamFile);
-        hts_idx_t *index = sam_index_load(bamFile, tumorBamFile.c_str());
-        if (!index) {
-            bam_hdr_destroy(header);
-           	sam_close(bamFile);
-            continue;
+                                   BamReaderPool &tumorReaders,
+                                   BamReaderPool *normalReaders,
+                                   const AnalysisOptions &options) {
+    std::vector<SampleInput> samples(1);
+    samples[0].tumor = &tumorReaders;
+    samples[0].normal = normalReaders;
+    std::vector<AnalysisResult> results = computeSamples(somaticSites, samples, options);
+    return std::move(results[0]);
+}
+
+//--------------------------------------------------
+// 多樣本分析：所有樣本的 (樣本, 區塊) 工作共用同一組執行緒
+// 工作依樣本順序排列 (樣本內依成本由高到低)，執行緒進入下一個樣本時即關閉前一個樣本的 reader，
+// 每個執行緒同時只開啟一個樣本的 BAM
+//--------------------------------------------------
+std::vector<AnalysisResult> Analysis::computeSamples(const std::vector<SomaticSite>& somaticSites,
+                                                     const std::vector<SampleInput>& samples,
+                                                     const AnalysisOptions &options,
+                                                     const std::vector<char> *emitMethylMask) {
+    const int nSamples = static_cast<int>(samples.size());
+    const int nThreads = samples[0].tumor->size();
+    std::vector<AnalysisResult> results(nSamples);
+    // 未分析的 site (contig 不在 BAM header 中) 維持 contig = -1 的空白結果
+    SomaticAnalyData emptyRow = {-1, 0, "", "", 0, 0, 0.0, 0.0, 0, 0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0, 0};
+    // contig ID 以第一個樣本的 tumor BAM header 為準，其他 BAM 依名稱對應
+    std::vector<std::string> contigNames;
+    sam_hdr_t *header = samples[0].tumor->get(0).header;
+    for (int tid = 0; tid < sam_hdr_nref(header); tid++)
+        contigNames.push_back(sam_hdr_tid2name(header, tid));
+    std::vector<SiteBlock> blocks = buildSiteBlocks(somaticSites, header, options.window, options.sweep);
+    auto mapContigs = [&](BamReaderPool &pool) {
+        std::vector<int> tids;
+        for (const auto &name : contigNames)
+            tids.push_back(sam_hdr_name2tid(pool.get(0).header, name.c_str()));
+        // 多樣本時讀完 header 即關閉，避免主執行緒同時開啟所有樣本
+        if (nSamples > 1)
+            pool.release(0);
+        return tids;
+    };
+    std::vector<char> hasSites(contigNames.size(), 0);
+    for (const auto &block : blocks)
+        hasSites[block.tid] = 1;
+    std::vector<int> refContigs = mapReferenceContigs(options, contigNames, hasSites);
+    std::vector<std::vector<int>> tumorTids(nSamples), normalTids(nSamples);
+    for (int sample = 0; sample < nSamples; sample++) {
+        tumorTids[sample] = mapContigs(*samples[sample].tumor);
+        if (samples[sample].normal)
+            normalTids[sample] = mapContigs(*samples[sample].normal);
+        AnalysisResult &result = results[sample];
+        result.hasNormal = (samples[sample].normal != NULL);
+        result.maxDepth = options.maxDepth;
+        result.contigNames = contigNames;
+        result.somaticData.assign(somaticSites.size(), emptyRow);
+        result.siteMethyl.assign(somaticSites.size(), MethylRange{0, 0});
+    }
+
+    std::vector<std::vector<ResultShard>> shards(nSamples, std::vector<ResultShard>(nThreads));
+    std::vector<ModDecodeState> modStates(nThreads);
+    DecodeCounters counters = {0, 0};
+    // 各 site 是否輸出 methylation 資料 (methylSiteKey 相同的 site 只輸出第一筆)
+    std::vector<char> emitMethyl = emitMethylMask ? *emitMethylMask : firstOccurrenceMask(somaticSites);
+    // site 資訊先行填入；平行階段 tumor 與 normal 工作只寫入各自的欄位
+    for (int sample = 0; sample < nSamples; sample++) {
+        for (const auto &block : blocks) {
+            if (tumorTids[sample][block.tid] < 0)
+                continue;
+            for (int i : block.sites) {
+                SomaticAnalyData &row = results[sample].somaticData[i];
+                row.contig = block.tid;
+                row.pos = somaticSites[i].pos;
+                row.ref = somaticSites[i].ref;
+                row.alt = somaticSites[i].alt;
+            }
         }
-        // 定義查詢區間，確保範圍不小於 1
-        int regionStart = (site.pos - window > 0) ? site.pos - window : 1;
-        int regionEnd = site.pos + window;
-        std::string regionStr = site.chr + ":" + std::to_string(regionStart) + "-" + std::to_string(regionEnd);
-        hts_itr_t *iter = sam_itr_querys(index, header, regionStr.c_str());
-        if (!iter) {
-            hts_idx_destroy(index);
-            bam_hdr_destroy(header);
-            sam_close(bamFile);
-            continue;
+    }
+
+    // 工作清單：每個樣本每個區塊的 tumor 工作，以及 normal 工作
+    std::vector<BlockTask> tasks;
+    for (int sample = 0; sample < nSamples; sample++) {
+        for (int b = 0; b < static_cast<int>(blocks.size()); b++) {
+            const int tid = blocks[b].tid;
+            if (tumorTids[sample][tid] >= 0)
+                tasks.push_back({b, sample, false, -1, 0, 0, INT_MAX, 0});
+            if (samples[sample].normal && normalTids[sample][tid] >= 0)
+                tasks.push_back({b, sample, true, -1, 0, 0, INT_MAX, 0});
+        }
+    }
+    // 每個執行緒目前開啟的樣本；換到下一個樣本時關閉前一個樣本的 reader
+    std::vector<int> activeSample(nThreads, -1);
+    auto readerFor = [&](const BlockTask &task, int thread) -> BamReader & {
+        int &active = activeSample[thread];
+        if (active != task.sample) {
+            if (active >= 0) {
+                samples[active].tumor->release(thread);
+                if (samples[active].normal)
+                    samples[active].normal->release(thread);
+            }
+            active = task.sample;
+        }
+        const SampleInput &input = samples[task.sample];
+        return task.normal ? input.normal->get(thread) : input.tumor->get(thread);
+    };
+    auto contigFor = [&](const BlockTask &task) {
+        const int tid = blocks[task.block].tid;
+        return task.normal ? normalTids[task.sample][tid] : tumorTids[task.sample][tid];
+    };
+
+    double stageStart = omp_get_wtime();
+    // 以 index 估計各工作的成本 (只讀取 index，不解壓縮資料)
+    #pragma omp parallel for schedule(dynamic, 64) num_threads(nThreads)
+    for (int t = 0; t < static_cast<int>(tasks.size()); t++) {
+        BlockTask &task = tasks[t];
+        const SiteBlock &block = blocks[task.block];
+        task.cost = estimateCost(readerFor(task, omp_get_thread_num()), contigFor(task),
+                                 block.start - 1, block.end);
+    }
+    int64_t totalCost = 0;
+    for (const auto &task : tasks)
+        totalCost += task.cost;
+    // 同一區塊的 tumor 與 normal 以兩者中較高的成本 (分段前) 排序
+    std::vector<int64_t> pairCost(static_cast<size_t>(nSamples) * blocks.size(), 0);
+    auto pairOf = [&](const BlockTask &task) {
+        return static_cast<size_t>(task.sample) * blocks.size() + task.block;
+    };
+    for (const auto &task : tasks)
+        pairCost[pairOf(task)] = std::max(pairCost[pairOf(task)], task.cost);
+    if (options.profiler) {
+        options.profiler->addStage("cost_estimate", omp_get_wtime() - stageStart);
+        stageStart = omp_get_wtime();
+    }
+
+    // 成本超過目標兩倍的工作依 read 起點均分為數段
+    std::vector<SplitGroup> groups;
+    if (nThreads > 1) {
+        const int64_t target = std::max<int64_t>(1, totalCost / (static_cast<int64_t>(nThreads) * kTasksPerThread));
+        std::vector<int> heavy;
+        for (int t = 0; t < static_cast<int>(tasks.size()); t++)
+            if (tasks[t].cost > 2 * target)
+                heavy.push_back(t);
+        std::vector<int> firstStart(heavy.size());
+        #pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+        for (int h = 0; h < static_cast<int>(heavy.size()); h++) {
+            const BlockTask &task = tasks[heavy[h]];
+            firstStart[h] = firstReadStart(readerFor(task, omp_get_thread_num()), contigFor(task),
+                                           blocks[task.block]);
         }
-        
-        int refCount = 0, altCount = 0;
-        double refMethSum = 0.0, altMethSum = 0.0;
-        std::vector<MethylAnalyData> localMethyl; // 儲存此區域的 methylation 資料
-        
-        bam1_t *aln = bam_init1();
-        while (sam_itr_next(bamFile, iter, aln) >= 0) {
-            // 僅處理主對齊
-            if ((aln->core.flag & BAM_FSECONDARY) || (aln->core.flag & BAM_FSUPPLEMENTARY))
+        for (size_t h = 0; h < heavy.size(); h++) {
+            const BlockTask task = tasks[heavy[h]];
+            const int64_t span = blocks[task.block].end - firstStart[h];
+            int64_t nParts = std::min<int64_t>((task.cost + target - 1) / target, nThreads);
+            nParts = std::min<int64_t>(nParts, span / kMinPartSpan);
+            if (nParts < 2)
                 continue;
-                
-            // 取得此 read 的甲基化記錄
-            auto methRecords = parseMethylation(aln);
-            std::vector<MethylationRecord> filteredRecords;
-            // 過濾僅保留在 somatic site ± window 範圍內的記錄
-            for (const auto& rec : methRecords) {
-                if (std::abs(rec.refPos - site.pos) <= window)
-                    filteredRecords.push_back(rec);
-            }
-            double avgMethyl = 0.0;
-            if (!filteredRecords.empty()) {
-                double sumProb = 0.0;
-                for (const auto& rec : filteredRecords)
-                    sumProb += rec.prob;
-                avgMethyl = sumProb / filteredRecords.size();
-            }
-            
-            // 取得 read 在 somatic site 上的對應位置
-            int readLength = aln->core.l_qseq;
-            auto readToRef = buildReadToRefMap(aln);
-            int readPosAtSite = -1;
-            for (int pos = 1; pos <= readLength; pos++) {
-                if (readToRef[pos] == site.pos) {
-                    readPosAtSite = pos;
-                    break;
-                }
+            SplitGroup group;
+            group.parts.resize(nParts);
+            group.remaining = static_cast<int>(nParts);
+            const int groupIndex = static_cast<int>(groups.size());
+            groups.push_back(group);
+            for (int p = 0; p < nParts; p++) {
+                BlockTask part = task;
+                part.group = groupIndex;
+                part.part = p;
+                // 第一段涵蓋所有更早開始的 read，最後一段涵蓋到區塊終點之後
+                part.readBegin = (p == 0) ? 0 : static_cast<int>(firstStart[h] + span * p / nParts);
+                part.readEnd = (p == nParts - 1) ? INT_MAX
+                                                 : static_cast<int>(firstStart[h] + span * (p + 1) / nParts);
+                part.cost = task.cost / nParts;
+                if (p == 0)
+                    tasks[heavy[h]] = part;
+                else
+                    tasks.push_back(part);
             }
-            char observedAllele = 'N';
-            if (readPosAtSite > 0) {
-                uint8_t *seq = bam_get_seq(aln);
-                int baseVal = bam_seqi(seq, readPosAtSite - 1);
-                observedAllele = "=ACMGRSVTWYHKDBN"[baseVal];
-            }
-            
-            // 統計 ref 與 alt 的讀數及甲基化累計
-            if (toupper(observedAllele) != toupper(site.ref[0])) {
-                altCount++;
-                altMethSum += avgMethyl;
-            } else {
-                refCount++;
-                refMethSum += avgMethyl;
-            }
-            
-            // 記錄所有符合條件的 methylation 資料
-            for (const auto& rec : filteredRecords) {
-                MethylAnalyData md;
-                md.chr = site.chr;
-                md.pos = rec.refPos;
-                md.somatic_pos = site.pos;
-                md.somatic_base = observedAllele;
-                md.high_methyl = rec.prob;
-                localMethyl.push_back(md);
-            }
-        }
-        bam_destroy1(aln);
-        hts_itr_destroy(iter);
-        hts_idx_destroy(index);
-        bam_hdr_destroy(header);
-        sam_close(bamFile);
-        
-        double refMethyl = (refCount > 0) ? refMethSum / refCount : 0.0;
-        double altMethyl = (altCount > 0) ? altMethSum / altCount : 0.0;
-        
-        // 將結果寫入全域結果，使用 critical 區段避免多緒競爭
-        #pragma omp critical
+        }
+    }
+    if (options.profiler)
+        options.profiler->addStage("split_heavy_blocks", omp_get_wtime() - stageStart);
+    // 依樣本順序，樣本內成本高的區塊優先 (LPT)；相同成本維持區塊順序。
+    // 同一區塊的 tumor 與 normal 依段序交錯相鄰，由不同執行緒同時讀取
+    std::stable_sort(tasks.begin(), tasks.end(), [&](const BlockTask &a, const BlockTask &b) {
+        if (a.sample != b.sample)
+            return a.sample < b.sample;
+        if (pairCost[pairOf(a)] != pairCost[pairOf(b)])
+            return pairCost[pairOf(a)] > pairCost[pairOf(b)];
+        if (a.block != b.block)
+            return a.block < b.block;
+        if (a.part != b.part)
+            return a.part < b.part;
+        return !a.normal && b.normal;
+    });
+
+    // 區塊的統計完成後寫入結果：tumor 與 normal 寫入各自的欄位，各 site 只由一個執行緒寫入
+    auto finishBlock = [&](int thread, const BlockTask &task, const std::vector<SiteAccumulator> &accs) {
+        const SiteBlock &block = blocks[task.block];
+        AnalysisResult &result = results[task.sample];
+        if (task.normal) {
+            for (size_t k = 0; k < block.sites.size(); k++) {
+                SomaticAnalyData &row = result.somaticData[block.sites[k]];
+                const SiteAccumulator &acc = accs[k];
+                row.normal_ref_count = acc.refCount;
+                row.normal_alt_count = acc.altCount;
+                row.normal_ref_methyl_sum = acc.refMethSum;
+                row.normal_alt_methyl_sum = acc.altMethSum;
+                row.normal_ref_methyl = methylMean(acc.refMethSum, acc.refCount);
+                row.normal_alt_methyl = methylMean(acc.altMethSum, acc.altCount);
+                row.normal_depth = acc.depth;
+            }
+            return;
+        }
+        // methylation 資料移入本執行緒的分片，每個輸出的 site 一段
+        ResultShard &shard = shards[task.sample][thread];
+        for (size_t k = 0; k < block.sites.size(); k++) {
+            const int i = block.sites[k];
+            SomaticAnalyData &row = result.somaticData[i];
+            const SiteAccumulator &acc = accs[k];
+            row.ref_count = acc.refCount;
+            row.alt_count = acc.altCount;
+            row.ref_methyl_sum = acc.refMethSum;
+            row.alt_methyl_sum = acc.altMethSum;
+            row.ref_methyl = methylMean(acc.refMethSum, acc.refCount);
+            row.alt_methyl = methylMean(acc.altMethSum, acc.altCount);
+            row.depth = acc.depth;
+            if (emitMethyl[i]) {
+                ShardSegment segment;
+                segment.block = task.block;
+                segment.site = i;
+                segment.offset = shard.methyl.size();
+                acc.methyl.emit(block.tid, row.pos, shard.methyl);
+                segment.length = shard.methyl.size() - segment.offset;
+                shard.segments.push_back(segment);
+            }
+        }
+    };
+
+    auto queryFor = [&](const BlockTask &task) {
+        BlockQuery query;
+        query.contig = contigFor(task);
+        query.readBegin = task.readBegin;
+        query.readEnd = task.readEnd;
+        query.collectMethyl = !task.normal;
+        query.deferSums = (task.group >= 0);
+        query.refContig = refContigs[blocks[task.block].tid];
+        return query;
+    };
+
+    // 預讀管線：I/O 執行緒使用 reader 0 ~ nPrefetch-1，計算執行緒不再讀取 BAM
+    // 計算與 I/O 執行緒須同時存在，總數受 OMP_THREAD_LIMIT 限制
+    const int nPrefetch = std::max(0, std::min(std::min(options.prefetchThreads, nThreads),
+                                               omp_get_thread_limit() - nThreads));
+    std::unique_ptr<RecordRing> ring;
+    if (nPrefetch > 0)
+        ring.reset(new RecordRing(static_cast<int>(tasks.size()), options.queueDepth, kPrefetchBatchRecords));
+
+    // 每個 thread 使用自己的 reader (或由 ring 取得預讀的記錄)，並記錄每個執行緒的忙碌時間
+    std::vector<double> busySeconds(nThreads, 0.0);
+    std::vector<double> waitSeconds(nThreads, 0.0);
+    std::vector<int> taskCounts(nThreads, 0);
+    // prefetched：由 ring 取得預讀的記錄，否則以自己的 reader 讀取
+    auto runTask = [&](int t, int tid, bool prefetched) {
+        const double taskStart = omp_get_wtime();
+        const BlockTask &task = tasks[t];
+        const BlockQuery query = queryFor(task);
+        ThreadProfile *prof = options.profiler ? &options.profiler->thread(tid) : NULL;
+        std::vector<SiteAccumulator> accs;
+        long long readsUsed;
+        if (prefetched) {
+            double waited = 0.0;
+            readsUsed = consumeBlock(*ring, t, query, blocks[task.block], somaticSites, options,
+                                     modStates[tid], counters, accs, prof, waited);
+            waitSeconds[tid] += waited;
+            if (prof)
+                prof->prefetchWaitSeconds += waited;
+        } else {
+            readsUsed = processBlock(readerFor(task, tid), query, blocks[task.block], somaticSites,
+                                     options, modStates[tid], counters, accs, prof);
+        }
+
+        if (task.group < 0) {
+            finishBlock(tid, task, accs);
+        } else {
+            // 最後完成的段負責合併；critical 同時確保其他段的結果對本執行緒可見
+            SplitGroup &group = groups[task.group];
+            bool last;
+            const double lockStart = profileClock(prof);
+            #pragma omp critical(splitGroup)
+            {
+                if (prof)
+                    prof->lockWaitSeconds += omp_get_wtime() - lockStart;
+                group.parts[task.part].swap(accs);
+                last = (--group.remaining == 0);
+            }
+            if (last) {
+                const double mergeStart = profileClock(prof);
+                std::vector<SiteAccumulator> merged;
+                mergeParts(group, merged, options.maxDepth, query.collectMethyl);
+                finishBlock(tid, task, merged);
+                if (prof)
+                    prof->mergeSeconds += omp_get_wtime() - mergeStart;
+            }
+        }
+        const double taskSeconds = omp_get_wtime() - taskStart;
+        busySeconds[tid] += taskSeconds;
+        taskCounts[tid]++;
+        if (prof) {
+            const SiteBlock &block = blocks[task.block];
+            prof->tasks++;
+            options.profiler->recordTask(tid, TaskLatency{task.sample, task.normal, block.tid,
+                                                          somaticSites[block.sites.front()].pos,
+                                                          somaticSites[block.sites.back()].pos,
+                                                          static_cast<int>(block.sites.size()),
+                                                          readsUsed, taskSeconds});
+        }
+    };
+
+    const double loopStart = omp_get_wtime();
+    if (!ring) {
+        #pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+        for (int t = 0; t < static_cast<int>(tasks.size()); t++)
+            runTask(t, omp_get_thread_num(), false);
+    } else {
+        // 執行緒 0 ~ nThreads-1 計算，其後 nPrefetch 個執行緒預讀；兩者皆依工作順序領取
+        // OpenMP 提供的執行緒不足時 (OMP_DYNAMIC、巢狀或執行緒上限) 沒有 I/O 執行緒填入 ring，
+        // 改由前 nThreads 個執行緒各自讀取，避免計算執行緒永久等待
+        std::atomic<int> nextTask(0);
+        int granted = nThreads + nPrefetch;
+        #pragma omp parallel num_threads(nThreads + nPrefetch)
         {
-            result.somaticData[i] = {site.chr, site.pos, site.ref, site.alt, refCount, altCount, refMethyl, altMethyl};
-            result.methylData.insert(result.methylData.end(), localMethyl.begin(), localMethyl.end());
+            const int thread = omp_get_thread_num();
+            const bool piped = (omp_get_num_threads() == nThreads + nPrefetch);
+            if (thread == 0)
+                granted = omp_get_num_threads();
+            if (piped && thread >= nThreads) {
+                ThreadProfile *prof = options.profiler ? &options.profiler->thread(thread) : NULL;
+                int t;
+                while ((t = ring->beginTask()) >= 0) {
+                    const BlockTask &task = tasks[t];
+                    prefetchBlock(readerFor(task, thread - nThreads), queryFor(task), blocks[task.block],
+                                  t, *ring, prof);
+                }
+            } else if (thread < nThreads) {
+                int t;
+                while ((t = nextTask++) < static_cast<int>(tasks.size()))
+                    runTask(t, thread, piped);
+            }
+        }
+        if (granted != nThreads + nPrefetch) {
+            std::cerr << "警告：OpenMP 只提供 " << granted << " 個執行緒 (需要 " << nThreads + nPrefetch
+                      << " 個)，未使用預讀" << std::endl;
+            ring.reset();
+        }
+    }
+    const double loopSeconds = omp_get_wtime() - loopStart;
+    if (options.profiler)
+        options.profiler->addStage("process_blocks", loopSeconds);
+
+    if (!options.quiet) {
+        // 各執行緒使用率：忙碌時間 / 平行區段時間
+        std::cout << "排程: " << tasks.size() << " 個工作 (" << groups.size()
+                  << " 個重負載區塊已分段), 平行區段 " << loopSeconds << " 秒" << std::endl;
+        for (int thread = 0; thread < nThreads; thread++) {
+            std::cout << "  執行緒 " << thread << ": " << taskCounts[thread] << " 個工作, 忙碌 "
+                      << busySeconds[thread] << " 秒 ("
+                      << (loopSeconds > 0 ? 100.0 * busySeconds[thread] / loopSeconds : 0.0) << "%)";
+            if (ring)
+                std::cout << ", 其中等待預讀 " << waitSeconds[thread] << " 秒";
+            std::cout << std::endl;
+        }
+        // ring 已滿的等待 (backpressure) 表示計算跟不上 I/O；計算端等待表示 I/O 跟不上計算
+        if (ring) {
+            const RingStats stats = ring->stats();
+            std::cout << "預讀: " << nPrefetch << " 個 I/O 執行緒, ring " << ring->capacity() << " 批 x "
+                      << kPrefetchBatchRecords << " 筆, 送出 " << stats.batches << " 批, 最多同時 "
+                      << stats.peakQueued << " 批待處理" << std::endl;
+            std::cout << "  backpressure (ring 已滿): " << stats.producerStalls << " 次, "
+                      << stats.producerStallSeconds << " 秒; 計算端等待資料: " << stats.consumerStalls
+                      << " 次, " << stats.consumerStallSeconds << " 秒" << std::endl;
+        }
+    }
+
+    // 依區塊順序合併各執行緒的分片，輸出與排程無關
+    stageStart = omp_get_wtime();
+    for (int sample = 0; sample < nSamples; sample++)
+        mergeShards(shards[sample], nThreads, results[sample].methylData, results[sample].siteMethyl);
+    if (options.profiler)
+        options.profiler->addStage("merge_shards", omp_get_wtime() - stageStart);
+
+    if (options.verifyMods) {
+        std::cout << "MM/ML 解碼驗證: " << counters.verifiedReads << " 條 read, "
+                  << counters.modMismatches << " 條與 htslib 結果不一致" << std::endl;
+    }
+    return results;
+}
+
+//--------------------------------------------------
+// 由快取計算：快取保存擷取視窗內每條 read 的資料 (依 BAM 順序)，較小的視窗只需
+// 篩選 read 與記錄，逐條 read 的累加順序與 processBlock 相同，結果完全一致
+//--------------------------------------------------
+// 回傳使用的 read 數；快取中沒有此 site 或資料損毀時回傳 -1
+// acc 須已以 prepareSite 設定 SNV 的 ref / alt 標記
+static long long accumulateCached(const MethylCache &cache, int contig, const SomaticSite &site,
+                                  int window, int maxDepth, const CpGContext *cpg, bool collectMethyl,
+                                  std::vector<uint64_t> &buffer, std::vector<MethylationRecord> &calls,
+                                  SiteAccumulator &acc, ThreadProfile *prof) {
+    double clock = profileClock(prof);
+    const CacheSiteEntry *entry = cache.find(contig, site.pos);
+    CachedSiteView view;
+    if (!entry || !cache.load(*entry, buffer, view))
+        return -1;
+    if (prof) {
+        const double now = omp_get_wtime();
+        prof->decodeSeconds += now - clock;
+        prof->readsSeen += view.nReads;
+        prof->recordBytes += entry->rawSize;
+        clock = now;
+    }
+    const int regionStart = windowStart(site.pos, window);
+    const int regionEnd = site.pos + window;
+    const int32_t *offset = view.callOffset;
+    const uint8_t *qual = view.callQual;
+    long long readsUsed = 0;
+    long long readsDownsampled = 0;
+    for (uint32_t r = 0; r < view.nReads; r++) {
+        const uint32_t nCalls = view.callCount[r];
+        if (view.readStart[r] <= regionEnd && view.readEnd[r] >= regionStart) {
+            // 與 processBlock 相同的抽樣：以 read 順序與名稱雜湊決定是否保留
+            const uint32_t order = static_cast<uint32_t>(readsUsed++);
+            acc.depth++;
+            if (maxDepth > 0 && !sampleAdmits(acc, maxDepth, view.nameHash[r], order)) {
+                readsDownsampled++;
+                offset += nCalls;
+                qual += nCalls;
+                continue;
+            }
+            calls.clear();
+            // 與 decodeRead 相同：先判斷 CpG (可能合併兩股)，再以視窗篩選
+            for (uint32_t c = 0; c < nCalls; c++) {
+                int callPos = site.pos + offset[c];
+                if (cpg && !cpg->locate(callPos))
+                    continue;
+                if (callPos >= site.pos - window && callPos <= site.pos + window)
+                    calls.push_back(MethylationRecord{callPos, qual[c]});
+            }
+            if (maxDepth > 0)
+                sampleInsert(acc, maxDepth, view.nameHash[r], order, view.allele[r],
+                             calls.data(), calls.data() + calls.size());
+            else
+                accumulateRead(calls.data(), calls.data() + calls.size(), view.allele[r], collectMethyl, acc);
+            if (prof)
+                prof->callsEmitted += calls.size();
         }
-    } // end parallel for
+        offset += nCalls;
+        qual += nCalls;
+    }
+    if (maxDepth > 0)
+        accumulateSampled(acc, collectMethyl);
+    if (prof) {
+        prof->readsSkipped += view.nReads - readsUsed;
+        prof->readsDownsampled += readsDownsampled;
+        prof->accumulateSeconds += omp_get_wtime() - clock;
+    }
+    return readsUsed;
+}
+
+AnalysisResult Analysis::computeFromCache(const std::vector<SomaticSite>& somaticSites,
+                                          const MethylCache &tumorCache,
+                                          const MethylCache *normalCache,
+                                          const AnalysisOptions &options, int nThreads,
+                                          const std::vector<char> *emitMethylMask) {
+    const int window = options.window;
+    AnalysisResult result;
+    result.hasNormal = (normalCache != NULL);
+    result.maxDepth = options.maxDepth;
+    result.contigNames = tumorCache.contigNames();
+    SomaticAnalyData emptyRow = {-1, 0, "", "", 0, 0, 0.0, 0.0, 0, 0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0, 0};
+    result.somaticData.assign(somaticSites.size(), emptyRow);
+    result.siteMethyl.assign(somaticSites.size(), MethylRange{0, 0});
+    std::vector<char> emitMethyl = emitMethylMask ? *emitMethylMask : firstOccurrenceMask(somaticSites);
+    std::vector<int> normalIds(result.contigNames.size(), -1);
+    if (normalCache) {
+        for (size_t c = 0; c < result.contigNames.size(); c++)
+            normalIds[c] = normalCache->contigId(result.contigNames[c]);
+    }
 
-    // 聚合相同位點的 methylation 資料
+    std::vector<char> hasSites(result.contigNames.size(), 0);
+    for (const auto &site : somaticSites) {
+        const int contig = tumorCache.contigId(site.chr);
+        if (contig >= 0)
+            hasSites[contig] = 1;
+    }
+    std::vector<int> refContigs = mapReferenceContigs(options, result.contigNames, hasSites);
+
+    std::vector<ResultShard> shards(nThreads);
+    // 快取中缺少的 site (VCF 與擷取時不同)；記錄索引最小者
+    long long missingSite = -1;
+    bool missingInNormal = false;
+    // 快取只保存 site 位置的鹼基，無法判斷 indel 等非 SNV site 的 allele，結果維持空白
+    long long skippedAlleleSites = 0;
+    const double loopStart = omp_get_wtime();
+    #pragma omp parallel num_threads(nThreads)
     {
-        using MethylKey = std::tuple<std::string, int, int, char>;
-        std::map<MethylKey, std::pair<double, int>> aggMap;
-        for (const auto &m : result.methylData) {
-            MethylKey key = std::make_tuple(m.chr, m.pos, m.somatic_pos, m.somatic_base);
-            aggMap[key].first += m.high_methyl;
-            aggMap[key].second += 1;
-        }
-        std::vector<MethylAnalyData> aggregated;
-        for (const auto &entry : aggMap) {
-            MethylAnalyData md;
-            md.chr = std::get<0>(entry.first);
-            md.pos = std::get<1>(entry.first);
-            md.somatic_pos = std::get<2>(entry.first);
-            md.somatic_base = std::get<3>(entry.first);
-            md.high_methyl = entry.second.first / entry.second.second;
-            aggregated.push_back(md);
-        }
-        result.methylData = std::move(aggregated);
-    }
-    
-    if (!normalBamFile.empty()) {
-        #pragma omp critical
-        {
-            std::cerr << "注意：Normal BAM 分析尚未實作。\n";
+        const int thread = omp_get_thread_num();
+        std::vector<uint64_t> buffer;
+        std::vector<MethylationRecord> calls;
+        AlleleSet alleles;
+        #pragma omp for schedule(dynamic, 64) reduction(+:skippedAlleleSites)
+        for (int i = 0; i < static_cast<int>(somaticSites.size()); i++) {
+            const SomaticSite &site = somaticSites[i];
+            const int contig = tumorCache.contigId(site.chr);
+            // 不在 BAM header 中的 contig 無法查詢，結果維持空白
+            if (contig < 0)
+                continue;
+            SiteAccumulator acc;
+            SiteAccumulator normalAcc;
+            if (prepareSite(site, acc, alleles)) {
+                skippedAlleleSites++;
+                continue;
+            }
+            normalAcc.refLabel = acc.refLabel;
+            normalAcc.altLabel = acc.altLabel;
+            SomaticAnalyData &row = result.somaticData[i];
+            row.contig = contig;
+            row.pos = site.pos;
+            row.ref = site.ref;
+            row.alt = site.alt;
+
+            ThreadProfile *prof = options.profiler ? &options.profiler->thread(thread) : NULL;
+            const double siteStart = profileClock(prof);
+            acc.methyl.reset(site.pos, window);
+            CpGContext cpg = {options.reference, refContigs[contig], options.collapseStrands};
+            const CpGContext *cpgFilter = options.reference ? &cpg : NULL;
+            long long readsUsed = accumulateCached(tumorCache, contig, site, window, options.maxDepth, cpgFilter, true,
+                                                   buffer, calls, acc, prof);
+            const bool found = (readsUsed >= 0);
+            bool normalFound = true;
+            if (found && normalCache && normalIds[contig] >= 0) {
+                long long normalReads = accumulateCached(*normalCache, normalIds[contig], site, window,
+                                                         options.maxDepth, cpgFilter, false, buffer, calls, normalAcc, prof);
+                normalFound = (normalReads >= 0);
+                readsUsed += normalReads;
+                row.normal_ref_count = normalAcc.refCount;
+                row.normal_alt_count = normalAcc.altCount;
+                row.normal_ref_methyl_sum = normalAcc.refMethSum;
+                row.normal_alt_methyl_sum = normalAcc.altMethSum;
+                row.normal_ref_methyl = methylMean(normalAcc.refMethSum, normalAcc.refCount);
+                row.normal_alt_methyl = methylMean(normalAcc.altMethSum, normalAcc.altCount);
+                row.normal_depth = normalAcc.depth;
+            }
+            if (!found || !normalFound) {
+                #pragma omp critical(cacheMissing)
+                if (missingSite < 0 || i < missingSite) {
+                    missingSite = i;
+                    missingInNormal = found;
+                }
+                continue;
+            }
+            row.ref_count = acc.refCount;
+            row.alt_count = acc.altCount;
+            row.ref_methyl_sum = acc.refMethSum;
+            row.alt_methyl_sum = acc.altMethSum;
+            row.ref_methyl = methylMean(acc.refMethSum, acc.refCount);
+            row.alt_methyl = methylMean(acc.altMethSum, acc.altCount);
+            row.depth = acc.depth;
+            if (emitMethyl[i]) {
+                ResultShard &shard = shards[thread];
+                ShardSegment segment;
+                segment.block = i;
+                segment.site = i;
+                segment.offset = shard.methyl.size();
+                acc.methyl.emit(contig, site.pos, shard.methyl);
+                segment.length = shard.methyl.size() - segment.offset;
+                shard.segments.push_back(segment);
+            }
+            if (prof) {
+                prof->tasks++;
+                options.profiler->recordTask(thread, TaskLatency{0, false, contig, site.pos, site.pos, 1,
+                                                                 readsUsed, omp_get_wtime() - siteStart});
+            }
         }
     }
+    if (options.profiler)
+        options.profiler->addStage("process_sites", omp_get_wtime() - loopStart);
+    if (skippedAlleleSites > 0) {
+        std::cerr << "警告：快取模式不支援 indel 等非 SNV site，" << skippedAlleleSites
+                  << " 個 site 未分析 (請直接以 BAM 分析)" << std::endl;
+    }
+    if (missingSite >= 0) {
+        const SomaticSite &site = somaticSites[missingSite];
+        std::cerr << "錯誤：" << (missingInNormal ? "normal " : "") << "快取檔中沒有 site "
+                  << site.chr << ":" << site.pos << " 或資料已損毀，請以包含此 site 的 VCF 重新執行 extract"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // 依 site 順序合併，與不分段的 compute 順序相同
+    const double mergeStart = omp_get_wtime();
+    mergeShards(shards, nThreads, result.methylData, result.siteMethyl);
+    if (options.profiler)
+        options.profiler->addStage("merge_shards", omp_get_wtime() - mergeStart);
     return result;
 }
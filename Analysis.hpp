@@ -2,11 +2,14 @@
 #define ANALYSIS_HPP
 
 #include "CommonTypes.hpp"
+#include <cstdint>
 #include <string>
 #include <vector>
 
+class BamReaderPool;
+
 struct SomaticAnalyData {
-    std::string chr;
+    int contig;        // contig ID (BAM header 順序)，-1 表示未分析
     int pos;           // 1-based
     std::string ref;
     std::string alt;
@@ -14,27 +17,144 @@ struct SomaticAnalyData {
     int alt_count;
     double ref_methyl;
     double alt_methyl;
+    // normal BAM 統計 (未提供 normal BAM 時為 0)
+    int normal_ref_count;
+    int normal_alt_count;
+    double normal_ref_methyl;
+    double normal_alt_methyl;
+    // 平均前的每條 read 平均甲基化總和，供分片結果精確合併
+    double ref_methyl_sum;
+    double alt_methyl_sum;
+    double normal_ref_methyl_sum;
+    double normal_alt_methyl_sum;
+    // 覆蓋視窗的 read 數 (--max-depth 抽樣前)；大於 maxDepth 表示此 site 已抽樣
+    int depth;
+    int normal_depth;
 };
 
-struct MethylAnalyData {
-    std::string chr;
-    int pos;           // 1-based
-    int somatic_pos;   // 1-based
-    char somatic_base;
-    double high_methyl;
+// 平均甲基化值；分析與分片合併皆以此計算，確保結果一致
+inline double methylMean(double sum, int count) {
+    return (count > 0) ? sum / count : 0.0;
+}
+
+//--------------------------------------------------
+// methyl_analy.txt 的資料列，以結構陣列 (SoA) 儲存
+// key 將 (pos, somatic_pos, allele) 打包為 64 位元：
+//   [63:32] pos  [31:8] somatic_pos - pos + kMethylDeltaBias  [7:0] allele
+// 同一 contig 內依 key 遞增即為輸出順序
+//--------------------------------------------------
+static const int kMethylDeltaBias = 1 << 23; // window 上限
+
+inline uint64_t packMethylKey(int pos, int somaticPos, char allele) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(pos)) << 32) |
+           (static_cast<uint64_t>(somaticPos - pos + kMethylDeltaBias) << 8) |
+           static_cast<uint8_t>(allele);
+}
+inline int methylKeyPos(uint64_t key) { return static_cast<int>(key >> 32); }
+inline int methylKeySomaticPos(uint64_t key) {
+    return methylKeyPos(key) + static_cast<int>((key >> 8) & 0xFFFFFF) - kMethylDeltaBias;
+}
+inline char methylKeyAllele(uint64_t key) { return static_cast<char>(key & 0xFF); }
+
+struct MethylTable {
+    std::vector<int32_t>  contig;   // contig ID (BAM header 順序)
+    std::vector<uint64_t> key;      // packMethylKey(pos, somatic_pos, allele)
+    std::vector<uint32_t> qualSum;  // ML 值總和
+    std::vector<uint32_t> count;    // 甲基化記錄筆數
+
+    size_t size() const { return key.size(); }
+    void resize(size_t n) {
+        contig.resize(n);
+        key.resize(n);
+        qualSum.resize(n);
+        count.resize(n);
+    }
+    void append(const MethylTable &other) {
+        contig.insert(contig.end(), other.contig.begin(), other.contig.end());
+        key.insert(key.end(), other.key.begin(), other.key.end());
+        qualSum.insert(qualSum.end(), other.qualSum.begin(), other.qualSum.end());
+        count.insert(count.end(), other.count.begin(), other.count.end());
+    }
+    void push(int32_t contigId, uint64_t packedKey, uint32_t sum, uint32_t n) {
+        contig.push_back(contigId);
+        key.push_back(packedKey);
+        qualSum.push_back(sum);
+        count.push_back(n);
+    }
+    // 平均甲基化分數 (0 ~ 1)
+    double score(size_t i) const { return qualSum[i] / (255.0 * count[i]); }
+};
+
+// 一個 site 輸出的 methylation 資料列在 MethylTable 中的範圍
+struct MethylRange {
+    uint64_t offset;
+    uint64_t count;
 };
 
 struct AnalysisResult {
+    bool                          hasNormal;   // 是否含 normal BAM 統計
+    int                           maxDepth;    // 每個 site 最多使用的 read 數，0 表示不限制
+    std::vector<std::string>      contigNames; // contig ID → 名稱
     std::vector<SomaticAnalyData> somaticData;
-    std::vector<MethylAnalyData>  methylData;
+    MethylTable                   methylData;
+    // 與 somaticData 逐列對應的 methylData 範圍；重複而未輸出 methylation 資料的 site 為空範圍
+    // (分片合併的結果不含此欄)
+    std::vector<MethylRange>      siteMethyl;
+};
+
+// 分析參數
+class ReferenceGenome;
+class Profiler;
+
+struct AnalysisOptions {
+    int window;   // somatic site 前後的分析範圍 (bp)
+    bool sweep;   // 合併重疊視窗，每個區塊的 read 只讀取與解析一次
+    bool verifyMods; // 逐條 read 以 htslib 結果驗證原生 MM/ML 解碼
+    const ReferenceGenome *reference; // 非 NULL 時只保留參考基因組 CpG 上的記錄 (-r)
+    bool collapseStrands;             // CpG 兩股的記錄合併至 C 的位置 (--collapse-strands)
+    Profiler *profiler;               // 非 NULL 時記錄各執行緒計數與工作耗時 (--profile)
+    int maxDepth;                     // 每個 site 最多使用的 read 數 (--max-depth)，0 表示不限制
+    int prefetchThreads;              // 預讀 BAM 的 I/O 執行緒數 (--prefetch-threads)，0 表示計算執行緒自行讀取
+    int queueDepth;                   // 預讀 ring 的批次數 (--queue-depth)
+    bool quiet;                       // 不輸出排程與預讀摘要 (serve 模式每個查詢皆呼叫 computeSamples)
+};
+
+// 單一樣本的 BAM 輸入
+class MethylCache;
+
+struct SampleInput {
+    BamReaderPool *tumor;
+    BamReaderPool *normal;   // NULL 表示無 normal BAM
 };
 
 class Analysis {
 public:
+    // tumorReaders 的 reader 數量即為平行處理的執行緒數；預讀的 I/O 執行緒另外建立，
+    // 使用前 options.prefetchThreads 個 reader (不超過 reader 數量)
+    // normalReaders 為 NULL 表示不分析 normal BAM，否則 reader 數量須與 tumorReaders 相同
     static AnalysisResult compute(const std::vector<SomaticSite>& somaticSites,
-                                  const std::string &tumorBamFile,
-                                  const std::string &normalBamFile,
-                                  int window);
+                                  BamReaderPool &tumorReaders,
+                                  BamReaderPool *normalReaders,
+                                  const AnalysisOptions &options);
+    // 多樣本共用同一組執行緒；各 pool 的 reader 數量須相同，結果依 samples 順序回傳
+    // contig ID 以第一個樣本的 tumor BAM header 為準
+    // emitMethylMask：各 site 是否輸出 methylation 資料 (分批處理時由呼叫端跨批次去除重複位置)；
+    // NULL 表示 methylSiteKey 相同的 site 只輸出第一筆
+    static std::vector<AnalysisResult> computeSamples(const std::vector<SomaticSite>& somaticSites,
+                                                      const std::vector<SampleInput>& samples,
+                                                      const AnalysisOptions &options,
+                                                      const std::vector<char> *emitMethylMask = NULL);
+    // 由 extract 產生的快取檔計算，不讀取 BAM；options.window 不可大於快取的擷取視窗
+    // 結果與以相同 BAM 執行 compute 完全相同，contig ID 以 tumor 快取的 header 為準
+    static AnalysisResult computeFromCache(const std::vector<SomaticSite>& somaticSites,
+                                           const MethylCache &tumorCache,
+                                           const MethylCache *normalCache,
+                                           const AnalysisOptions &options, int nThreads,
+                                           const std::vector<char> *emitMethylMask = NULL);
+
+    // 去除重複 methylation 資料的鍵：SNV 的 allele 欄位為鹼基，同一位置的 SNV 資料列相同，鍵為 (chr, pos)；
+    // indel、MNV 的 allele 欄位為記錄內的 allele 序號，鍵另含 ref 與所有 ALT
+    static std::string methylSiteKey(const SomaticSite &site);
 };
 
 #endif
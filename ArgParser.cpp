@@ -1,23 +1,125 @@
 #include "ArgParser.hpp"
+#include "Analysis.hpp"
 #include <iostream>
 #include <cstring>
 #include <getopt.h>
 #include <cstdlib>
+#include <cstdio>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+// 只有長選項的參數代碼 (避開單字元選項)
+enum LongOnlyOption {
+    OPT_SWEEP = 256,
+    OPT_VERIFY_MODS,
+    OPT_SHARD,
+    OPT_SAMPLES,
+    OPT_REGIONS,
+    OPT_PASS_ONLY,
+    OPT_SNV_ONLY,
+    OPT_BATCH_SIZE,
+    OPT_CACHE,
+    OPT_NORMAL_CACHE,
+    OPT_COLLAPSE_STRANDS,
+    OPT_PROFILE,
+    OPT_PROFILE_TOP,
+    OPT_MAX_DEPTH,
+    OPT_PREFETCH_THREADS,
+    OPT_QUEUE_DEPTH,
+    OPT_STORE,
+    OPT_HEADER,
+    OPT_PING,
+    OPT_SHUTDOWN,
+    OPT_CRAM_REF
+};
+
 // 顯示使用說明
 void ArgParser::printHelp(const char* progName) {
     std::cout << "使用說明: " << progName << " [options]\n"
               << "選項:\n"
-              << "  -n, --normal <file>    Normal BAM 檔案 (可選)\n"
-              << "  -t, --tumor <file>     Tumor BAM 檔案 (必填)\n"
+              << "  -n, --normal <file>    Normal BAM 或 CRAM 檔案 (可選)\n"
+              << "  -t, --tumor <file>     Tumor BAM 或 CRAM 檔案 (未使用 --samples 時必填)\n"
+              << "      --samples <file>   樣本表，每列 <name> <tumor.bam> [normal.bam]；結果輸出至 <output>/<name>/\n"
               << "  -v, --vcf <file>       Somatic VCF 檔案 (必填)\n"
-              << "  -r, --ref <file>       參考基因組檔案 (可選)\n"
+              << "      --regions <reg>    只分析指定區段 (chr:beg-end,... 或區段檔)，需要 VCF 的 .tbi/.csi index\n"
+              << "      --pass-only        只分析 FILTER 為 PASS 的記錄\n"
+              << "      --snv-only         只分析 REF 與 ALT 皆為單一鹼基的 allele\n"
+              << "      --batch-size <num> 每批讀取並分析的 site 數 (預設 100000)\n"
+              << "  -r, --ref <file>       參考基因組 FASTA (未壓縮)；只保留 CpG 上的甲基化記錄，未指定 --cram-ref 時亦用於解碼 CRAM\n"
+              << "      --cram-ref <file>  解碼 CRAM 的參考基因組 (可為 bgzip 壓縮)，不啟用 CpG 篩選\n"
+              << "      --collapse-strands 將 CpG 反股 (G) 的記錄合併至正股 C 的位置 (需 -r)\n"
               << "  -o, --output <folder>  輸出資料夾 (預設 './')\n"
               << "  -w, --window <num>     Somatic 讀取範圍 (預設 2000)\n"
               << "  -j, --threads <num>    最大執行緒數 (預設使用最大值)\n"
+              << "  -@, --hts-threads <num> BGZF 解壓縮執行緒數 (預設 0)\n"
+              << "      --sweep            合併重疊的 somatic 視窗，每個區塊的 read 只讀取一次\n"
+              << "      --prefetch-threads <num> 預讀 BAM 的 I/O 執行緒數 (預設 0，由計算執行緒自行讀取；不超過 -j)\n"
+              << "      --queue-depth <num> 預讀 ring 的批次數，每批 64 條 read (預設 32，至少 2)\n"
+              << "      --max-depth <num>  每個 site 最多使用的 read 數，依 read 名稱雜湊固定抽樣 (預設 0 不限制)\n"
+              << "      --verify-mods      逐條 read 以 htslib 驗證原生 MM/ML 解碼結果\n"
+              << "  -z, --bgzip            輸出 bgzip 壓縮的 methyl_analy.txt.gz 並建立 tabix index\n"
+              << "      --shard <i/N>      只分析第 i 個分片 (0 <= i < N)，輸出部分結果供 merge 合併\n"
+              << "      --cache <file>     由 extract 產生的快取檔取代讀取 tumor BAM (-t 可省略，指定時檢查是否相符)\n"
+              << "      --normal-cache <file> normal BAM 的快取檔 (與 --cache 一起使用)\n"
+              << "      --store <file>     增量分析的結果庫：只計算新增或改變的 site，並以本次結果改寫\n"
+              << "      --profile <file>   輸出 JSON 效能剖析報告 (各階段與各執行緒計數、工作耗時分布)\n"
+              << "      --profile-top <num> 報告中列出最慢的工作數 (預設 20)\n"
+              << "  -h, --help             顯示此訊息\n"
+              << "\n"
+              << "合併分片結果: " << progName << " merge [options] <partial files...>\n"
+              << "擷取甲基化快取: " << progName << " extract [options]\n"
+              << "常駐查詢服務: " << progName << " serve [options] / " << progName << " query [options]\n";
+}
+
+void ArgParser::printMergeHelp(const char* progName) {
+    std::cout << "使用說明: " << progName << " merge [options] <partial files...>\n"
+              << "選項:\n"
+              << "  -o, --output <folder>  輸出資料夾 (預設 './')\n"
+              << "  -z, --bgzip            輸出 bgzip 壓縮的 methyl_analy.txt.gz 並建立 tabix index\n"
+              << "  -h, --help             顯示此訊息\n";
+}
+
+void ArgParser::printExtractHelp(const char* progName) {
+    std::cout << "使用說明: " << progName << " extract [options]\n"
+              << "選項:\n"
+              << "  -t, --tumor <file>     BAM 或 CRAM 檔案 (必填，tumor 或 normal 各自擷取)\n"
+              << "  -r, --ref <file>       參考基因組 FASTA (CRAM 輸入時必填，只用於解碼)\n"
+              << "  -v, --vcf <file>       Somatic VCF 檔案 (必填)\n"
+              << "  -o, --output <file>    快取檔 (必填)\n"
+              << "  -w, --window <num>     擷取範圍 (預設 2000)；之後可以 --cache 分析此範圍以內的任意 -w\n"
+              << "  -j, --threads <num>    最大執行緒數 (預設使用最大值)\n"
+              << "  -@, --hts-threads <num> BGZF 解壓縮執行緒數 (預設 0)\n"
+              << "      --regions <reg>    只擷取指定區段的 site\n"
+              << "      --pass-only        只擷取 FILTER 為 PASS 的記錄\n"
+              << "      --snv-only         只擷取 REF 與 ALT 皆為單一鹼基的 allele\n"
+              << "  -h, --help             顯示此訊息\n";
+}
+
+void ArgParser::printServeHelp(const char* progName) {
+    std::cout << "使用說明: " << progName << " serve [options]\n"
+              << "選項:\n"
+              << "  -t, --tumor <file>     Tumor BAM 或 CRAM 檔案 (必填)\n"
+              << "  -n, --normal <file>    Normal BAM 或 CRAM 檔案 (可選)\n"
+              << "  -r, --ref <file>       參考基因組 FASTA (未壓縮)；只保留 CpG 上的甲基化記錄，未指定 --cram-ref 時亦用於解碼 CRAM\n"
+              << "      --cram-ref <file>  解碼 CRAM 的參考基因組 (可為 bgzip 壓縮)，不啟用 CpG 篩選\n"
+              << "      --collapse-strands 將 CpG 反股 (G) 的記錄合併至正股 C 的位置 (需 -r)\n"
+              << "  -s, --socket <path>    Unix socket 路徑 (必填)\n"
+              << "  -w, --window <num>     Somatic 讀取範圍 (預設 2000)\n"
+              << "  -j, --threads <num>    最大執行緒數 (預設使用最大值)\n"
+              << "  -@, --hts-threads <num> BGZF 解壓縮執行緒數 (預設 0)\n"
+              << "      --max-depth <num>  每個 site 最多使用的 read 數 (預設 0 不限制)\n"
+              << "  -h, --help             顯示此訊息\n";
+}
+
+void ArgParser::printQueryHelp(const char* progName) {
+    std::cout << "使用說明: " << progName << " query [options] [chr:pos:ref:alt ...]\n"
+              << "未指定 site 時由標準輸入讀取，每列 <chr> <pos> <ref> <alt>\n"
+              << "選項:\n"
+              << "  -s, --socket <path>    serve 的 Unix socket 路徑 (必填)\n"
+              << "      --header           先輸出 Somatic_analy.txt 與 methyl_analy.txt 的欄位名稱\n"
+              << "      --ping             只確認 serve 是否回應\n"
+              << "      --shutdown         結束 serve\n"
               << "  -h, --help             顯示此訊息\n";
 }
 
@@ -26,6 +128,20 @@ Args ArgParser::parse(int argc, char* argv[]) {
     // 設定預設值
     args.window = 2000;
     args.outputFolder = "./";
+    args.htsThreads = 0;
+    args.sweep = false;
+    args.bgzip = false;
+    args.verifyMods = false;
+    args.passOnly = false;
+    args.snvOnly = false;
+    args.collapseStrands = false;
+    args.profileTop = 20;
+    args.maxDepth = 0;
+    args.prefetchThreads = 0;
+    args.queueDepth = 32;
+    args.batchSize = 100000;
+    args.shardIndex = 0;
+    args.shardCount = 0;
 #ifdef _OPENMP
     args.maxThreads = omp_get_max_threads();
 #else
@@ -37,16 +153,36 @@ Args ArgParser::parse(int argc, char* argv[]) {
         {"tumor", required_argument, 0, 't'},
         {"vcf", required_argument, 0, 'v'},
         {"ref", required_argument, 0, 'r'},
+        {"cram-ref", required_argument, 0, OPT_CRAM_REF},
         {"output", required_argument, 0, 'o'},
         {"window", required_argument, 0, 'w'},
         {"threads", required_argument, 0, 'j'},
+        {"hts-threads", required_argument, 0, '@'},
+        {"sweep", no_argument, 0, OPT_SWEEP},
+        {"bgzip", no_argument, 0, 'z'},
+        {"verify-mods", no_argument, 0, OPT_VERIFY_MODS},
+        {"shard", required_argument, 0, OPT_SHARD},
+        {"samples", required_argument, 0, OPT_SAMPLES},
+        {"regions", required_argument, 0, OPT_REGIONS},
+        {"pass-only", no_argument, 0, OPT_PASS_ONLY},
+        {"snv-only", no_argument, 0, OPT_SNV_ONLY},
+        {"batch-size", required_argument, 0, OPT_BATCH_SIZE},
+        {"cache", required_argument, 0, OPT_CACHE},
+        {"normal-cache", required_argument, 0, OPT_NORMAL_CACHE},
+        {"collapse-strands", no_argument, 0, OPT_COLLAPSE_STRANDS},
+        {"profile", required_argument, 0, OPT_PROFILE},
+        {"profile-top", required_argument, 0, OPT_PROFILE_TOP},
+        {"max-depth", required_argument, 0, OPT_MAX_DEPTH},
+        {"prefetch-threads", required_argument, 0, OPT_PREFETCH_THREADS},
+        {"queue-depth", required_argument, 0, OPT_QUEUE_DEPTH},
+        {"store", required_argument, 0, OPT_STORE},
         {"help", no_argument, 0, 'h'},
         {0,0,0,0}
     };
 
     int optionChar;
     int optionIndex = 0;
-    while ((optionChar = getopt_long(argc, argv, "n:t:v:r:o:w:j:h", longOptions, &optionIndex)) != -1) {
+    while ((optionChar = getopt_long(argc, argv, "n:t:v:r:o:w:j:@:zh", longOptions, &optionIndex)) != -1) {
         switch (optionChar) {
             case 'n':
                 args.normalBam = optarg;
@@ -60,6 +196,9 @@ Args ArgParser::parse(int argc, char* argv[]) {
             case 'r':
                 args.refFile = optarg;
                 break;
+            case OPT_CRAM_REF:
+                args.cramRefFile = optarg;
+                break;
             case 'o':
                 args.outputFolder = optarg;
                 break;
@@ -69,6 +208,90 @@ Args ArgParser::parse(int argc, char* argv[]) {
             case 'j':
                 args.maxThreads = std::stoi(optarg);
                 break;
+            case '@':
+                args.htsThreads = std::stoi(optarg);
+                break;
+            case 'z':
+                args.bgzip = true;
+                break;
+            case OPT_SWEEP:
+                args.sweep = true;
+                break;
+            case OPT_VERIFY_MODS:
+                args.verifyMods = true;
+                break;
+            case OPT_SAMPLES:
+                args.sampleSheet = optarg;
+                break;
+            case OPT_REGIONS:
+                args.regions = optarg;
+                break;
+            case OPT_PASS_ONLY:
+                args.passOnly = true;
+                break;
+            case OPT_SNV_ONLY:
+                args.snvOnly = true;
+                break;
+            case OPT_BATCH_SIZE:
+                args.batchSize = std::stoi(optarg);
+                if (args.batchSize < 1) {
+                    std::cerr << "錯誤：--batch-size 必須大於 0" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_CACHE:
+                args.cacheFile = optarg;
+                break;
+            case OPT_NORMAL_CACHE:
+                args.normalCacheFile = optarg;
+                break;
+            case OPT_COLLAPSE_STRANDS:
+                args.collapseStrands = true;
+                break;
+            case OPT_STORE:
+                args.storeFile = optarg;
+                break;
+            case OPT_PROFILE:
+                args.profileFile = optarg;
+                break;
+            case OPT_PROFILE_TOP:
+                args.profileTop = std::stoi(optarg);
+                if (args.profileTop < 0) {
+                    std::cerr << "錯誤：--profile-top 不可小於 0" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MAX_DEPTH:
+                args.maxDepth = std::stoi(optarg);
+                if (args.maxDepth < 0) {
+                    std::cerr << "錯誤：--max-depth 不可小於 0" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_PREFETCH_THREADS:
+                args.prefetchThreads = std::stoi(optarg);
+                if (args.prefetchThreads < 0) {
+                    std::cerr << "錯誤：--prefetch-threads 不可小於 0" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_QUEUE_DEPTH:
+                // 讀取中編號最小的工作須保留一個空批次，ring 至少兩批才能同時預讀
+                args.queueDepth = std::stoi(optarg);
+                if (args.queueDepth < 2) {
+                    std::cerr << "錯誤：--queue-depth 不可小於 2" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_SHARD: {
+                char extra;
+                if (sscanf(optarg, "%d/%d%c", &args.shardIndex, &args.shardCount, &extra) != 2 ||
+                    args.shardCount < 1 || args.shardIndex < 0 || args.shardIndex >= args.shardCount) {
+                    std::cerr << "錯誤：--shard 格式須為 i/N，且 0 <= i < N" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
             case 'h':
                 printHelp(argv[0]);
                 exit(EXIT_SUCCESS);
@@ -81,11 +304,37 @@ Args ArgParser::parse(int argc, char* argv[]) {
     }
 
     // 檢查必要參數
-    if (args.tumorBam.empty()) {
-        std::cerr << "錯誤：必須指定 Tumor BAM 檔案 (-t 或 --tumor)" << std::endl;
+    if (args.tumorBam.empty() && args.sampleSheet.empty() && args.cacheFile.empty()) {
+        std::cerr << "錯誤：必須指定 Tumor BAM 檔案 (-t 或 --tumor)、樣本表 (--samples) 或快取檔 (--cache)" << std::endl;
         printHelp(argv[0]);
         exit(EXIT_FAILURE);
     }
+    if (!args.sampleSheet.empty() && (!args.tumorBam.empty() || !args.normalBam.empty())) {
+        std::cerr << "錯誤：--samples 不可與 -t 或 -n 同時使用" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!args.cacheFile.empty() && (!args.sampleSheet.empty() || !args.normalBam.empty())) {
+        std::cerr << "錯誤：--cache 不可與 --samples 或 -n 同時使用 (normal 請使用 --normal-cache)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (args.collapseStrands && args.refFile.empty()) {
+        std::cerr << "錯誤：--collapse-strands 須搭配參考基因組 (-r)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // 結果庫保存單一樣本的完整結果
+    if (!args.storeFile.empty() && (!args.sampleSheet.empty() || args.shardCount > 0)) {
+        std::cerr << "錯誤：--store 不可與 --samples 或 --shard 同時使用" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!args.normalCacheFile.empty() && args.cacheFile.empty()) {
+        std::cerr << "錯誤：--normal-cache 須與 --cache 一起使用" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // methyl_analy.txt 的 key 以 24 位元儲存 somatic_pos 與 CpG 位置的差距
+    if (args.window < 0 || args.window >= kMethylDeltaBias) {
+        std::cerr << "錯誤：分析範圍 (-w) 必須介於 0 與 " << kMethylDeltaBias - 1 << " 之間" << std::endl;
+        exit(EXIT_FAILURE);
+    }
     if (args.vcfFile.empty()) {
         std::cerr << "錯誤：必須指定 Somatic VCF 檔案 (-v 或 --vcf)" << std::endl;
         printHelp(argv[0]);
@@ -93,3 +342,279 @@ Args ArgParser::parse(int argc, char* argv[]) {
     }
     return args;
 }
+
+MergeArgs ArgParser::parseMerge(int argc, char* argv[]) {
+    const char *progName = argv[0];
+    // 略過程式名稱，以 "merge" 作為 getopt 的 argv[0]
+    argc--;
+    argv++;
+    MergeArgs args;
+    args.outputFolder = "./";
+    args.bgzip = false;
+
+    static struct option longOptions[] = {
+        {"output", required_argument, 0, 'o'},
+        {"bgzip", no_argument, 0, 'z'},
+        {"help", no_argument, 0, 'h'},
+        {0,0,0,0}
+    };
+
+    int optionChar;
+    int optionIndex = 0;
+    while ((optionChar = getopt_long(argc, argv, "o:zh", longOptions, &optionIndex)) != -1) {
+        switch (optionChar) {
+            case 'o':
+                args.outputFolder = optarg;
+                break;
+            case 'z':
+                args.bgzip = true;
+                break;
+            case 'h':
+                printMergeHelp(progName);
+                exit(EXIT_SUCCESS);
+            default:
+                printMergeHelp(progName);
+                exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = optind; i < argc; i++)
+        args.partialFiles.push_back(argv[i]);
+    if (args.partialFiles.empty()) {
+        std::cerr << "錯誤：必須指定分片結果檔" << std::endl;
+        printMergeHelp(progName);
+        exit(EXIT_FAILURE);
+    }
+    return args;
+}
+
+
+ExtractArgs ArgParser::parseExtract(int argc, char* argv[]) {
+    const char *progName = argv[0];
+    // 略過程式名稱，以 "extract" 作為 getopt 的 argv[0]
+    argc--;
+    argv++;
+    ExtractArgs args;
+    args.window = 2000;
+    args.htsThreads = 0;
+    args.passOnly = false;
+    args.snvOnly = false;
+#ifdef _OPENMP
+    args.maxThreads = omp_get_max_threads();
+#else
+    args.maxThreads = 1;
+#endif
+
+    static struct option longOptions[] = {
+        {"tumor", required_argument, 0, 't'},
+        {"vcf", required_argument, 0, 'v'},
+        {"ref", required_argument, 0, 'r'},
+        {"output", required_argument, 0, 'o'},
+        {"window", required_argument, 0, 'w'},
+        {"threads", required_argument, 0, 'j'},
+        {"hts-threads", required_argument, 0, '@'},
+        {"regions", required_argument, 0, OPT_REGIONS},
+        {"pass-only", no_argument, 0, OPT_PASS_ONLY},
+        {"snv-only", no_argument, 0, OPT_SNV_ONLY},
+        {"help", no_argument, 0, 'h'},
+        {0,0,0,0}
+    };
+
+    int optionChar;
+    int optionIndex = 0;
+    while ((optionChar = getopt_long(argc, argv, "t:v:r:o:w:j:@:h", longOptions, &optionIndex)) != -1) {
+        switch (optionChar) {
+            case 't':
+                args.bamFile = optarg;
+                break;
+            case 'r':
+                args.refFile = optarg;
+                break;
+            case 'v':
+                args.vcfFile = optarg;
+                break;
+            case 'o':
+                args.cacheFile = optarg;
+                break;
+            case 'w':
+                args.window = std::stoi(optarg);
+                break;
+            case 'j':
+                args.maxThreads = std::stoi(optarg);
+                break;
+            case '@':
+                args.htsThreads = std::stoi(optarg);
+                break;
+            case OPT_REGIONS:
+                args.regions = optarg;
+                break;
+            case OPT_PASS_ONLY:
+                args.passOnly = true;
+                break;
+            case OPT_SNV_ONLY:
+                args.snvOnly = true;
+                break;
+            case 'h':
+                printExtractHelp(progName);
+                exit(EXIT_SUCCESS);
+            default:
+                printExtractHelp(progName);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (args.bamFile.empty() || args.vcfFile.empty() || args.cacheFile.empty()) {
+        std::cerr << "錯誤：必須指定 BAM 檔案 (-t)、VCF 檔案 (-v) 與快取檔 (-o)" << std::endl;
+        printExtractHelp(progName);
+        exit(EXIT_FAILURE);
+    }
+    if (args.window < 0 || args.window >= kMethylDeltaBias) {
+        std::cerr << "錯誤：擷取範圍 (-w) 必須介於 0 與 " << kMethylDeltaBias - 1 << " 之間" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return args;
+}
+
+ServeArgs ArgParser::parseServe(int argc, char* argv[]) {
+    const char *progName = argv[0];
+    // 略過程式名稱，以 "serve" 作為 getopt 的 argv[0]
+    argc--;
+    argv++;
+    ServeArgs args;
+    args.window = 2000;
+    args.htsThreads = 0;
+    args.maxDepth = 0;
+    args.collapseStrands = false;
+#ifdef _OPENMP
+    args.maxThreads = omp_get_max_threads();
+#else
+    args.maxThreads = 1;
+#endif
+
+    static struct option longOptions[] = {
+        {"tumor", required_argument, 0, 't'},
+        {"normal", required_argument, 0, 'n'},
+        {"ref", required_argument, 0, 'r'},
+        {"cram-ref", required_argument, 0, OPT_CRAM_REF},
+        {"collapse-strands", no_argument, 0, OPT_COLLAPSE_STRANDS},
+        {"socket", required_argument, 0, 's'},
+        {"window", required_argument, 0, 'w'},
+        {"threads", required_argument, 0, 'j'},
+        {"hts-threads", required_argument, 0, '@'},
+        {"max-depth", required_argument, 0, OPT_MAX_DEPTH},
+        {"help", no_argument, 0, 'h'},
+        {0,0,0,0}
+    };
+
+    int optionChar;
+    int optionIndex = 0;
+    while ((optionChar = getopt_long(argc, argv, "t:n:r:s:w:j:@:h", longOptions, &optionIndex)) != -1) {
+        switch (optionChar) {
+            case 't':
+                args.tumorBam = optarg;
+                break;
+            case 'n':
+                args.normalBam = optarg;
+                break;
+            case 'r':
+                args.refFile = optarg;
+                break;
+            case OPT_CRAM_REF:
+                args.cramRefFile = optarg;
+                break;
+            case OPT_COLLAPSE_STRANDS:
+                args.collapseStrands = true;
+                break;
+            case 's':
+                args.socketPath = optarg;
+                break;
+            case 'w':
+                args.window = std::stoi(optarg);
+                break;
+            case 'j':
+                args.maxThreads = std::stoi(optarg);
+                break;
+            case '@':
+                args.htsThreads = std::stoi(optarg);
+                break;
+            case OPT_MAX_DEPTH:
+                args.maxDepth = std::stoi(optarg);
+                if (args.maxDepth < 0) {
+                    std::cerr << "錯誤：--max-depth 不可小於 0" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                printServeHelp(progName);
+                exit(EXIT_SUCCESS);
+            default:
+                printServeHelp(progName);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (args.tumorBam.empty() || args.socketPath.empty()) {
+        std::cerr << "錯誤：必須指定 Tumor BAM 檔案 (-t) 與 socket 路徑 (-s)" << std::endl;
+        printServeHelp(progName);
+        exit(EXIT_FAILURE);
+    }
+    if (args.window < 0 || args.window >= kMethylDeltaBias) {
+        std::cerr << "錯誤：分析範圍 (-w) 必須介於 0 與 " << kMethylDeltaBias - 1 << " 之間" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (args.collapseStrands && args.refFile.empty()) {
+        std::cerr << "錯誤：--collapse-strands 須搭配參考基因組 (-r)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return args;
+}
+
+QueryArgs ArgParser::parseQuery(int argc, char* argv[]) {
+    const char *progName = argv[0];
+    // 略過程式名稱，以 "query" 作為 getopt 的 argv[0]
+    argc--;
+    argv++;
+    QueryArgs args;
+    args.header = false;
+    args.ping = false;
+    args.shutdown = false;
+
+    static struct option longOptions[] = {
+        {"socket", required_argument, 0, 's'},
+        {"header", no_argument, 0, OPT_HEADER},
+        {"ping", no_argument, 0, OPT_PING},
+        {"shutdown", no_argument, 0, OPT_SHUTDOWN},
+        {"help", no_argument, 0, 'h'},
+        {0,0,0,0}
+    };
+
+    int optionChar;
+    int optionIndex = 0;
+    while ((optionChar = getopt_long(argc, argv, "s:h", longOptions, &optionIndex)) != -1) {
+        switch (optionChar) {
+            case 's':
+                args.socketPath = optarg;
+                break;
+            case OPT_HEADER:
+                args.header = true;
+                break;
+            case OPT_PING:
+                args.ping = true;
+                break;
+            case OPT_SHUTDOWN:
+                args.shutdown = true;
+                break;
+            case 'h':
+                printQueryHelp(progName);
+                exit(EXIT_SUCCESS);
+            default:
+                printQueryHelp(progName);
+                exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = optind; i < argc; i++)
+        args.sites.push_back(argv[i]);
+    if (args.socketPath.empty()) {
+        std::cerr << "錯誤：必須指定 serve 的 socket 路徑 (-s)" << std::endl;
+        printQueryHelp(progName);
+        exit(EXIT_FAILURE);
+    }
+    return args;
+}
@@ -2,21 +2,99 @@
 #define ARG_PARSER_HPP
 
 #include <string>
+#include <vector>
 
 struct Args {
     std::string normalBam;    // -n 或 --normal (可選)
-    std::string tumorBam;     // -t 或 --tumor (必填)
+    std::string tumorBam;     // -t 或 --tumor (未使用 --samples 時必填)
+    std::string sampleSheet;  // --samples (可選，多樣本樣本表，取代 -t/-n)
     std::string vcfFile;      // -v 或 --vcf (必填)
-    std::string refFile;      // -r 或 --ref (可選)
+    std::string refFile;      // -r 或 --ref (可選，只保留參考基因組 CpG 上的甲基化記錄)
+    std::string cramRefFile;  // --cram-ref (可選，解碼 CRAM 的參考基因組；未指定時使用 -r)
+    bool collapseStrands;     // --collapse-strands (可選，需 -r，CpG 兩股合併至 C 的位置)
     std::string outputFolder; // -o 或 --output (可選，預設為當前目錄)
     int window;               // -w 或 --window (可選，預設2000)
     int maxThreads;           // -j 或 --threads (可選，預設使用系統最大)
+    int htsThreads;           // -@ 或 --hts-threads (可選，預設0，BGZF 解壓縮執行緒)
+    bool sweep;               // --sweep (可選，合併重疊視窗後一次讀取)
+    bool verifyMods;          // --verify-mods (可選，以 htslib 驗證原生 MM/ML 解碼)
+    bool bgzip;               // -z 或 --bgzip (可選，輸出 bgzip 壓縮的 methyl_analy.txt.gz 與 tabix index)
+    std::string regions;      // --regions (可選，以 VCF index 限制區段)
+    bool passOnly;            // --pass-only (可選，只分析 FILTER 為 PASS 的記錄)
+    bool snvOnly;             // --snv-only (可選，只分析 SNV)
+    int batchSize;            // --batch-size (可選，每批 site 數，預設 100000)
+    int shardIndex;           // --shard i/N 的 i (可選，0-based)
+    int shardCount;           // --shard i/N 的 N (預設 0，不分片)
+    std::string cacheFile;    // --cache (可選，以 extract 產生的快取取代讀取 tumor BAM)
+    std::string normalCacheFile; // --normal-cache (可選，normal BAM 的快取)
+    std::string profileFile;  // --profile (可選，輸出 JSON 效能剖析報告)
+    int profileTop;           // --profile-top (可選，報告列出最慢的工作數，預設 20)
+    int maxDepth;             // --max-depth (可選，每個 site 最多使用的 read 數，預設 0 不限制)
+    int prefetchThreads;      // --prefetch-threads (可選，預讀 BAM 的 I/O 執行緒數，預設 0)
+    int queueDepth;           // --queue-depth (可選，預讀 ring 的批次數，預設 32)
+    std::string storeFile;    // --store (可選，增量分析的結果庫，只計算新增或改變的 site)
+};
+
+// extract 子命令的參數
+struct ExtractArgs {
+    std::string bamFile;      // -t 或 --tumor (必填)
+    std::string vcfFile;      // -v 或 --vcf (必填)
+    std::string cacheFile;    // -o 或 --output (必填)
+    std::string refFile;      // -r 或 --ref (CRAM 輸入時必填，用於重建序列)
+    int window;               // -w 或 --window (預設 2000，之後可分析此範圍以內的任意視窗)
+    int maxThreads;           // -j 或 --threads
+    int htsThreads;           // -@ 或 --hts-threads
+    std::string regions;      // --regions
+    bool passOnly;            // --pass-only
+    bool snvOnly;             // --snv-only
+};
+
+// merge 子命令的參數
+struct MergeArgs {
+    std::string outputFolder;              // -o 或 --output (可選，預設為當前目錄)
+    bool bgzip;                            // -z 或 --bgzip
+    std::vector<std::string> partialFiles; // 各分片的部分結果檔
+};
+
+// serve 子命令的參數：常駐並於 Unix socket 接受查詢
+struct ServeArgs {
+    std::string tumorBam;     // -t 或 --tumor (必填)
+    std::string normalBam;    // -n 或 --normal (可選)
+    std::string refFile;      // -r 或 --ref (可選)
+    std::string cramRefFile;  // --cram-ref (可選，未指定時使用 -r)
+    bool collapseStrands;     // --collapse-strands (可選，需 -r)
+    std::string socketPath;   // -s 或 --socket (必填)
+    int window;               // -w 或 --window (預設 2000)
+    int maxThreads;           // -j 或 --threads
+    int htsThreads;           // -@ 或 --hts-threads
+    int maxDepth;             // --max-depth (預設 0 不限制)
+};
+
+// query 子命令的參數：送出查詢至 serve 並輸出結果
+struct QueryArgs {
+    std::string socketPath;           // -s 或 --socket (必填)
+    bool header;                      // --header (先輸出欄位名稱)
+    bool ping;                        // --ping (只確認 serve 是否回應)
+    bool shutdown;                    // --shutdown (結束 serve)
+    std::vector<std::string> sites;   // chr:pos:ref:alt；未指定時由標準輸入讀取 (每列 chr pos ref alt)
 };
 
 class ArgParser {
 public:
     static Args parse(int argc, char* argv[]);
     static void printHelp(const char* progName);
+    // argv[1] 為 "merge"
+    static MergeArgs parseMerge(int argc, char* argv[]);
+    static void printMergeHelp(const char* progName);
+    // argv[1] 為 "extract"
+    static ExtractArgs parseExtract(int argc, char* argv[]);
+    static void printExtractHelp(const char* progName);
+    // argv[1] 為 "serve"
+    static ServeArgs parseServe(int argc, char* argv[]);
+    static void printServeHelp(const char* progName);
+    // argv[1] 為 "query"
+    static QueryArgs parseQuery(int argc, char* argv[]);
+    static void printQueryHelp(const char* progName);
     static void printArgs(const Args& args);
 };
 
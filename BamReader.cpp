@@ -0,0 +1,133 @@
+#include "BamReader.hpp"
+#include <iostream>
+#include <cstdlib>
+
+SharedHtsThreadPool::SharedHtsThreadPool(int nThreads) {
+    threadPool.pool = NULL;
+    threadPool.qsize = 0;
+    if (nThreads > 0) {
+        threadPool.pool = hts_tpool_init(nThreads);
+        if (!threadPool.pool)
+            std::cerr << "警告：無法建立 HTSlib 解壓縮執行緒池，改為單執行緒解壓縮" << std::endl;
+    }
+}
+
+SharedHtsThreadPool::~SharedHtsThreadPool() {
+    if (threadPool.pool)
+        hts_tpool_destroy(threadPool.pool);
+}
+
+BamReaderPool::BamReaderPool(const std::string &bamFile, int nReaders, int htsThreads,
+                             const CramOptions &cram)
+    : bamPath(bamFile), cramOptions(cram), ownsThreadPool(true), sharedRefs(NULL), openCram(0) {
+    threadPool.pool = NULL;
+    threadPool.qsize = 0;
+    // 所有 reader 共用同一組解壓縮執行緒，避免 reader 數 × 執行緒數的過度配置
+    if (htsThreads > 0) {
+        threadPool.pool = hts_tpool_init(htsThreads);
+        if (!threadPool.pool)
+            std::cerr << "警告：無法建立 HTSlib 解壓縮執行緒池，改為單執行緒解壓縮" << std::endl;
+    }
+
+    BamReader closed = {NULL, NULL, NULL};
+    readers.assign(nReaders, closed);
+    for (int i = 0; i < nReaders; i++)
+        open(i);
+}
+
+BamReaderPool::BamReaderPool(const std::string &bamFile, int nReaders, htsThreadPool *sharedPool,
+                             const CramOptions &cram)
+    : bamPath(bamFile), cramOptions(cram), ownsThreadPool(false), sharedRefs(NULL), openCram(0) {
+    threadPool.pool = sharedPool ? sharedPool->pool : NULL;
+    threadPool.qsize = sharedPool ? sharedPool->qsize : 0;
+    BamReader closed = {NULL, NULL, NULL};
+    readers.assign(nReaders, closed);
+}
+
+void BamReaderPool::open(int tid) {
+    BamReader &reader = readers[tid];
+    reader.file = sam_open(bamPath.c_str(), "r");
+    if (!reader.file) {
+        std::cerr << "錯誤：無法開啟 BAM/CRAM 檔案 " << bamPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (hts_get_format(reader.file)->format == cram)
+        setupCram(reader.file);
+    if (threadPool.pool)
+        hts_set_thread_pool(reader.file, &threadPool);
+    reader.header = sam_hdr_read(reader.file);
+    if (!reader.header) {
+        std::cerr << "錯誤：無法讀取 BAM/CRAM header " << bamPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    reader.index = sam_index_load(reader.file, bamPath.c_str());
+    if (!reader.index) {
+        std::cerr << "錯誤：無法載入 BAM/CRAM index (.bai/.csi/.crai) " << bamPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+//--------------------------------------------------
+// CRAM：以參考基因組重建序列，只解碼 flag、位置、CIGAR、序列與 aux 標籤 (MM/ML)，
+// 不解碼品質值與 MD/NM；未使用 --max-depth 的分析也不解碼 read 名稱
+// 參考序列由第一個 reader 載入，其餘 reader 共用，不會每個執行緒各載入一份
+//--------------------------------------------------
+void BamReaderPool::setupCram(samFile *file) {
+    int fields = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR | SAM_SEQ | SAM_AUX;
+    if (cramOptions.readNames)
+        fields |= SAM_QNAME;
+    if (hts_set_opt(file, CRAM_OPT_REQUIRED_FIELDS, fields) != 0 ||
+        hts_set_opt(file, CRAM_OPT_DECODE_MD, 0) != 0) {
+        std::cerr << "錯誤：無法設定 CRAM 解碼選項 " << bamPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // 多樣本時 reader 於平行迴圈中開啟與關閉
+    #pragma omp critical(cramRefs)
+    {
+        if (sharedRefs) {
+            if (hts_set_opt(file, CRAM_OPT_SHARED_REF, sharedRefs) != 0) {
+                std::cerr << "錯誤：無法共用 CRAM 參考序列 " << bamPath << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            if (cramOptions.refFile.empty()) {
+                std::cerr << "錯誤：CRAM 檔案 " << bamPath << " 須以 --cram-ref 或 -r 指定參考基因組" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (hts_set_fai_filename(file, cramOptions.refFile.c_str()) != 0) {
+                std::cerr << "錯誤：無法載入參考基因組 " << cramOptions.refFile << " 以解碼 " << bamPath << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            sharedRefs = cram_get_refs(file);
+        }
+        openCram++;
+    }
+}
+
+void BamReaderPool::release(int tid) {
+    BamReader &reader = readers[tid];
+    if (!reader.file)
+        return;
+    // 共用的參考序列隨最後一個 CRAM reader 關閉而釋放
+    if (hts_get_format(reader.file)->format == cram) {
+        #pragma omp critical(cramRefs)
+        {
+            if (--openCram == 0)
+                sharedRefs = NULL;
+        }
+    }
+    hts_idx_destroy(reader.index);
+    bam_hdr_destroy(reader.header);
+    sam_close(reader.file);
+    reader.file = NULL;
+    reader.header = NULL;
+    reader.index = NULL;
+}
+
+BamReaderPool::~BamReaderPool() {
+    for (int i = 0; i < size(); i++)
+        release(i);
+    // 執行緒池須在所有使用它的檔案關閉後才釋放
+    if (ownsThreadPool && threadPool.pool)
+        hts_tpool_destroy(threadPool.pool);
+}
@@ -0,0 +1,81 @@
+#ifndef BAM_READER_HPP
+#define BAM_READER_HPP
+
+#include "htslib/cram.h"
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+#include <string>
+#include <vector>
+
+// 單一執行緒專用的 BAM/CRAM 讀取器 (檔案、header 與 index)
+struct BamReader {
+    samFile   *file;
+    sam_hdr_t *header;
+    hts_idx_t *index;
+};
+
+// 多個 BamReaderPool 共用的解壓縮執行緒池，須比使用它的 pool 晚釋放
+class SharedHtsThreadPool {
+public:
+    explicit SharedHtsThreadPool(int nThreads);
+    ~SharedHtsThreadPool();
+    // 未建立執行緒池時回傳 NULL
+    htsThreadPool *get() { return threadPool.pool ? &threadPool : NULL; }
+
+private:
+    SharedHtsThreadPool(const SharedHtsThreadPool &);
+    SharedHtsThreadPool &operator=(const SharedHtsThreadPool &);
+
+    htsThreadPool threadPool;
+};
+
+// CRAM 輸入的解碼設定 (BAM 不使用)
+struct CramOptions {
+    std::string refFile;  // 重建序列用的參考基因組 (--cram-ref 或 -r)；CRAM 輸入時必填
+    bool readNames;       // 是否解碼 read 名稱 (--max-depth 與 extract 需要)
+    CramOptions() : readNames(true) {}
+};
+
+// 每個執行緒一組 BAM/CRAM 讀取器，只開啟一次並於所有 somatic site 間重複使用
+// CRAM 只解碼分析需要的欄位，同一 pool 的 reader 共用參考序列快取
+class BamReaderPool {
+public:
+    // nReaders：reader 數量 (對應 OpenMP 執行緒數)
+    // htsThreads：共用的 BGZF 解壓縮執行緒數 (0 表示不使用)
+    BamReaderPool(const std::string &bamFile, int nReaders, int htsThreads,
+                  const CramOptions &cram = CramOptions());
+    // 延遲開啟：reader 於第一次 get() 時才開啟，可用 release() 關閉 (可由多個執行緒同時呼叫)
+    // sharedPool：由呼叫端擁有、多個 pool 共用的解壓縮執行緒池 (可為 NULL)
+    BamReaderPool(const std::string &bamFile, int nReaders, htsThreadPool *sharedPool,
+                  const CramOptions &cram = CramOptions());
+    ~BamReaderPool();
+
+    // 取得第 tid 個執行緒的 reader，尚未開啟時先開啟
+    BamReader &get(int tid) {
+        if (!readers[tid].file)
+            open(tid);
+        return readers[tid];
+    }
+    // 關閉第 tid 個執行緒的 reader，釋放 header 與 index 的記憶體
+    void release(int tid);
+    int size() const { return static_cast<int>(readers.size()); }
+    const std::string &path() const { return bamPath; }
+
+private:
+    BamReaderPool(const BamReaderPool &);
+    BamReaderPool &operator=(const BamReaderPool &);
+
+    void open(int tid);
+    void setupCram(samFile *file);
+
+    std::string bamPath;
+    CramOptions cramOptions;
+    std::vector<BamReader> readers;
+    htsThreadPool threadPool;
+    bool ownsThreadPool;
+    // 第一個開啟的 CRAM reader 載入的參考序列，其餘 reader 共用 (依開啟中的 reader 數計數釋放)
+    refs_t *sharedRefs;
+    int openCram;
+};
+
+#endif // BAM_READER_HPP
@@ -0,0 +1,407 @@
+//--------------------------------------------------
+// 效能基準測試：產生合成資料，分別計時各分析階段
+// 結果輸出為 JSON 與 CSV，供比較不同版本的吞吐量 (reads/s、sites/s)
+//--------------------------------------------------
+#include "SyntheticData.hpp"
+#include "VCFHandler.hpp"
+#include "Analysis.hpp"
+#include "BamReader.hpp"
+#include "ReadDecoder.hpp"
+#include "SimdKernels.hpp"
+#include "OutputHandler.hpp"
+#include "Utility.hpp"
+#include "htslib/sam.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct BenchOptions {
+    std::string workFolder;  // 合成資料與暫存輸出的資料夾
+    std::string jsonFile;
+    std::string csvFile;
+    int threads;
+    int repeats;             // 每個階段重複次數，取最短時間
+    bool quick;              // 只執行最小的情境
+};
+
+// 單一情境：資料規模 + 分析視窗
+struct BenchScenario {
+    SyntheticConfig data;
+    int window;
+};
+
+// 單一計時結果
+struct BenchResult {
+    std::string scenario;
+    std::string stage;
+    double seconds;
+    long long items;
+    std::string unit;        // items 的單位 (reads、sites、rows)
+};
+
+static void printHelp(const char *progName) {
+    std::cout << "使用說明: " << progName << " [options]\n"
+              << "選項:\n"
+              << "  -o, --output <folder>  合成資料與輸出資料夾 (預設 './bench_data')\n"
+              << "  -j, --threads <num>    執行緒數 (預設使用最大值)\n"
+              << "  -n, --repeats <num>    每個階段重複次數，取最短時間 (預設 3)\n"
+              << "      --json <file>      JSON 結果檔 (預設 <output>/bench_results.json)\n"
+              << "      --csv <file>       CSV 結果檔 (預設 <output>/bench_results.csv)\n"
+              << "  -q, --quick            只執行最小的情境\n"
+              << "  -h, --help             顯示此訊息\n";
+}
+
+static BenchOptions parseOptions(int argc, char *argv[]) {
+    enum { OPT_JSON = 256, OPT_CSV };
+    BenchOptions options;
+    options.workFolder = "./bench_data";
+#ifdef _OPENMP
+    options.threads = omp_get_max_threads();
+#else
+    options.threads = 1;
+#endif
+    options.repeats = 3;
+    options.quick = false;
+
+    static struct option longOptions[] = {
+        {"output", required_argument, 0, 'o'},
+        {"threads", required_argument, 0, 'j'},
+        {"repeats", required_argument, 0, 'n'},
+        {"json", required_argument, 0, OPT_JSON},
+        {"csv", required_argument, 0, OPT_CSV},
+        {"quick", no_argument, 0, 'q'},
+        {"help", no_argument, 0, 'h'},
+        {0,0,0,0}
+    };
+    int optionChar;
+    int optionIndex = 0;
+    while ((optionChar = getopt_long(argc, argv, "o:j:n:qh", longOptions, &optionIndex)) != -1) {
+        switch (optionChar) {
+            case 'o': options.workFolder = optarg; break;
+            case 'j': options.threads = std::stoi(optarg); break;
+            case 'n': options.repeats = std::max(1, std::stoi(optarg)); break;
+            case OPT_JSON: options.jsonFile = optarg; break;
+            case OPT_CSV: options.csvFile = optarg; break;
+            case 'q': options.quick = true; break;
+            case 'h':
+                printHelp(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                printHelp(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (options.jsonFile.empty())
+        options.jsonFile = options.workFolder + "/bench_results.json";
+    if (options.csvFile.empty())
+        options.csvFile = options.workFolder + "/bench_results.csv";
+    return options;
+}
+
+// 情境組合：read 長度 × 深度 × site 密度 × 視窗
+static std::vector<BenchScenario> buildScenarios(bool quick) {
+    std::vector<BenchScenario> scenarios;
+    const int readLengths[] = {10000, 30000};
+    const int depths[] = {10, 30};
+    const int spacings[] = {20000, 1000};
+    const int windows[] = {500, 2000};
+    unsigned seed = 1;
+    for (int readLength : readLengths)
+        for (int depth : depths)
+            for (int spacing : spacings)
+                for (int window : windows) {
+                    BenchScenario scenario;
+                    scenario.data.contig = "chrSyn";
+                    scenario.data.contigLength = 2000000;
+                    scenario.data.readLength = readLength;
+                    scenario.data.depth = depth;
+                    scenario.data.siteSpacing = spacing;
+                    scenario.data.seed = seed;
+                    scenario.window = window;
+                    scenarios.push_back(scenario);
+                    if (quick) {
+                        scenarios.back().data.contigLength = 500000;
+                        scenarios.back().data.siteSpacing = 5000;
+                        return scenarios;
+                    }
+                }
+    return scenarios;
+}
+
+static std::string scenarioName(const BenchScenario &s) {
+    return "len" + std::to_string(s.data.readLength) + "_dp" + std::to_string(s.data.depth) +
+           "_sp" + std::to_string(s.data.siteSpacing) + "_w" + std::to_string(s.window);
+}
+
+static std::string datasetPrefix(const SyntheticConfig &c) {
+    return "syn_len" + std::to_string(c.readLength) + "_dp" + std::to_string(c.depth) +
+           "_sp" + std::to_string(c.siteSpacing) + "_L" + std::to_string(c.contigLength);
+}
+
+// 將整個 BAM 載入記憶體，使 read 層級的計時不含 I/O
+static std::vector<bam1_t *> loadReads(const std::string &bamPath) {
+    std::vector<bam1_t *> reads;
+    samFile *file = sam_open(bamPath.c_str(), "r");
+    if (!file) {
+        std::cerr << "錯誤：無法開啟 BAM 檔案 " << bamPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    sam_hdr_t *header = sam_hdr_read(file);
+    bam1_t *aln = bam_init1();
+    while (sam_read1(file, header, aln) >= 0) {
+        reads.push_back(aln);
+        aln = bam_init1();
+    }
+    bam_destroy1(aln);
+    bam_hdr_destroy(header);
+    sam_close(file);
+    return reads;
+}
+
+// 重複執行 repeats 次，回傳最短時間
+template <typename Func>
+static double bestOf(int repeats, Func func) {
+    double best = 0.0;
+    for (int r = 0; r < repeats; r++) {
+        Timer timer;
+        func();
+        double seconds = timer.stop();
+        if (r == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+static void runScenario(const BenchScenario &scenario, const SyntheticDataset &dataset,
+                        const std::vector<bam1_t *> &reads, const BenchOptions &options,
+                        std::vector<BenchResult> &results) {
+    const std::string name = scenarioName(scenario);
+    const long long nReads = static_cast<long long>(reads.size());
+    // 防止編譯器省略未使用的計算結果
+    volatile long long sink = 0;
+
+    // read 層級：單執行緒解碼
+    double seconds = bestOf(options.repeats, [&]() {
+        long long total = 0;
+        for (const bam1_t *aln : reads)
+            total += ReadDecoder::buildReadToRefMap(aln).size();
+        sink = sink + total;
+    });
+    results.push_back({name, "buildReadToRefMap", seconds, nReads, "reads"});
+
+    seconds = bestOf(options.repeats, [&]() {
+        long long total = 0;
+        for (const bam1_t *aln : reads)
+            total += ReadDecoder::parseMethylation(aln).size();
+        sink = sink + total;
+    });
+    results.push_back({name, "parseMethylation", seconds, nReads, "reads"});
+
+    seconds = bestOf(options.repeats, [&]() {
+        ModDecodeState state;
+        std::vector<MethylationRecord> calls;
+        long long total = 0;
+        for (const bam1_t *aln : reads) {
+            int sitePos = static_cast<int>(aln->core.pos) + 1;
+            char siteBase;
+            ReadDecoder::decodeRead(aln, &sitePos, 1, &siteBase,
+                                    sitePos - scenario.window, sitePos + scenario.window,
+                                    state, calls);
+            total += calls.size();
+        }
+        sink = sink + total;
+    });
+    results.push_back({name, "decodeRead", seconds, nReads, "reads"});
+
+    // SIMD 核心：依序強制使用 CPU 支援的各等級，解碼並加總每條 read 的 ML 值 (結果逐位元相同)
+    const SimdLevel detected = SimdKernels::detect();
+    for (int level = kSimdScalar; level <= detected; level++) {
+        SimdKernels::setLevel(static_cast<SimdLevel>(level));
+        seconds = bestOf(options.repeats, [&]() {
+            ModDecodeState state;
+            std::vector<MethylationRecord> calls;
+            unsigned long long total = 0;
+            for (const bam1_t *aln : reads) {
+                int sitePos = static_cast<int>(aln->core.pos) + 1;
+                char siteBase;
+                ReadDecoder::decodeRead(aln, &sitePos, 1, &siteBase,
+                                        sitePos - scenario.window, sitePos + scenario.window,
+                                        state, calls);
+                total += SimdKernels::sumQual(calls.data(), calls.data() + calls.size());
+            }
+            sink = sink + static_cast<long long>(total);
+        });
+        results.push_back({name, std::string("decodeRead_") + SimdKernels::levelName(static_cast<SimdLevel>(level)),
+                           seconds, nReads, "reads"});
+    }
+    SimdKernels::setLevel(detected);
+
+    // site 層級：完整分析流程 (含 BAM 讀取)
+    auto sites = VCFHandler::parseSomaticSites(dataset.vcfPath);
+    const long long nSites = static_cast<long long>(sites.size());
+    int nReaders = std::max(1, std::min(options.threads, static_cast<int>(sites.size())));
+    BamReaderPool readers(dataset.bamPath, nReaders, 0);
+    AnalysisOptions analysisOptions;
+    analysisOptions.window = scenario.window;
+    analysisOptions.verifyMods = false;
+    analysisOptions.reference = NULL;
+    analysisOptions.collapseStrands = false;
+    analysisOptions.profiler = NULL;
+    analysisOptions.maxDepth = 0;
+    analysisOptions.prefetchThreads = 0;
+    analysisOptions.queueDepth = 32;
+    analysisOptions.quiet = false;
+    AnalysisResult result;
+    for (int sweep = 0; sweep <= 1; sweep++) {
+        analysisOptions.sweep = (sweep == 1);
+        seconds = bestOf(options.repeats, [&]() {
+            result = Analysis::compute(sites, readers, NULL, analysisOptions);
+        });
+        results.push_back({name, sweep ? "compute_sweep" : "compute", seconds, nSites, "sites"});
+    }
+    // 完整分析流程改用純量核心，與 compute 比較 SIMD 的整體效益
+    analysisOptions.sweep = false;
+    SimdKernels::setLevel(kSimdScalar);
+    seconds = bestOf(options.repeats, [&]() {
+        Analysis::compute(sites, readers, NULL, analysisOptions);
+    });
+    SimdKernels::setLevel(detected);
+    results.push_back({name, "compute_scalar", seconds, nSites, "sites"});
+    // 預讀管線：每個計算執行緒搭配一個 I/O 執行緒
+    analysisOptions.prefetchThreads = nReaders;
+    seconds = bestOf(options.repeats, [&]() {
+        Analysis::compute(sites, readers, NULL, analysisOptions);
+    });
+    results.push_back({name, "compute_prefetch", seconds, nSites, "sites"});
+    analysisOptions.prefetchThreads = 0;
+
+    // BAM 與 CRAM (相同記錄)：循序讀取全部 read 與完整分析流程
+    // CRAM 只解碼分析需要的欄位，不含品質值、MD/NM 與 read 名稱
+    CramOptions cram;
+    cram.refFile = dataset.refPath;
+    cram.readNames = false;
+    const std::string formats[2] = {"bam", "cram"};
+    const std::string paths[2] = {dataset.bamPath, dataset.cramPath};
+    for (int f = 0; f < 2; f++) {
+        BamReaderPool scanner(paths[f], 1, 0, cram);
+        seconds = bestOf(options.repeats, [&]() {
+            BamReader &reader = scanner.get(0);
+            hts_itr_t *iter = sam_itr_queryi(reader.index, HTS_IDX_START, 0, 0);
+            bam1_t *aln = bam_init1();
+            long long total = 0;
+            while (iter && sam_itr_next(reader.file, iter, aln) >= 0)
+                total += aln->core.l_qseq;
+            bam_destroy1(aln);
+            hts_itr_destroy(iter);
+            sink = sink + total;
+        });
+        results.push_back({name, "scan_" + formats[f], seconds, nReads, "reads"});
+    }
+    BamReaderPool cramReaders(dataset.cramPath, nReaders, 0, cram);
+    seconds = bestOf(options.repeats, [&]() {
+        Analysis::compute(sites, cramReaders, NULL, analysisOptions);
+    });
+    results.push_back({name, "compute_cram", seconds, nSites, "sites"});
+
+    // 輸出：writeMethylAnaly 會原地排序，每次以原始順序的副本計時
+    const std::string outputFolder = options.workFolder + "/out_" + name;
+    seconds = bestOf(options.repeats, [&]() {
+        OutputHandler::writeSomaticAnaly(result.somaticData, result.contigNames, outputFolder, false);
+    });
+    results.push_back({name, "writeSomaticAnaly", seconds, nSites, "rows"});
+    double best = 0.0;
+    for (int r = 0; r < options.repeats; r++) {
+        MethylTable table = result.methylData;
+        Timer timer;
+        OutputHandler::writeMethylAnaly(table, result.contigNames, outputFolder, false);
+        double elapsed = timer.stop();
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+    results.push_back({name, "writeMethylAnaly", best, static_cast<long long>(result.methylData.size()), "rows"});
+}
+
+static bool writeJson(const std::string &filename, const BenchOptions &options,
+                      const std::vector<BenchResult> &results) {
+    FILE *fp = fopen(filename.c_str(), "w");
+    if (!fp)
+        return false;
+    fprintf(fp, "{\n  \"threads\": %d,\n  \"repeats\": %d,\n  \"results\": [\n",
+            options.threads, options.repeats);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        fprintf(fp, "    {\"scenario\": \"%s\", \"stage\": \"%s\", \"seconds\": %.6f, "
+                    "\"items\": %lld, \"unit\": \"%s\", \"throughput\": %.2f}%s\n",
+                r.scenario.c_str(), r.stage.c_str(), r.seconds, r.items, r.unit.c_str(),
+                r.seconds > 0 ? r.items / r.seconds : 0.0, (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    return fclose(fp) == 0;
+}
+
+static bool writeCsv(const std::string &filename, const std::vector<BenchResult> &results) {
+    FILE *fp = fopen(filename.c_str(), "w");
+    if (!fp)
+        return false;
+    fprintf(fp, "scenario,stage,seconds,items,unit,throughput\n");
+    for (const auto &r : results)
+        fprintf(fp, "%s,%s,%.6f,%lld,%s,%.2f\n", r.scenario.c_str(), r.stage.c_str(), r.seconds,
+                r.items, r.unit.c_str(), r.seconds > 0 ? r.items / r.seconds : 0.0);
+    return fclose(fp) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options = parseOptions(argc, argv);
+#ifdef _OPENMP
+    omp_set_num_threads(options.threads);
+#endif
+
+    std::vector<BenchResult> results;
+    std::string loadedPrefix;
+    SyntheticDataset dataset;
+    std::vector<bam1_t *> reads;
+    for (const auto &scenario : buildScenarios(options.quick)) {
+        // 同一組資料參數只產生與載入一次，不同視窗共用
+        std::string prefix = datasetPrefix(scenario.data);
+        if (prefix != loadedPrefix) {
+            for (bam1_t *aln : reads)
+                bam_destroy1(aln);
+            std::cout << "產生合成資料 " << prefix << "..." << std::endl;
+            dataset = SyntheticData::generate(scenario.data, options.workFolder, prefix);
+            reads = loadReads(dataset.bamPath);
+            loadedPrefix = prefix;
+            struct stat bamStat, cramStat;
+            if (stat(dataset.bamPath.c_str(), &bamStat) != 0 || stat(dataset.cramPath.c_str(), &cramStat) != 0) {
+                std::cerr << "錯誤：無法讀取合成資料 " << dataset.bamPath << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::cout << "  " << dataset.nReads << " 條 read, " << dataset.nBases << " bp, "
+                      << dataset.nSites << " 個 site; BAM " << bamStat.st_size << " bytes, CRAM "
+                      << cramStat.st_size << " bytes" << std::endl;
+        }
+        size_t first = results.size();
+        runScenario(scenario, dataset, reads, options, results);
+        for (size_t i = first; i < results.size(); i++) {
+            const BenchResult &r = results[i];
+            printf("%-32s %-20s %10.4f s %14.1f %s/s\n", r.scenario.c_str(), r.stage.c_str(),
+                   r.seconds, r.seconds > 0 ? r.items / r.seconds : 0.0, r.unit.c_str());
+        }
+    }
+    for (bam1_t *aln : reads)
+        bam_destroy1(aln);
+
+    if (!writeJson(options.jsonFile, options, results) || !writeCsv(options.csvFile, results)) {
+        std::cerr << "錯誤：無法寫入基準測試結果" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "結果已寫入 " << options.jsonFile << " 與 " << options.csvFile << std::endl;
+    return EXIT_SUCCESS;
+}
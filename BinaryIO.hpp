@@ -0,0 +1,74 @@
+#ifndef BINARY_IO_HPP
+#define BINARY_IO_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//--------------------------------------------------
+// 二進位讀寫：任何一次讀寫失敗後 ok() 即為 false
+// 分片部分結果與增量結果庫共用；數值以本機位元組順序讀寫
+//--------------------------------------------------
+class BinaryWriter {
+public:
+    explicit BinaryWriter(FILE *fp) : fp(fp), good(true) {}
+    void raw(const void *data, size_t size) {
+        if (good && size > 0 && fwrite(data, 1, size, fp) != size)
+            good = false;
+    }
+    template <typename T> void value(T v) { raw(&v, sizeof(v)); }
+    void string(const std::string &s) {
+        value(static_cast<uint32_t>(s.size()));
+        raw(s.data(), s.size());
+    }
+    template <typename T> void column(const std::vector<T> &v) { raw(v.data(), v.size() * sizeof(T)); }
+    bool ok() const { return good; }
+private:
+    FILE *fp;
+    bool good;
+};
+
+class BinaryReader {
+public:
+    explicit BinaryReader(FILE *fp) : fp(fp), good(true) {}
+    void raw(void *data, size_t size) {
+        if (good && size > 0 && fread(data, 1, size, fp) != size)
+            good = false;
+    }
+    template <typename T> T value() {
+        T v = T();
+        raw(&v, sizeof(v));
+        return v;
+    }
+    // 檔案剩餘的位元組數；長度欄位須先與此比較再配置，避免損壞的檔案造成過大的配置
+    uint64_t remaining() {
+        long here = ftell(fp);
+        if (!good || here < 0 || fseek(fp, 0, SEEK_END) != 0)
+            return 0;
+        long end = ftell(fp);
+        if (end < here || fseek(fp, here, SEEK_SET) != 0) {
+            good = false;
+            return 0;
+        }
+        return static_cast<uint64_t>(end - here);
+    }
+    std::string string() {
+        uint32_t size = value<uint32_t>();
+        std::string s;
+        if (good && size > remaining())
+            good = false;
+        if (good) {
+            s.resize(size);
+            raw(&s[0], size);
+        }
+        return s;
+    }
+    template <typename T> void column(std::vector<T> &v) { raw(v.data(), v.size() * sizeof(T)); }
+    bool ok() const { return good; }
+private:
+    FILE *fp;
+    bool good;
+};
+
+#endif // BINARY_IO_HPP
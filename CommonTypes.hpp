@@ -9,7 +9,8 @@ struct SomaticSite {
     std::string chr;
     int pos;         // 1-based
     std::string ref;
-    std::string alt;
+    std::string alt;     // 此列的 ALT allele (多 ALT 的記錄拆為每個 ALT 一列)
+    std::string alts;    // 記錄的所有 ALT (逗號分隔)，空字串表示只有 alt；決定 indel site 的 allele 標記
 };
 
 #endif // COMMON_TYPES_HPP 
\ No newline at end of file
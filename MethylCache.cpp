@@ -0,0 +1,367 @@
+#include "MethylCache.hpp"
+#include "BamReader.hpp"
+#include "ReadDecoder.hpp"
+#include "htslib/sam.h"
+#include <zlib.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <omp.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 快取檔的識別碼與格式版本；數值以本機位元組順序寫出，須於相同架構上讀取
+static const char kCacheMagic[8] = {'L', 'M', 'S', 'C', 'A', 'C', 'H', 'E'};
+static const uint32_t kCacheVersion = 2;
+
+// 檔案尾端：索引位置、索引筆數、識別碼
+struct CacheTrailer {
+    uint64_t indexOffset;
+    uint64_t nEntries;
+    char magic[8];
+};
+
+static bool statBam(const std::string &bamFile, uint64_t &size, int64_t &mtime) {
+    struct stat st;
+    if (stat(bamFile.c_str(), &st) != 0)
+        return false;
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtime);
+    return true;
+}
+
+template <typename T> static void appendValue(std::string &buf, T v) {
+    buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static void appendString(std::string &buf, const std::string &s) {
+    appendValue(buf, static_cast<uint32_t>(s.size()));
+    buf.append(s);
+}
+
+// 依序讀取 mmap 標頭的游標；越界後 ok 為 false
+struct HeaderCursor {
+    const uint8_t *pos;
+    const uint8_t *end;
+    bool ok;
+
+    template <typename T> T value() {
+        T v = T();
+        if (ok && static_cast<size_t>(end - pos) >= sizeof(v)) {
+            memcpy(&v, pos, sizeof(v));
+            pos += sizeof(v);
+        } else {
+            ok = false;
+        }
+        return v;
+    }
+    std::string string() {
+        uint32_t size = value<uint32_t>();
+        if (!ok || static_cast<size_t>(end - pos) < size) {
+            ok = false;
+            return std::string();
+        }
+        std::string s(reinterpret_cast<const char *>(pos), size);
+        pos += size;
+        return s;
+    }
+};
+
+//--------------------------------------------------
+// 單一位置擷取的 read 資料 (欄位式)，每個執行緒重複使用
+//--------------------------------------------------
+struct SiteColumns {
+    std::vector<uint64_t> nameHash;
+    std::vector<int32_t> readStart, readEnd;
+    std::vector<uint32_t> callCount;
+    std::vector<int32_t> callOffset;
+    std::vector<char> allele;
+    std::vector<uint8_t> callQual;
+
+    void clear() {
+        nameHash.clear();
+        readStart.clear();
+        readEnd.clear();
+        callCount.clear();
+        callOffset.clear();
+        allele.clear();
+        callQual.clear();
+    }
+    // 欄位依元素大小遞減排列，解壓縮至 8 位元組對齊的緩衝區後可直接存取
+    void pack(std::string &raw) const {
+        raw.clear();
+        raw.append(reinterpret_cast<const char *>(nameHash.data()), nameHash.size() * sizeof(uint64_t));
+        raw.append(reinterpret_cast<const char *>(readStart.data()), readStart.size() * sizeof(int32_t));
+        raw.append(reinterpret_cast<const char *>(readEnd.data()), readEnd.size() * sizeof(int32_t));
+        raw.append(reinterpret_cast<const char *>(callCount.data()), callCount.size() * sizeof(uint32_t));
+        raw.append(reinterpret_cast<const char *>(callOffset.data()), callOffset.size() * sizeof(int32_t));
+        raw.append(allele.data(), allele.size());
+        raw.append(reinterpret_cast<const char *>(callQual.data()), callQual.size());
+    }
+};
+
+static size_t payloadSize(uint32_t nReads, uint32_t nCalls) {
+    return static_cast<size_t>(nReads) * (sizeof(uint64_t) + 3 * sizeof(int32_t) + 1) +
+           static_cast<size_t>(nCalls) * (sizeof(int32_t) + 1);
+}
+
+// 讀取視窗 [pos - window, pos + window] 內的主對齊 read，依 BAM 順序存入 columns
+static void extractSite(BamReader &reader, int tid, int pos, int window,
+                        ModDecodeState &modState, std::vector<MethylationRecord> &calls,
+                        SiteColumns &columns) {
+    columns.clear();
+    int regionStart = (pos - window > 0) ? pos - window : 1;
+    hts_itr_t *iter = sam_itr_queryi(reader.index, tid, regionStart - 1, pos + window);
+    if (!iter)
+        return;
+    bam1_t *aln = bam_init1();
+    while (sam_itr_next(reader.file, iter, aln) >= 0) {
+        if ((aln->core.flag & BAM_FSECONDARY) || (aln->core.flag & BAM_FSUPPLEMENTARY))
+            continue;
+        char base;
+        // 記錄多保留視窗後一位，分析時以 --collapse-strands 合併至視窗內 C 的 G 也在快取中
+        ReadDecoder::decodeRead(aln, &pos, 1, &base, pos - window, pos + window + 1, modState, calls);
+        columns.nameHash.push_back(ReadDecoder::readNameHash(aln));
+        columns.readStart.push_back(static_cast<int32_t>(aln->core.pos) + 1);
+        columns.readEnd.push_back(static_cast<int32_t>(bam_endpos(aln)));
+        columns.callCount.push_back(static_cast<uint32_t>(calls.size()));
+        columns.allele.push_back(base);
+        for (const auto &rec : calls) {
+            columns.callOffset.push_back(rec.refPos - pos);
+            columns.callQual.push_back(static_cast<uint8_t>(rec.qual));
+        }
+    }
+    bam_destroy1(aln);
+    hts_itr_destroy(iter);
+}
+
+//--------------------------------------------------
+// 擷取：各位置平行讀取與壓縮，依 (contig, 位置) 順序寫出 (ordered)
+// 先寫入暫存檔，完成後才改名，中斷時不會留下不完整的快取
+//--------------------------------------------------
+bool MethylCache::extract(const std::vector<SomaticSite> &sites, BamReaderPool &readers,
+                          int window, const std::string &cacheFile) {
+    sam_hdr_t *header = readers.get(0).header;
+    std::vector<std::string> names;
+    for (int tid = 0; tid < sam_hdr_nref(header); tid++)
+        names.push_back(sam_hdr_tid2name(header, tid));
+
+    // 不重複的 (contig, 位置)；不在 BAM header 中的 contig 略過
+    std::vector<std::pair<int, int>> positions;
+    for (const auto &site : sites) {
+        int tid = sam_hdr_name2tid(header, site.chr.c_str());
+        if (tid >= 0)
+            positions.push_back(std::make_pair(tid, site.pos));
+    }
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+
+    uint64_t bamSize = 0;
+    int64_t bamMtime = 0;
+    if (!statBam(readers.path(), bamSize, bamMtime)) {
+        std::cerr << "錯誤：無法讀取 BAM 檔案資訊 " << readers.path() << std::endl;
+        return false;
+    }
+    const std::string tmpFile = cacheFile + ".tmp";
+    FILE *fp = fopen(tmpFile.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "錯誤：無法開啟檔案 " << tmpFile << " 進行輸出" << std::endl;
+        return false;
+    }
+    std::string head(kCacheMagic, sizeof(kCacheMagic));
+    appendValue(head, kCacheVersion);
+    appendValue(head, static_cast<int32_t>(window));
+    appendValue(head, bamSize);
+    appendValue(head, bamMtime);
+    appendString(head, readers.path());
+    appendValue(head, static_cast<uint32_t>(names.size()));
+    for (const auto &name : names)
+        appendString(head, name);
+    bool ok = fwrite(head.data(), 1, head.size(), fp) == head.size();
+    uint64_t offset = head.size();
+
+    std::vector<CacheSiteEntry> entries(positions.size());
+    uint64_t totalReads = 0, totalCalls = 0, rawBytes = 0;
+    const int nThreads = readers.size();
+    #pragma omp parallel num_threads(nThreads)
+    {
+        const int thread = omp_get_thread_num();
+        ModDecodeState modState;
+        std::vector<MethylationRecord> calls;
+        SiteColumns columns;
+        std::string raw;
+        std::vector<Bytef> compressed;
+
+        #pragma omp for schedule(dynamic) ordered
+        for (int p = 0; p < static_cast<int>(positions.size()); p++) {
+            extractSite(readers.get(thread), positions[p].first, positions[p].second, window,
+                        modState, calls, columns);
+            columns.pack(raw);
+            uLongf compressedSize = compressBound(raw.size());
+            compressed.resize(compressedSize);
+            int status = compress2(compressed.data(), &compressedSize,
+                                   reinterpret_cast<const Bytef *>(raw.data()), raw.size(),
+                                   Z_DEFAULT_COMPRESSION);
+            #pragma omp ordered
+            {
+                CacheSiteEntry &entry = entries[p];
+                entry.contig = positions[p].first;
+                entry.pos = positions[p].second;
+                entry.offset = offset;
+                entry.compressedSize = static_cast<uint32_t>(compressedSize);
+                entry.rawSize = static_cast<uint32_t>(raw.size());
+                entry.nReads = static_cast<uint32_t>(columns.nameHash.size());
+                entry.nCalls = static_cast<uint32_t>(columns.callQual.size());
+                if (status != Z_OK || fwrite(compressed.data(), 1, compressedSize, fp) != compressedSize)
+                    ok = false;
+                offset += compressedSize;
+                totalReads += entry.nReads;
+                totalCalls += entry.nCalls;
+                rawBytes += raw.size();
+            }
+        }
+    }
+
+    // 索引對齊至 8 位元組，mmap 後可直接以 CacheSiteEntry 陣列存取
+    static const char padding[8] = {0};
+    size_t pad = (8 - offset % 8) % 8;
+    if (pad > 0 && fwrite(padding, 1, pad, fp) != pad)
+        ok = false;
+    offset += pad;
+    CacheTrailer trailer;
+    trailer.indexOffset = offset;
+    trailer.nEntries = entries.size();
+    memcpy(trailer.magic, kCacheMagic, sizeof(kCacheMagic));
+    if (!entries.empty() && fwrite(entries.data(), sizeof(CacheSiteEntry), entries.size(), fp) != entries.size())
+        ok = false;
+    if (fwrite(&trailer, sizeof(trailer), 1, fp) != 1)
+        ok = false;
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok || rename(tmpFile.c_str(), cacheFile.c_str()) != 0) {
+        std::cerr << "錯誤：寫入快取檔 " << cacheFile << " 失敗" << std::endl;
+        remove(tmpFile.c_str());
+        return false;
+    }
+    std::cout << cacheFile << " 輸出完成 (" << entries.size() << " 個位置, " << totalReads
+              << " 筆 read, " << totalCalls << " 筆 5mC 記錄, 壓縮 " << rawBytes << " -> "
+              << offset - head.size() << " bytes)" << std::endl;
+    return true;
+}
+
+MethylCache::MethylCache()
+    : data(NULL), dataSize(0), extractWindow(0), bamSize(0), bamMtime(0), entries(NULL), nEntries(0) {}
+
+MethylCache::~MethylCache() {
+    if (data)
+        munmap(const_cast<uint8_t *>(data), dataSize);
+}
+
+bool MethylCache::open(const std::string &cacheFile) {
+    int fd = ::open(cacheFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "錯誤：無法開啟快取檔 " << cacheFile << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(kCacheMagic) + sizeof(CacheTrailer))) {
+        std::cerr << "錯誤：" << cacheFile << " 不是可辨識的快取檔" << std::endl;
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "錯誤：無法映射快取檔 " << cacheFile << std::endl;
+        return false;
+    }
+    data = static_cast<const uint8_t *>(mapped);
+    dataSize = static_cast<size_t>(st.st_size);
+
+    CacheTrailer trailer;
+    memcpy(&trailer, data + dataSize - sizeof(trailer), sizeof(trailer));
+    HeaderCursor cursor = {data + sizeof(kCacheMagic), data + dataSize - sizeof(trailer), true};
+    uint32_t version = cursor.value<uint32_t>();
+    if (memcmp(data, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+        memcmp(trailer.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || version != kCacheVersion ||
+        trailer.indexOffset % 8 != 0 ||
+        trailer.indexOffset + trailer.nEntries * sizeof(CacheSiteEntry) != dataSize - sizeof(trailer)) {
+        std::cerr << "錯誤：" << cacheFile << " 不是可辨識的快取檔或已損毀" << std::endl;
+        return false;
+    }
+    extractWindow = cursor.value<int32_t>();
+    bamSize = cursor.value<uint64_t>();
+    bamMtime = cursor.value<int64_t>();
+    sourceBam = cursor.string();
+    uint32_t nContigs = cursor.value<uint32_t>();
+    contigs.clear();
+    contigIds.clear();
+    for (uint32_t c = 0; c < nContigs && cursor.ok; c++) {
+        contigs.push_back(cursor.string());
+        contigIds[contigs.back()] = static_cast<int>(c);
+    }
+    if (!cursor.ok) {
+        std::cerr << "錯誤：快取檔 " << cacheFile << " 標頭不完整" << std::endl;
+        return false;
+    }
+    entries = reinterpret_cast<const CacheSiteEntry *>(data + trailer.indexOffset);
+    nEntries = trailer.nEntries;
+    return true;
+}
+
+bool MethylCache::matchesBam(const std::string &bamFile) const {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    return statBam(bamFile, size, mtime) && size == bamSize && mtime == bamMtime;
+}
+
+int MethylCache::contigId(const std::string &name) const {
+    auto it = contigIds.find(name);
+    return it == contigIds.end() ? -1 : it->second;
+}
+
+const CacheSiteEntry *MethylCache::find(int contig, int pos) const {
+    const CacheSiteEntry *end = entries + nEntries;
+    const CacheSiteEntry *it = std::lower_bound(entries, end, std::make_pair(contig, pos),
+        [](const CacheSiteEntry &entry, const std::pair<int, int> &key) {
+            return entry.contig != key.first ? entry.contig < key.first : entry.pos < key.second;
+        });
+    if (it == end || it->contig != contig || it->pos != pos)
+        return NULL;
+    return it;
+}
+
+bool MethylCache::load(const CacheSiteEntry &entry, std::vector<uint64_t> &buffer,
+                       CachedSiteView &view) const {
+    if (entry.rawSize != payloadSize(entry.nReads, entry.nCalls) ||
+        entry.offset + entry.compressedSize > dataSize)
+        return false;
+    buffer.resize(entry.rawSize / sizeof(uint64_t) + 1);
+    uLongf rawSize = entry.rawSize;
+    if (uncompress(reinterpret_cast<Bytef *>(buffer.data()), &rawSize,
+                   data + entry.offset, entry.compressedSize) != Z_OK || rawSize != entry.rawSize)
+        return false;
+
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(buffer.data());
+    const size_t n = entry.nReads;
+    const size_t m = entry.nCalls;
+    view.nReads = entry.nReads;
+    view.nCalls = entry.nCalls;
+    view.nameHash = reinterpret_cast<const uint64_t *>(p);
+    p += n * sizeof(uint64_t);
+    view.readStart = reinterpret_cast<const int32_t *>(p);
+    p += n * sizeof(int32_t);
+    view.readEnd = reinterpret_cast<const int32_t *>(p);
+    p += n * sizeof(int32_t);
+    view.callCount = reinterpret_cast<const uint32_t *>(p);
+    p += n * sizeof(uint32_t);
+    view.callOffset = reinterpret_cast<const int32_t *>(p);
+    p += m * sizeof(int32_t);
+    view.allele = reinterpret_cast<const char *>(p);
+    p += n;
+    view.callQual = p;
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef METHYL_CACHE_HPP
+#define METHYL_CACHE_HPP
+
+#include "CommonTypes.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class BamReaderPool;
+
+//--------------------------------------------------
+// 甲基化記錄快取
+// 對每個 somatic 位置保存視窗 (±window) 內所有主對齊 read 的資料：read 名稱雜湊、
+// 參考座標範圍、site 位置的鹼基，以及視窗內 (含視窗後一位) 的 5mC 記錄 (相對位置與 ML 值)。
+// 各位置的資料以欄位方式排列並以 zlib 壓縮；檔案尾端為依 (contig, 位置) 排序的索引。
+// 讀取時以 mmap 映射整個檔案，只解壓縮查詢到的位置
+//--------------------------------------------------
+
+// 索引項目 (32 bytes，8 位元組對齊)
+struct CacheSiteEntry {
+    int32_t  contig;          // contig ID (BAM header 順序)
+    int32_t  pos;             // 1-based
+    uint64_t offset;          // 壓縮資料在檔案中的位置
+    uint32_t compressedSize;
+    uint32_t rawSize;
+    uint32_t nReads;
+    uint32_t nCalls;
+};
+
+// 單一位置解壓縮後的欄位 (指向呼叫端提供的緩衝區)
+struct CachedSiteView {
+    uint32_t nReads;
+    uint32_t nCalls;
+    const uint64_t *nameHash;    // read 名稱雜湊
+    const int32_t  *readStart;   // 1-based
+    const int32_t  *readEnd;     // 1-based，含
+    const uint32_t *callCount;   // 每條 read 的記錄筆數
+    const int32_t  *callOffset;  // 記錄位置 - site 位置，每條 read 內遞增
+    const char     *allele;      // site 位置的鹼基 (未覆蓋為 'N')
+    const uint8_t  *callQual;    // ML 值
+};
+
+class MethylCache {
+public:
+    // 由 BAM 擷取 sites 所在位置 (重複位置只擷取一次) 的資料並寫入 cacheFile
+    static bool extract(const std::vector<SomaticSite> &sites, BamReaderPool &readers,
+                        int window, const std::string &cacheFile);
+
+    MethylCache();
+    ~MethylCache();
+    // 映射快取檔並讀取索引；失敗時輸出錯誤訊息並回傳 false
+    bool open(const std::string &cacheFile);
+    // 檢查 BAM 檔的大小與修改時間是否與擷取時相同
+    bool matchesBam(const std::string &bamFile) const;
+
+    int window() const { return extractWindow; }
+    const std::string &bamPath() const { return sourceBam; }
+    const std::vector<std::string> &contigNames() const { return contigs; }
+    // contig 名稱轉為 ID，不存在時回傳 -1
+    int contigId(const std::string &name) const;
+    // 依 (contig, 位置) 查詢，找不到時回傳 NULL
+    const CacheSiteEntry *find(int contig, int pos) const;
+    // 解壓縮單一位置至 buffer，並設定 view 指向各欄位
+    bool load(const CacheSiteEntry &entry, std::vector<uint64_t> &buffer, CachedSiteView &view) const;
+
+private:
+    MethylCache(const MethylCache &);
+    MethylCache &operator=(const MethylCache &);
+
+    const uint8_t *data;
+    size_t dataSize;
+    int extractWindow;
+    uint64_t bamSize;
+    int64_t bamMtime;
+    std::string sourceBam;
+    std::vector<std::string> contigs;
+    std::unordered_map<std::string, int> contigIds;
+    const CacheSiteEntry *entries;
+    uint64_t nEntries;
+};
+
+#endif // METHYL_CACHE_HPP
@@ -1,13 +1,21 @@
 #include "OutputHandler.hpp"
-#include <fstream>
+#include "Utility.hpp"
+#include "htslib/bgzf.h"
+#include "htslib/tbx.h"
+#include <cstdio>
 #include <iostream>
-#include <sstream>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// 每個格式化區塊的資料列數；各區塊平行格式化後依序寫出
+static const size_t kRowsPerChunk = 65536;
 
 // 建立輸出資料夾（跨平台）
-static void createDirectory(const std::string &folder) {
+void OutputHandler::createDirectory(const std::string &folder) {
 #ifdef _WIN32
     _mkdir(folder.c_str());
 #else
@@ -15,59 +23,264 @@ static void createDirectory(const std::string &folder) {
 #endif
 }
 
+// contig ID 轉為名稱，未分析的 site (-1) 輸出空白
+static const std::string &contigName(const std::vector<std::string> &contigNames, int contig) {
+    static const std::string empty;
+    return (contig >= 0) ? contigNames[contig] : empty;
+}
+
+//--------------------------------------------------
+// 輸出檔：一般文字檔以大區塊 fwrite 寫出，或經 BGZF 壓縮
+//--------------------------------------------------
+class OutputFile {
+public:
+    OutputFile() : fp(NULL), bgzf(NULL) {}
+    ~OutputFile() { close(); }
+
+    bool open(const std::string &filename, bool compress) {
+        if (compress) {
+            bgzf = bgzf_open(filename.c_str(), "w");
+            if (bgzf) {
+#ifdef _OPENMP
+                bgzf_mt(bgzf, omp_get_max_threads(), 256);
+#endif
+            }
+            return bgzf != NULL;
+        }
+        fp = fopen(filename.c_str(), "w");
+        if (fp)
+            setvbuf(fp, NULL, _IONBF, 0); // 呼叫端已累積大區塊，不需再經 stdio 緩衝
+        return fp != NULL;
+    }
+
+    bool write(const std::string &data) {
+        if (data.empty())
+            return true;
+        if (bgzf)
+            return bgzf_write(bgzf, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+        return fwrite(data.data(), 1, data.size(), fp) == data.size();
+    }
+
+    bool close() {
+        bool ok = true;
+        if (bgzf) {
+            ok = bgzf_close(bgzf) == 0;
+            bgzf = NULL;
+        }
+        if (fp) {
+            ok = fclose(fp) == 0;
+            fp = NULL;
+        }
+        return ok;
+    }
+
+private:
+    FILE *fp;
+    BGZF *bgzf;
+};
+
+std::string OutputHandler::somaticHeader(bool hasNormal, int maxDepth) {
+    std::string header = "chr\tPOS\tref\talt\tref_count\talt_count\tref_methyl\talt_methyl";
+    if (hasNormal)
+        header += "\tnormal_ref_count\tnormal_alt_count\tnormal_ref_methyl\tnormal_alt_methyl"
+                  "\tref_methyl_delta\talt_methyl_delta";
+    if (maxDepth > 0) {
+        header += "\tdepth\tcapped";
+        if (hasNormal)
+            header += "\tnormal_depth\tnormal_capped";
+    }
+    return header;
+}
+
+void OutputHandler::appendSomaticRow(std::string &buffer, const SomaticAnalyData &data,
+                                     const std::vector<std::string> &contigNames,
+                                     bool hasNormal, int maxDepth) {
+    buffer += contigName(contigNames, data.contig);
+    buffer += '\t';
+    appendInt(buffer, data.pos);
+    buffer += '\t';
+    buffer += data.ref;
+    buffer += '\t';
+    buffer += data.alt;
+    buffer += '\t';
+    appendInt(buffer, data.ref_count);
+    buffer += '\t';
+    appendInt(buffer, data.alt_count);
+    buffer += '\t';
+    appendDouble(buffer, data.ref_methyl);
+    buffer += '\t';
+    appendDouble(buffer, data.alt_methyl);
+    if (hasNormal) {
+        buffer += '\t';
+        appendInt(buffer, data.normal_ref_count);
+        buffer += '\t';
+        appendInt(buffer, data.normal_alt_count);
+        buffer += '\t';
+        appendDouble(buffer, data.normal_ref_methyl);
+        buffer += '\t';
+        appendDouble(buffer, data.normal_alt_methyl);
+        // 兩個 delta 皆以 normal 的 ref allele 甲基化作為基準 (同一位置的生殖系背景)：
+        // somatic site 上 normal 通常沒有 alt read，normal_alt_methyl 多為 0，不適合作為基準
+        buffer += '\t';
+        appendDouble(buffer, data.ref_methyl - data.normal_ref_methyl);
+        buffer += '\t';
+        appendDouble(buffer, data.alt_methyl - data.normal_ref_methyl);
+    }
+    // 深度超過 --max-depth 的 site 只以其中 maxDepth 條 read 統計
+    if (maxDepth > 0) {
+        buffer += '\t';
+        appendInt(buffer, data.depth);
+        buffer += (data.depth > maxDepth) ? "\t1" : "\t0";
+        if (hasNormal) {
+            buffer += '\t';
+            appendInt(buffer, data.normal_depth);
+            buffer += (data.normal_depth > maxDepth) ? "\t1" : "\t0";
+        }
+    }
+}
+
+void OutputHandler::appendMethylRow(std::string &buffer, const MethylTable &methylData, size_t i,
+                                    const std::vector<std::string> &contigNames) {
+    const uint64_t key = methylData.key[i];
+    buffer += contigNames[methylData.contig[i]];
+    buffer += '\t';
+    appendInt(buffer, methylKeyPos(key));
+    buffer += '\t';
+    appendInt(buffer, methylKeySomaticPos(key));
+    buffer += '\t';
+    buffer += methylKeyAllele(key);
+    buffer += '\t';
+    appendDouble(buffer, methylData.score(i));
+}
+
 // 輸出 somatic mutation 分析結果
 bool OutputHandler::writeSomaticAnaly(const std::vector<SomaticAnalyData> &somaticData,
-                                      const std::string &outputFolder) {
+                                      const std::vector<std::string> &contigNames,
+                                      const std::string &outputFolder,
+                                      bool hasNormal, int maxDepth) {
     createDirectory(outputFolder);
     std::string filename = outputFolder + "/Somatic_analy.txt";
-    std::ofstream ofs(filename);
-    if (!ofs) {
+    OutputFile file;
+    if (!file.open(filename, false)) {
         std::cerr << "錯誤：無法開啟檔案 " << filename << " 進行輸出" << std::endl;
         return false;
     }
-    ofs << "chr\tPOS\tref\talt\tref_count\talt_count\tref_methyl\talt_methyl\n";
+    std::string buffer = somaticHeader(hasNormal, maxDepth);
+    buffer += '\n';
     for (const auto &data : somaticData) {
-        ofs << data.chr << "\t" << data.pos << "\t" << data.ref << "\t"
-            << data.alt << "\t" << data.ref_count << "\t"
-            << data.alt_count << "\t" << data.ref_methyl << "\t"
-            << data.alt_methyl << "\n";
+        appendSomaticRow(buffer, data, contigNames, hasNormal, maxDepth);
+        buffer += '\n';
+    }
+    if (!file.write(buffer) || !file.close()) {
+        std::cerr << "錯誤：寫入檔案 " << filename << " 失敗" << std::endl;
+        return false;
     }
-    ofs.close();
     std::cout << "Somatic_analy.txt 輸出完成" << std::endl;
     return true;
 }
 
-// 輸出 methylation 分析結果
-bool OutputHandler::writeMethylAnaly(const std::vector<MethylAnalyData> &methylData,
-                                     const std::string &outputFolder) {
-    // 依染色體、位點、somatic 位點與 observed allele排序；methylation score 由高到低排列
-    std::vector<MethylAnalyData> sortedData = methylData;
-    std::sort(sortedData.begin(), sortedData.end(), [](const MethylAnalyData &a, const MethylAnalyData &b) {
-        if (a.chr != b.chr)
-            return a.chr < b.chr;
-        if (a.pos != b.pos)
-            return a.pos < b.pos;
-        if (a.somatic_pos != b.somatic_pos)
-            return a.somatic_pos < b.somatic_pos;
-        if (a.somatic_base != b.somatic_base)
-            return a.somatic_base < b.somatic_base;
-        return a.high_methyl > b.high_methyl;
+// 依 contig 名稱排序：先以名稱排名將資料分桶，再於各桶內以 64 位元 key 排序
+void OutputHandler::sortMethylTable(MethylTable &methylData,
+                                    const std::vector<std::string> &contigNames) {
+    const size_t nContigs = contigNames.size();
+    std::vector<int> byName(nContigs);
+    for (size_t c = 0; c < nContigs; c++)
+        byName[c] = static_cast<int>(c);
+    std::sort(byName.begin(), byName.end(), [&](int a, int b) {
+        return contigNames[a] < contigNames[b];
     });
+    std::vector<size_t> rank(nContigs);
+    for (size_t r = 0; r < nContigs; r++)
+        rank[byName[r]] = r;
+
+    // 計數排序：依名稱排名決定每個 contig 分桶的起點
+    std::vector<size_t> bucketStart(nContigs + 1, 0);
+    for (size_t i = 0; i < methylData.size(); i++)
+        bucketStart[rank[methylData.contig[i]] + 1]++;
+    for (size_t r = 0; r < nContigs; r++)
+        bucketStart[r + 1] += bucketStart[r];
+
+    // (key, qualSum << 32 | count) 連續存放，排序時只搬動 16 bytes
+    std::vector<std::pair<uint64_t, uint64_t>> packed(methylData.size());
+    {
+        std::vector<size_t> fill(bucketStart.begin(), bucketStart.end() - 1);
+        for (size_t i = 0; i < methylData.size(); i++) {
+            size_t dest = fill[rank[methylData.contig[i]]]++;
+            packed[dest].first = methylData.key[i];
+            packed[dest].second = (static_cast<uint64_t>(methylData.qualSum[i]) << 32) | methylData.count[i];
+        }
+    }
+
+    // 聚合後 key 不重複，各分桶可獨立平行排序
+    #pragma omp parallel for schedule(dynamic)
+    for (int r = 0; r < static_cast<int>(nContigs); r++) {
+        std::sort(packed.begin() + bucketStart[r], packed.begin() + bucketStart[r + 1],
+                  [](const std::pair<uint64_t, uint64_t> &a, const std::pair<uint64_t, uint64_t> &b) {
+                      return a.first < b.first;
+                  });
+    }
+
+    for (size_t r = 0; r < nContigs; r++) {
+        for (size_t i = bucketStart[r]; i < bucketStart[r + 1]; i++) {
+            methylData.contig[i] = byName[r];
+            methylData.key[i] = packed[i].first;
+            methylData.qualSum[i] = static_cast<uint32_t>(packed[i].second >> 32);
+            methylData.count[i] = static_cast<uint32_t>(packed[i].second);
+        }
+    }
+}
+
+// 輸出 methylation 分析結果
+bool OutputHandler::writeMethylAnaly(MethylTable &methylData,
+                                     const std::vector<std::string> &contigNames,
+                                     const std::string &outputFolder,
+                                     bool bgzip) {
+    // 依染色體、位點、somatic 位點與 observed allele 排序
+    sortMethylTable(methylData, contigNames);
 
     createDirectory(outputFolder);
-    std::string filename = outputFolder + "/methyl_analy.txt";
-    std::ofstream ofs(filename);
-    if (!ofs) {
+    std::string filename = outputFolder + (bgzip ? "/methyl_analy.txt.gz" : "/methyl_analy.txt");
+    OutputFile file;
+    if (!file.open(filename, bgzip)) {
         std::cerr << "錯誤：無法開啟檔案 " << filename << " 進行輸出" << std::endl;
         return false;
     }
-    ofs << "Methyl_Chr\tMethyl_POS\tSomatic_POS\tSomatic_Allele\tMethylation_Score\n";
-    for (const auto &data : sortedData) {
-        ofs << data.chr << "\t" << data.pos << "\t"
-            << data.somatic_pos << "\t" << data.somatic_base << "\t"
-            << data.high_methyl << "\n";
+    bool ok = file.write(kMethylHeader + std::string("\n"));
+
+    // 各執行緒格式化不同區塊，ordered 區段依區塊順序寫出
+    const long nChunks = static_cast<long>((methylData.size() + kRowsPerChunk - 1) / kRowsPerChunk);
+    #pragma omp parallel
+    {
+        std::string buffer;
+        #pragma omp for ordered schedule(static, 1)
+        for (long c = 0; c < nChunks; c++) {
+            buffer.clear();
+            const size_t begin = c * kRowsPerChunk;
+            const size_t end = std::min(begin + kRowsPerChunk, methylData.size());
+            for (size_t i = begin; i < end; i++) {
+                appendMethylRow(buffer, methylData, i, contigNames);
+                buffer += '\n';
+            }
+            #pragma omp ordered
+            {
+                if (ok && !file.write(buffer))
+                    ok = false;
+            }
+        }
+    }
+    if (!file.close() || !ok) {
+        std::cerr << "錯誤：寫入檔案 " << filename << " 失敗" << std::endl;
+        return false;
+    }
+
+    // 建立 tabix index：第 1 欄為 contig，第 2 欄為 1-based 位置，略過標題列
+    if (bgzip) {
+        tbx_conf_t conf = {TBX_GENERIC, 1, 2, 2, '#', 1};
+        if (tbx_index_build(filename.c_str(), 0, &conf) != 0) {
+            std::cerr << "錯誤：無法建立 tabix index " << filename << ".tbi" << std::endl;
+            return false;
+        }
     }
-    ofs.close();
     std::cout << "methyl_analy.txt 輸出完成" << std::endl;
     return true;
 }
@@ -5,14 +5,37 @@
 #include <vector>
 #include "Analysis.hpp"
 
+// methyl_analy.txt 的標題列
+static const char *const kMethylHeader = "Methyl_Chr\tMethyl_POS\tSomatic_POS\tSomatic_Allele\tMethylation_Score";
+
 class OutputHandler {
 public:
-    // 輸出 somatic 分析結果至 Somatic_analy.txt
+    // 建立輸出資料夾 (已存在時不做任何事)
+    static void createDirectory(const std::string &folder);
+    // 輸出 somatic 分析結果至 Somatic_analy.txt；hasNormal 時附加 normal 統計與甲基化差值欄位
+    // maxDepth > 0 時附加抽樣前的深度與是否抽樣 (capped) 欄位
     static bool writeSomaticAnaly(const std::vector<SomaticAnalyData> &somaticData,
-                                  const std::string &outputFolder);
-    // 輸出 CpG 甲基化分析結果至 methyl_analy.txt
-    static bool writeMethylAnaly(const std::vector<MethylAnalyData> &methylData,
-                                 const std::string &outputFolder);
+                                  const std::vector<std::string> &contigNames,
+                                  const std::string &outputFolder,
+                                  bool hasNormal, int maxDepth = 0);
+    // 輸出 CpG 甲基化分析結果至 methyl_analy.txt (methylData 會於原地排序)
+    // bgzip 為 true 時輸出 methyl_analy.txt.gz 並建立 tabix index
+    static bool writeMethylAnaly(MethylTable &methylData,
+                                 const std::vector<std::string> &contigNames,
+                                 const std::string &outputFolder,
+                                 bool bgzip);
+    // Somatic_analy.txt 的標題列與單一資料列 (不含換行)，serve 模式的回應使用相同格式
+    // ref_methyl_delta 與 alt_methyl_delta 皆減去 normal_ref_methyl
+    static std::string somaticHeader(bool hasNormal, int maxDepth);
+    static void appendSomaticRow(std::string &buffer, const SomaticAnalyData &data,
+                                 const std::vector<std::string> &contigNames,
+                                 bool hasNormal, int maxDepth);
+    // methyl_analy.txt 的第 i 列 (不含換行)
+    static void appendMethylRow(std::string &buffer, const MethylTable &methylData, size_t i,
+                                const std::vector<std::string> &contigNames);
+    // 依 contig 名稱、位點、somatic 位點與 allele 原地排序
+    static void sortMethylTable(MethylTable &methylData,
+                                const std::vector<std::string> &contigNames);
 };
 
 #endif // OUTPUT_HANDLER_HPP
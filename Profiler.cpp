@@ -0,0 +1,121 @@
+#include "Profiler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+// 工作耗時分布：第 k 個區間為 [2^(k-1), 2^k) 微秒 (第 0 個區間為 1 微秒以下)
+static const int kLatencyBuckets = 40;
+
+Profiler::Profiler(int nThreads) : threads(nThreads), latencies(nThreads) {}
+
+void Profiler::addStage(const std::string &name, double seconds) {
+    for (auto &stage : stages) {
+        if (stage.first == name) {
+            stage.second += seconds;
+            return;
+        }
+    }
+    stages.push_back(std::make_pair(name, seconds));
+}
+
+// JSON 字串跳脫 (contig 與樣本名稱)
+static std::string jsonString(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void writeThreadFields(FILE *fp, const ThreadProfile &p) {
+    fprintf(fp, "\"tasks\": %lld, \"reads_seen\": %lld, \"reads_skipped\": %lld, \"reads_downsampled\": %lld, "
+                "\"record_bytes\": %lld, \"calls_emitted\": %lld, \"query_seconds\": %.6f, "
+                "\"read_seconds\": %.6f, \"decode_seconds\": %.6f, \"accumulate_seconds\": %.6f, "
+                "\"lock_wait_seconds\": %.6f, \"merge_seconds\": %.6f, \"prefetch_wait_seconds\": %.6f, "
+                "\"backpressure_seconds\": %.6f",
+            p.tasks, p.readsSeen, p.readsSkipped, p.readsDownsampled, p.recordBytes, p.callsEmitted,
+            p.querySeconds, p.readSeconds, p.decodeSeconds, p.accumulateSeconds, p.lockWaitSeconds,
+            p.mergeSeconds, p.prefetchWaitSeconds, p.backpressureSeconds);
+}
+
+bool Profiler::writeJson(const std::string &filename, const std::vector<std::string> &sampleNames,
+                         const std::vector<std::string> &contigNames, int topN) const {
+    FILE *fp = fopen(filename.c_str(), "w");
+    if (!fp) {
+        std::cerr << "錯誤：無法開啟檔案 " << filename << " 進行輸出" << std::endl;
+        return false;
+    }
+    fprintf(fp, "{\n  \"threads\": %d,\n  \"stages\": {", static_cast<int>(threads.size()));
+    for (size_t s = 0; s < stages.size(); s++)
+        fprintf(fp, "%s\n    %s: %.6f", s ? "," : "", jsonString(stages[s].first).c_str(), stages[s].second);
+    fprintf(fp, "\n  },\n");
+
+    ThreadProfile total;
+    fprintf(fp, "  \"per_thread\": [\n");
+    for (size_t t = 0; t < threads.size(); t++) {
+        const ThreadProfile &p = threads[t];
+        fprintf(fp, "    {\"thread\": %d, ", static_cast<int>(t));
+        writeThreadFields(fp, p);
+        fprintf(fp, "}%s\n", (t + 1 < threads.size()) ? "," : "");
+        total.tasks += p.tasks;
+        total.readsSeen += p.readsSeen;
+        total.readsSkipped += p.readsSkipped;
+        total.readsDownsampled += p.readsDownsampled;
+        total.recordBytes += p.recordBytes;
+        total.callsEmitted += p.callsEmitted;
+        total.querySeconds += p.querySeconds;
+        total.readSeconds += p.readSeconds;
+        total.decodeSeconds += p.decodeSeconds;
+        total.accumulateSeconds += p.accumulateSeconds;
+        total.lockWaitSeconds += p.lockWaitSeconds;
+        total.mergeSeconds += p.mergeSeconds;
+        total.prefetchWaitSeconds += p.prefetchWaitSeconds;
+        total.backpressureSeconds += p.backpressureSeconds;
+    }
+    fprintf(fp, "  ],\n  \"totals\": {");
+    writeThreadFields(fp, total);
+    fprintf(fp, "},\n");
+
+    std::vector<TaskLatency> all;
+    for (const auto &perThread : latencies)
+        all.insert(all.end(), perThread.begin(), perThread.end());
+    std::vector<long long> histogram(kLatencyBuckets, 0);
+    for (const auto &task : all) {
+        double micros = task.seconds * 1e6;
+        int bucket = (micros < 1.0) ? 0 : static_cast<int>(std::floor(std::log2(micros))) + 1;
+        histogram[std::min(bucket, kLatencyBuckets - 1)]++;
+    }
+    int lastBucket = kLatencyBuckets - 1;
+    while (lastBucket > 0 && histogram[lastBucket] == 0)
+        lastBucket--;
+    fprintf(fp, "  \"latency_histogram\": {\"unit\": \"microseconds\", \"buckets\": [");
+    for (int b = 0; b <= lastBucket; b++)
+        fprintf(fp, "%s\n    {\"lt\": %.0f, \"count\": %lld}", b ? "," : "", std::ldexp(1.0, b), histogram[b]);
+    fprintf(fp, "\n  ]},\n");
+
+    // 最慢的工作依耗時遞減
+    const size_t nTop = std::min(all.size(), static_cast<size_t>(std::max(0, topN)));
+    std::partial_sort(all.begin(), all.begin() + nTop, all.end(),
+                      [](const TaskLatency &a, const TaskLatency &b) { return a.seconds > b.seconds; });
+    fprintf(fp, "  \"slowest\": [");
+    for (size_t i = 0; i < nTop; i++) {
+        const TaskLatency &task = all[i];
+        const std::string sample = (task.sample < static_cast<int>(sampleNames.size())) ? sampleNames[task.sample] : "";
+        const std::string contig = (task.contig >= 0 && task.contig < static_cast<int>(contigNames.size()))
+                                   ? contigNames[task.contig] : "";
+        fprintf(fp, "%s\n    {\"sample\": %s, \"bam\": \"%s\", \"contig\": %s, \"first_pos\": %d, \"last_pos\": %d, "
+                    "\"sites\": %d, \"reads\": %lld, \"seconds\": %.6f}",
+                i ? "," : "", jsonString(sample).c_str(), task.normal ? "normal" : "tumor",
+                jsonString(contig).c_str(), task.firstPos, task.lastPos, task.nSites, task.reads, task.seconds);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fclose(fp) != 0) {
+        std::cerr << "錯誤：寫入檔案 " << filename << " 失敗" << std::endl;
+        return false;
+    }
+    std::cout << filename << " 輸出完成 (" << all.size() << " 個工作)" << std::endl;
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <string>
+#include <utility>
+#include <vector>
+
+//--------------------------------------------------
+// --profile 效能剖析
+// 每個執行緒只累加自己的計數器 (以 padding 隔開 cache line)，平行區段中不需同步；
+// 未啟用時分析流程不呼叫任何計時函式
+//--------------------------------------------------
+
+// 單一執行緒的計數與各階段累計時間 (秒)
+struct ThreadProfile {
+    long long tasks = 0;
+    long long readsSeen = 0;       // 迭代器回傳的 read 數
+    long long readsSkipped = 0;    // 非主對齊、不在本段或未覆蓋任何 site 視窗的 read
+    long long readsDownsampled = 0; // --max-depth 未被任何 site 保留而不解碼的 read
+    long long recordBytes = 0;     // 解壓縮後的 BAM 記錄位元組數
+    long long callsEmitted = 0;    // 解碼輸出 (視窗內，CpG 篩選後) 的 5mC 記錄數
+    double querySeconds = 0.0;     // 建立 index 迭代器
+    double readSeconds = 0.0;      // sam_itr_next (含 BGZF 解壓縮)
+    double decodeSeconds = 0.0;    // CIGAR 與 MM/ML 解碼 (快取模式為解壓縮)
+    double accumulateSeconds = 0.0; // 累加至 site 統計與視窗聚合表
+    double lockWaitSeconds = 0.0;  // 等待分段合併的 critical 區段
+    double mergeSeconds = 0.0;     // 合併分段結果
+    double prefetchWaitSeconds = 0.0; // 計算執行緒等待預讀批次 (--prefetch-threads)
+    double backpressureSeconds = 0.0; // I/O 執行緒因 ring 已滿而等待空批次
+    char padding[64];              // 相鄰執行緒的計數器不共用 cache line
+};
+
+// 單一工作 (一個區塊，未使用 --sweep 時即一個 site) 的耗時
+struct TaskLatency {
+    int sample;
+    bool normal;
+    int contig;
+    int firstPos;
+    int lastPos;
+    int nSites;
+    long long reads;
+    double seconds;
+};
+
+class Profiler {
+public:
+    // nThreads：計算執行緒數加上預讀的 I/O 執行緒數 (I/O 執行緒排在後面)
+    explicit Profiler(int nThreads);
+
+    ThreadProfile &thread(int t) { return threads[t]; }
+    // 由執行緒 t 記錄一個工作的耗時
+    void recordTask(int t, const TaskLatency &latency) { latencies[t].push_back(latency); }
+    // 累加階段耗時 (只由主執行緒呼叫)，報告依首次加入的順序列出
+    void addStage(const std::string &name, double seconds);
+
+    // 輸出 JSON 報告：各階段耗時、各執行緒計數、工作耗時分布與最慢的 topN 個工作
+    bool writeJson(const std::string &filename, const std::vector<std::string> &sampleNames,
+                   const std::vector<std::string> &contigNames, int topN) const;
+
+private:
+    std::vector<ThreadProfile> threads;
+    std::vector<std::vector<TaskLatency>> latencies;
+    std::vector<std::pair<std::string, double>> stages;
+};
+
+#endif // PROFILER_HPP
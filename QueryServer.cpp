@@ -0,0 +1,460 @@
+#include "QueryServer.hpp"
+#include "Analysis.hpp"
+#include "BamReader.hpp"
+#include "OutputHandler.hpp"
+#include "ReferenceGenome.hpp"
+#include "Utility.hpp"
+#include "VCFHandler.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <unordered_map>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// 尚未收到換行的請求列上限，超過時視為錯誤的用戶端並關閉連線
+static const size_t kMaxPendingBytes = 1 << 20;
+
+// SIGINT/SIGTERM：事件迴圈於 poll 中斷後結束
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleStopSignal(int) {
+    stopRequested = 1;
+}
+
+// 填入 Unix socket 位址；路徑超過 sun_path 長度時回傳 false
+static bool socketAddress(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "錯誤：socket 路徑過長 (" << path << ")" << std::endl;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// 完整寫出 data；對方已關閉連線時回傳 false (不產生 SIGPIPE)
+static bool sendAll(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static void splitFields(const std::string &line, std::vector<std::string> &fields) {
+    fields.clear();
+    std::istringstream stream(line);
+    std::string field;
+    while (stream >> field)
+        fields.push_back(field);
+}
+
+//--------------------------------------------------
+// serve 端
+//--------------------------------------------------
+
+// 常駐的分析狀態
+struct ServeState {
+    std::vector<SampleInput> inputs;
+    AnalysisOptions options;
+    bool hasNormal;
+    int maxDepth;
+};
+
+// 一個連線：未處理完的輸入與目前累積的批次
+struct Connection {
+    int fd;
+    std::string input;
+    std::vector<SomaticSite> sites;
+    std::string error;   // 批次中第一個錯誤，分析時改回傳 ERR
+    int lineNumber;
+};
+
+// 分析一批 site 並附加 S/M 資料列與 OK 列至 response
+static void answerBatch(const ServeState &state, const std::vector<SomaticSite> &sites, std::string &response) {
+    Timer timer;
+    std::vector<AnalysisResult> results = Analysis::computeSamples(sites, state.inputs, state.options);
+    const AnalysisResult &result = results[0];
+
+    // methylSiteKey 相同的 site 只分析一次，每個 site 皆附上第一個相同 site 的資料列，依位點與 allele 排列
+    const MethylTable &methyl = result.methylData;
+    std::unordered_map<std::string, size_t> firstSite;
+    std::vector<size_t> order;
+    for (size_t k = 0; k < result.somaticData.size(); k++) {
+        const SomaticAnalyData &row = result.somaticData[k];
+        response += "S\t";
+        OutputHandler::appendSomaticRow(response, row, result.contigNames, state.hasNormal, state.maxDepth);
+        response += '\n';
+        if (row.contig < 0)
+            continue;
+        const size_t source = firstSite.emplace(Analysis::methylSiteKey(sites[k]), k).first->second;
+        const MethylRange &range = result.siteMethyl[source];
+        order.resize(range.count);
+        for (size_t m = 0; m < order.size(); m++)
+            order[m] = range.offset + m;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return methyl.key[a] < methyl.key[b]; });
+        for (size_t m : order) {
+            response += "M\t";
+            OutputHandler::appendMethylRow(response, methyl, m, result.contigNames);
+            response += '\n';
+        }
+    }
+    const double milliseconds = timer.stop() * 1000.0;
+    response += "OK\t";
+    appendInt(response, static_cast<long long>(sites.size()));
+    response += '\t';
+    appendDouble(response, milliseconds);
+    response += '\n';
+    std::cout << "查詢: " << sites.size() << " 個 site, " << milliseconds << " 毫秒" << std::endl;
+}
+
+// 檢查查詢的 contig 與位置，回傳錯誤訊息 (空字串表示可分析)
+// 位置不可超出 contig 長度 (視窗座標不致溢位)；使用 -r 時，BAM 中的 contig 須存在於參考基因組
+static std::string siteProblem(const ServeState &state, const std::string &chr, long pos) {
+    if (pos > INT_MAX - state.options.window)
+        return "位置 " + std::to_string(pos) + " 超出範圍";
+    sam_hdr_t *header = state.inputs[0].tumor->get(0).header;
+    const int tid = sam_hdr_name2tid(header, chr.c_str());
+    // 不在 BAM header 中的 contig 不分析，結果維持空白
+    if (tid < 0)
+        return "";
+    if (pos > sam_hdr_tid2len(header, tid))
+        return "位置 " + std::to_string(pos) + " 超出 contig " + chr + " 的長度";
+    if (state.options.reference && state.options.reference->contigId(chr) < 0)
+        return "參考基因組中沒有 contig " + chr;
+    return "";
+}
+
+// 處理一列請求；回傳 false 表示關閉此連線，shutdown 設為 true 表示結束服務
+static bool handleLine(const ServeState &state, Connection &conn, std::string line, bool &shutdown) {
+    if (!line.empty() && line[line.size() - 1] == '\r')
+        line.erase(line.size() - 1);
+    conn.lineNumber++;
+    std::string response;
+    if (line.empty()) {
+        if (!conn.error.empty()) {
+            response = "ERR\t" + conn.error + "\n";
+        } else if (conn.sites.empty()) {
+            response = "OK\t0\t0\n";
+        } else {
+            answerBatch(state, conn.sites, response);
+        }
+        conn.sites.clear();
+        conn.error.clear();
+        return sendAll(conn.fd, response);
+    }
+    if (line == "PING")
+        return sendAll(conn.fd, "OK\tPONG\n");
+    if (line == "HEADER") {
+        response = "S\t" + OutputHandler::somaticHeader(state.hasNormal, state.maxDepth) + "\n";
+        response += std::string("M\t") + kMethylHeader + "\n";
+        response += "OK\t0\t0\n";
+        return sendAll(conn.fd, response);
+    }
+    if (line == "QUIT")
+        return false;
+    if (line == "SHUTDOWN") {
+        shutdown = true;
+        sendAll(conn.fd, "OK\tSHUTDOWN\n");
+        return false;
+    }
+
+    std::vector<std::string> fields;
+    splitFields(line, fields);
+    char *end = NULL;
+    long pos = 0;
+    if (fields.size() == 4) {
+        errno = 0;
+        pos = strtol(fields[1].c_str(), &end, 10);
+    }
+    if (fields.size() != 4 || *end != '\0' || errno != 0 || pos < 1 || pos > INT_MAX) {
+        // 只記錄第一個錯誤，批次結束時回傳
+        if (conn.error.empty())
+            conn.error = "第 " + std::to_string(conn.lineNumber) + " 列格式錯誤，應為 <chr> <pos> <ref> <alt>: " + line;
+        return true;
+    }
+    const std::string problem = siteProblem(state, fields[0], pos);
+    if (!problem.empty()) {
+        if (conn.error.empty())
+            conn.error = "第 " + std::to_string(conn.lineNumber) + " 列，" + problem + ": " + line;
+        return true;
+    }
+    // 多個 ALT (逗號分隔) 與 VCF 相同，拆為每個 ALT 一個 site
+    VCFHandler::appendSites(fields[0], static_cast<int>(pos), fields[2], fields[3], false, conn.sites);
+    return true;
+}
+
+// 建立並監聽 socket；路徑上殘留的 socket 檔 (前一次未正常結束) 先移除，使用中則回傳錯誤
+static int listenSocket(const std::string &path) {
+    sockaddr_un addr;
+    if (!socketAddress(path, addr))
+        return -1;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool inUse = S_ISSOCK(st.st_mode) && probe >= 0 &&
+                     connect(probe, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (inUse || !S_ISSOCK(st.st_mode)) {
+            std::cerr << "錯誤：" << path << (inUse ? " 已有 serve 使用中" : " 已存在且不是 socket") << std::endl;
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        std::cerr << "錯誤：無法於 " << path << " 建立 socket: " << strerror(errno) << std::endl;
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int QueryServer::serve(const ServeArgs &args) {
+#ifdef _OPENMP
+    omp_set_num_threads(args.maxThreads);
+#endif
+    // 所有 reader 於啟動時開啟，之後的查詢不再載入 header 與 index
+    std::cout << "開始載入 BAM index..." << std::endl;
+    Timer readerTimer;
+    CramOptions cram;
+    cram.refFile = args.cramRefFile.empty() ? args.refFile : args.cramRefFile;
+    cram.readNames = (args.maxDepth > 0);
+    std::unique_ptr<BamReaderPool> tumor(new BamReaderPool(args.tumorBam, args.maxThreads, args.htsThreads, cram));
+    std::unique_ptr<BamReaderPool> normal;
+    if (!args.normalBam.empty())
+        normal.reset(new BamReaderPool(args.normalBam, args.maxThreads, args.htsThreads, cram));
+    ReferenceGenome reference;
+    if (!args.refFile.empty() && !reference.open(args.refFile))
+        return EXIT_FAILURE;
+    std::cout << "BAM index 載入耗時: " << readerTimer.stop() << " 秒, 共 "
+              << args.maxThreads << " 個 reader" << std::endl;
+
+    ServeState state;
+    SampleInput input;
+    input.tumor = tumor.get();
+    input.normal = normal.get();
+    state.inputs.push_back(input);
+    state.options.window = args.window;
+    state.options.sweep = true;
+    state.options.verifyMods = false;
+    state.options.reference = args.refFile.empty() ? NULL : &reference;
+    state.options.collapseStrands = args.collapseStrands;
+    state.options.profiler = NULL;
+    state.options.maxDepth = args.maxDepth;
+    state.options.prefetchThreads = 0;
+    state.options.queueDepth = 32;
+    state.options.quiet = true;
+    state.hasNormal = static_cast<bool>(normal);
+    state.maxDepth = args.maxDepth;
+
+    int listenFd = listenSocket(args.socketPath);
+    if (listenFd < 0)
+        return EXIT_FAILURE;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    std::cout << "serve 於 " << args.socketPath << " 等待查詢 (-w " << args.window << ")" << std::endl;
+
+    std::vector<Connection> connections;
+    std::vector<pollfd> fds;
+    bool shutdown = false;
+    char chunk[65536];
+    while (!shutdown && !stopRequested) {
+        fds.clear();
+        fds.push_back(pollfd{listenFd, POLLIN, 0});
+        for (const auto &conn : connections)
+            fds.push_back(pollfd{conn.fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "錯誤：poll 失敗: " << strerror(errno) << std::endl;
+            break;
+        }
+        // 先處理既有連線 (fds 與 connections 依序對應)，再接受新連線
+        std::vector<char> closing(connections.size(), 0);
+        for (size_t c = 0; c < connections.size() && !shutdown; c++) {
+            if (!fds[c + 1].revents)
+                continue;
+            Connection &conn = connections[c];
+            ssize_t n = read(conn.fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                closing[c] = 1;
+                continue;
+            }
+            conn.input.append(chunk, static_cast<size_t>(n));
+            size_t begin = 0, newline;
+            bool open = true;
+            while (open && !shutdown && (newline = conn.input.find('\n', begin)) != std::string::npos) {
+                open = handleLine(state, conn, conn.input.substr(begin, newline - begin), shutdown);
+                begin = newline + 1;
+            }
+            conn.input.erase(0, begin);
+            if (conn.input.size() > kMaxPendingBytes) {
+                sendAll(conn.fd, "ERR\t請求列過長\n");
+                open = false;
+            }
+            if (!open)
+                closing[c] = 1;
+        }
+        for (size_t c = connections.size(); c-- > 0;) {
+            if (closing[c] || shutdown) {
+                close(connections[c].fd);
+                connections.erase(connections.begin() + c);
+            }
+        }
+        if (!shutdown && (fds[0].revents & POLLIN)) {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd >= 0)
+                connections.push_back(Connection{fd, std::string(), std::vector<SomaticSite>(), std::string(), 0});
+        }
+    }
+    for (const auto &conn : connections)
+        close(conn.fd);
+    close(listenFd);
+    unlink(args.socketPath.c_str());
+    std::cout << "serve 結束" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+//--------------------------------------------------
+// query 端
+//--------------------------------------------------
+
+// chr:pos:ref:alt 或 "chr pos ref alt" 轉為請求列；chr 可含 ':'，由右側切分
+static bool siteRequest(const std::string &text, std::string &request) {
+    std::vector<std::string> fields;
+    splitFields(text, fields);
+    if (fields.size() == 1) {
+        const std::string spec = fields[0];
+        size_t altColon = spec.rfind(':');
+        size_t refColon = (altColon == std::string::npos || altColon == 0) ? std::string::npos
+                                                                           : spec.rfind(':', altColon - 1);
+        size_t posColon = (refColon == std::string::npos || refColon == 0) ? std::string::npos
+                                                                           : spec.rfind(':', refColon - 1);
+        if (posColon == std::string::npos)
+            return false;
+        fields.assign(1, spec.substr(0, posColon));
+        fields.push_back(spec.substr(posColon + 1, refColon - posColon - 1));
+        fields.push_back(spec.substr(refColon + 1, altColon - refColon - 1));
+        fields.push_back(spec.substr(altColon + 1));
+    }
+    if (fields.size() != 4)
+        return false;
+    request += fields[0] + '\t' + fields[1] + '\t' + fields[2] + '\t' + fields[3] + '\n';
+    return true;
+}
+
+int QueryServer::query(const QueryArgs &args) {
+    // 組合請求：每個請求各有一個 OK/ERR 回應
+    std::string request;
+    int nReplies = 0;
+    if (args.ping) {
+        request += "PING\n";
+        nReplies++;
+    }
+    if (args.shutdown) {
+        request += "SHUTDOWN\n";
+        nReplies++;
+    }
+    if (!args.ping && !args.shutdown) {
+        if (args.header) {
+            request += "HEADER\n";
+            nReplies++;
+        }
+        std::vector<std::string> specs = args.sites;
+        if (specs.empty()) {
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                if (!line.empty() && line[0] != '#' && line.find_first_not_of(" \t\r") != std::string::npos)
+                    specs.push_back(line);
+            }
+        }
+        for (const auto &spec : specs) {
+            if (!siteRequest(spec, request)) {
+                std::cerr << "錯誤：無法解析 site '" << spec << "'，應為 chr:pos:ref:alt 或 <chr> <pos> <ref> <alt>" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        request += "\n";
+        nReplies++;
+    }
+
+    sockaddr_un addr;
+    if (!socketAddress(args.socketPath, addr))
+        return EXIT_FAILURE;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "錯誤：無法連線至 " << args.socketPath << ": " << strerror(errno) << std::endl;
+        if (fd >= 0)
+            close(fd);
+        return EXIT_FAILURE;
+    }
+    if (!sendAll(fd, request)) {
+        std::cerr << "錯誤：送出查詢失敗" << std::endl;
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    // S/M 資料列 (保留前綴以區分兩種資料列) 輸出至標準輸出，OK/ERR 列輸出至標準錯誤
+    std::string buffer, output;
+    char chunk[65536];
+    bool ok = true;
+    while (nReplies > 0) {
+        size_t newline = buffer.find('\n');
+        if (newline == std::string::npos) {
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                std::cerr << "錯誤：serve 提前關閉連線" << std::endl;
+                ok = false;
+                break;
+            }
+            buffer.append(chunk, static_cast<size_t>(n));
+            continue;
+        }
+        const std::string line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        if (line.compare(0, 2, "S\t") == 0 || line.compare(0, 2, "M\t") == 0) {
+            output += line;
+            output += '\n';
+        } else if (line.compare(0, 3, "OK\t") == 0) {
+            nReplies--;
+            std::cerr << line << std::endl;
+        } else {
+            nReplies--;
+            std::cerr << "錯誤：" << (line.compare(0, 4, "ERR\t") == 0 ? line.substr(4) : line) << std::endl;
+            ok = false;
+        }
+    }
+    close(fd);
+    std::cout << output;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
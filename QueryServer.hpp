@@ -0,0 +1,32 @@
+#ifndef QUERY_SERVER_HPP
+#define QUERY_SERVER_HPP
+
+#include "ArgParser.hpp"
+
+//--------------------------------------------------
+// 常駐查詢服務 (serve / query 子命令)
+// serve 啟動時開啟 BAM reader (header 與 index) 與參考基因組並常駐，於 Unix socket 接受查詢，
+// 每批 site 以 Analysis::computeSamples 分析，省去每次執行的啟動、VCF 解析與 index 載入。
+//
+// 文字協定 (每列以 '\n' 結尾，欄位以 tab 分隔)：
+//   請求  <chr> <pos> <ref> <alt>   加入目前的批次 (空白或 tab 分隔；多個 ALT 以逗號分隔，各為一個 site)
+//         (空白列)                  分析目前的批次
+//         HEADER                    回傳兩種資料列的欄位名稱
+//         PING                      確認服務回應
+//         SHUTDOWN                  結束服務
+//         QUIT                      關閉連線
+//   回應  S\t<Somatic_analy.txt 資料列>   每個 site 一列，依請求順序
+//         M\t<methyl_analy.txt 資料列>    該 site 位置的 methylation 資料列，緊接於 S 列之後
+//         OK\t<site 數>\t<毫秒>            每個請求以 OK 或 ERR\t<訊息> 結束
+// 同時可有多個連線，各批次依序分析 (單一執行緒事件迴圈，分析時使用全部 reader)
+//--------------------------------------------------
+
+class QueryServer {
+public:
+    // 載入 BAM 後等待查詢，直到收到 SHUTDOWN 或 SIGINT/SIGTERM；回傳程式結束碼
+    static int serve(const ServeArgs &args);
+    // 送出查詢並將回應的 S/M 資料列輸出至標準輸出；回傳程式結束碼
+    static int query(const QueryArgs &args);
+};
+
+#endif // QUERY_SERVER_HPP
@@ -0,0 +1,434 @@
+#include "ReadDecoder.hpp"
+#include "SimdKernels.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+//--------------------------------------------------
+// 將 read 序列對應到參考座標 (1-based)
+//--------------------------------------------------
+std::vector<int> ReadDecoder::buildReadToRefMap(const bam1_t* aln) {
+    int readLength = aln->core.l_qseq;
+    std::vector<int> readToRef(readLength + 1, -1);
+    int refPos = aln->core.pos + 1; // 1-based
+    uint32_t *cigar = bam_get_cigar(aln);
+    int nCigar = aln->core.n_cigar;
+    int readPos = 1; // 1-based read 座標
+
+    for (int i = 0; i < nCigar; i++) {
+        int op = cigar[i] & BAM_CIGAR_MASK;
+        int len = cigar[i] >> BAM_CIGAR_SHIFT;
+        switch (op) {
+            case BAM_CMATCH:
+            case BAM_CEQUAL:
+            case BAM_CDIFF:
+                for (int j = 0; j < len; j++) {
+                    if (readPos <= readLength)
+                        readToRef[readPos] = refPos;
+                    readPos++;
+                    refPos++;
+                }
+                break;
+            case BAM_CINS:
+            case BAM_CSOFT_CLIP:
+                readPos += len;
+                break;
+            case BAM_CDEL:
+            case BAM_CREF_SKIP:
+                refPos += len;
+                break;
+            default:
+                break;
+        }
+    }
+    return readToRef;
+}
+
+//--------------------------------------------------
+// 解析 BAM 中的 MM/ML 標籤，取得甲基化記錄
+//--------------------------------------------------
+std::vector<MethylationRecord> ReadDecoder::parseMethylation(const bam1_t* aln) {
+    std::vector<MethylationRecord> records;
+    hts_base_mod_state *modState = hts_base_mod_state_alloc();
+    int ret = bam_parse_basemod(aln, modState);
+    if (ret < 0) {
+        hts_base_mod_state_free(modState);
+        return records;
+    }
+    auto readToRef = buildReadToRefMap(aln);
+    int readLength = aln->core.l_qseq;
+    hts_base_mod mods[5];
+    int readPos0;
+    int n = bam_next_basemod(aln, modState, mods, 5, &readPos0);
+    while (n > 0) {
+        for (int i = 0; i < n; i++) {
+            int readPos1 = readPos0 + 1; // 轉為 1-based
+            if (readPos1 >= 1 && readPos1 <= readLength) {
+                int refPos = readToRef[readPos1];
+                if (refPos > 0) {
+                    records.push_back({refPos, mods[i].qual});
+                }
+            }
+        }
+        n = bam_next_basemod(aln, modState, mods, 5, &readPos0);
+    }
+    hts_base_mod_state_free(modState);
+    return records;
+}
+
+uint64_t ReadDecoder::readNameHash(const bam1_t* aln) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const char *c = bam_get_qname(aln); *c; c++) {
+        hash ^= static_cast<unsigned char>(*c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//--------------------------------------------------
+// 原生 MM/ML 解碼
+// MM:Z 由多個 "<base><strand><mods>[.?],<delta>,...;" 組成，ML:B:C 依序存放每個
+// delta 的各修飾機率。只走訪 C+m 所在的項目，其餘項目僅計算 ML 位移
+//--------------------------------------------------
+static const uint8_t *findTag(const bam1_t* aln, const char *tag, const char *legacyTag) {
+    const uint8_t *data = bam_aux_get(aln, tag);
+    return data ? data : bam_aux_get(aln, legacyTag);
+}
+
+bool ReadDecoder::parseCpGMods(const bam1_t* aln, ModDecodeState& state) {
+    state.readPos.clear();
+    state.qual.clear();
+
+    const uint8_t *mmTag = findTag(aln, "MM", "Mm");
+    if (!mmTag || mmTag[0] != 'Z')
+        return false;
+    const uint8_t *mlTag = findTag(aln, "ML", "Ml");
+    const uint8_t *ml = NULL;
+    uint32_t mlLength = 0;
+    if (mlTag && mlTag[0] == 'B' && mlTag[1] == 'C') {
+        mlLength = bam_auxB_len(mlTag);
+        ml = mlTag + 6; // 'B'、子型別與 4 bytes 長度之後即為資料
+    }
+
+    const uint8_t *seq = bam_get_seq(aln);
+    const int readLength = aln->core.l_qseq;
+    const bool reverse = bam_is_rev(aln);
+    // MM 以原始定序方向計數；反向 read 在 BAM 中為反向互補，改由尾端計數 G
+    const int target = reverse ? 4 : 2; // seq_nt16 編碼：C = 2，G = 4
+    int nEntries = 0;
+
+    const char *p = reinterpret_cast<const char *>(mmTag + 1);
+    uint32_t mlOffset = 0;
+    while (*p) {
+        const char base = *p++;
+        const char strand = *p ? *p++ : '\0';
+        if (strand != '+' && strand != '-')
+            return false;
+        // 修飾代碼：一或多個字母，或單一 ChEBI 數字代碼
+        int nCodes = 0;
+        int methylIndex = -1;
+        if (isdigit(static_cast<unsigned char>(*p))) {
+            while (isdigit(static_cast<unsigned char>(*p)))
+                p++;
+            nCodes = 1;
+        } else {
+            while (isalpha(static_cast<unsigned char>(*p))) {
+                if (*p == 'm')
+                    methylIndex = nCodes;
+                nCodes++;
+                p++;
+            }
+        }
+        if (nCodes == 0)
+            return false;
+        if (*p == '.' || *p == '?')
+            p++;
+
+        const bool wanted = (base == 'C' && strand == '+' && methylIndex >= 0);
+        if (wanted)
+            nEntries++;
+        int origPos = 0; // 原始定序方向的 read 座標
+        while (*p == ',') {
+            char *end;
+            long delta = strtol(p + 1, &end, 10);
+            if (end == p + 1 || delta < 0)
+                return false;
+            p = end;
+            if (wanted) {
+                // 略過 delta 個 C，取下一個 C (反向 read 於 BAM 座標中由尾端往前)
+                const int seqPos = reverse
+                    ? SimdKernels::findNthBaseReverse(seq, 0, readLength - origPos, target, delta)
+                    : SimdKernels::findNthBase(seq, origPos, readLength, target, delta);
+                if (seqPos < 0 || mlOffset + methylIndex >= mlLength)
+                    return false;
+                state.readPos.push_back(seqPos);
+                state.qual.push_back(ml[mlOffset + methylIndex]);
+                origPos = (reverse ? readLength - 1 - seqPos : seqPos) + 1;
+            }
+            mlOffset += nCodes;
+        }
+        if (*p == ';')
+            p++;
+        else if (*p)
+            return false;
+    }
+
+    // 反向 read 由尾端往前產生座標，反轉為遞增
+    if (reverse) {
+        std::reverse(state.readPos.begin(), state.readPos.end());
+        std::reverse(state.qual.begin(), state.qual.end());
+    }
+    // 同一 read 有多個 C+m 項目時 (極少見) 需重新排序
+    if (nEntries > 1) {
+        std::vector<std::pair<int, uint8_t>> merged(state.readPos.size());
+        for (size_t i = 0; i < merged.size(); i++)
+            merged[i] = std::make_pair(state.readPos[i], state.qual[i]);
+        std::stable_sort(merged.begin(), merged.end(),
+                         [](const std::pair<int, uint8_t> &a, const std::pair<int, uint8_t> &b) {
+                             return a.first < b.first;
+                         });
+        for (size_t i = 0; i < merged.size(); i++) {
+            state.readPos[i] = merged[i].first;
+            state.qual[i] = merged[i].second;
+        }
+    }
+    return true;
+}
+
+bool ReadDecoder::verifyCpGMods(const bam1_t* aln, ModDecodeState& state) {
+    std::vector<int> expectedPos;
+    std::vector<uint8_t> expectedQual;
+    hts_base_mod_state *modState = hts_base_mod_state_alloc();
+    if (bam_parse_basemod(aln, modState) >= 0) {
+        hts_base_mod mods[5];
+        int readPos0;
+        int n;
+        while ((n = bam_next_basemod(aln, modState, mods, 5, &readPos0)) > 0) {
+            for (int i = 0; i < std::min(n, 5); i++) {
+                if (mods[i].canonical_base == 'C' && mods[i].modified_base == 'm' && mods[i].strand == 0) {
+                    expectedPos.push_back(readPos0);
+                    expectedQual.push_back(static_cast<uint8_t>(mods[i].qual));
+                }
+            }
+        }
+    }
+    hts_base_mod_state_free(modState);
+
+    parseCpGMods(aln, state);
+    return state.readPos == expectedPos && state.qual == expectedQual;
+}
+
+//--------------------------------------------------
+// 非 SNV site 的 allele 比對
+//--------------------------------------------------
+bool AlleleSet::build(const std::string &ref, const std::string &alts) {
+    codes.clear();
+    offsets.clear();
+    refSpan = static_cast<int>(ref.size());
+    bool snv = (ref.size() == 1);
+    offsets.push_back(0);
+    for (char c : ref)
+        codes.push_back(seq_nt16_table[static_cast<unsigned char>(c)]);
+    offsets.push_back(static_cast<int>(codes.size()));
+    size_t begin = 0;
+    while (begin <= alts.size() && static_cast<int>(offsets.size()) <= kMaxAlleles) {
+        size_t end = alts.find(',', begin);
+        if (end == std::string::npos)
+            end = alts.size();
+        if (end - begin != 1)
+            snv = false;
+        for (size_t k = begin; k < end; k++)
+            codes.push_back(seq_nt16_table[static_cast<unsigned char>(alts[k])]);
+        offsets.push_back(static_cast<int>(codes.size()));
+        begin = end + 1;
+    }
+    if (snv || ref.empty()) {
+        codes.clear();
+        offsets.clear();
+        return false;
+    }
+    return true;
+}
+
+// 第 index 個鹼基與 base 不同 (或長度不足) 的 allele 自 alive 移除
+static inline uint32_t matchBase(const AlleleSet &alleles, uint32_t alive, int index, uint8_t base) {
+    for (int a = 0; a < alleles.size(); a++) {
+        if (!(alive >> a & 1))
+            continue;
+        const int at = alleles.offsets[a] + index;
+        if (at >= alleles.offsets[a + 1] || alleles.codes[at] != base)
+            alive &= ~(1u << a);
+    }
+    return alive;
+}
+
+// 由參考範圍含 sitePos 的 CIGAR op (opIndex，起點為 refPos / readPos) 往後比對
+// read 須在 REF 範圍之後仍有比對或刪除，才能確認範圍末端沒有後續插入
+static char matchAllele(const bam1_t* aln, uint32_t opIndex, int refPos, int readPos,
+                        int sitePos, const AlleleSet &alleles) {
+    const uint32_t *cigar = bam_get_cigar(aln);
+    const uint8_t *seq = bam_get_seq(aln);
+    const int spanEnd = sitePos + alleles.refSpan - 1;
+    uint32_t alive = (1u << alleles.size()) - 1;
+    int length = 0; // 已比對的鹼基數
+    bool complete = false;
+    for (uint32_t i = opIndex; i < aln->core.n_cigar && alive; i++) {
+        const int op = bam_cigar_op(cigar[i]);
+        const int len = bam_cigar_oplen(cigar[i]);
+        const int type = bam_cigar_type(op);
+        if ((type & 2) && refPos > spanEnd) {
+            complete = true;
+            break;
+        }
+        switch (op) {
+            case BAM_CMATCH:
+            case BAM_CEQUAL:
+            case BAM_CDIFF: {
+                const int to = std::min(refPos + len - 1, spanEnd);
+                for (int p = std::max(refPos, sitePos); p <= to && alive; p++)
+                    alive = matchBase(alleles, alive, length++, bam_seqi(seq, readPos + p - refPos));
+                complete = (refPos + len - 1 > spanEnd);
+                break;
+            }
+            case BAM_CINS:
+                // 只計入範圍內位置之後的插入，sitePos 之前的插入不屬於此 site
+                if (refPos > sitePos && refPos <= spanEnd + 1) {
+                    for (int j = 0; j < len && alive; j++)
+                        alive = matchBase(alleles, alive, length++, bam_seqi(seq, readPos + j));
+                }
+                break;
+            case BAM_CSOFT_CLIP:
+            case BAM_CHARD_CLIP:
+                // read 於範圍內結束
+                alive = 0;
+                break;
+            default:
+                break;
+        }
+        if (complete)
+            break;
+        if (type & 1)
+            readPos += len;
+        if (type & 2)
+            refPos += len;
+    }
+    if (!complete)
+        return kNoAllele;
+    for (int a = 0; a < alleles.size(); a++) {
+        if ((alive >> a & 1) && alleles.offsets[a + 1] - alleles.offsets[a] == length)
+            return alleleLabel(a);
+    }
+    return kNoAllele;
+}
+
+//--------------------------------------------------
+// 單次走訪 CIGAR：同時取得 site 鹼基與視窗內的甲基化記錄
+//--------------------------------------------------
+void ReadDecoder::decodeRead(const bam1_t* aln,
+                             const int* sitePos, int nSites, char* siteBase,
+                             int windowLo, int windowHi,
+                             ModDecodeState& modState,
+                             std::vector<MethylationRecord>& calls,
+                             const CpGContext* cpg,
+                             const AlleleSet* const* siteAlleles) {
+    calls.clear();
+    for (int k = 0; k < nSites; k++)
+        siteBase[k] = 'N';
+    if (siteAlleles) {
+        for (int k = 0; k < nSites; k++) {
+            if (siteAlleles[k])
+                siteBase[k] = kNoAllele;
+        }
+    }
+
+    const uint8_t *seq = bam_get_seq(aln);
+    const int readLength = aln->core.l_qseq;
+
+    // 5mC 記錄依 read 座標遞增，可與 CIGAR 同步推進
+    if (!parseCpGMods(aln, modState)) {
+        modState.readPos.clear();
+        modState.qual.clear();
+    }
+    const size_t nMods = modState.readPos.size();
+    size_t nextMod = 0;
+    // 合併兩股時，視窗後一位的 G 會改記於視窗內的 C
+    const int callLimit = (cpg && cpg->collapseStrands) ? windowHi + 1 : windowHi;
+
+    const uint32_t *cigar = bam_get_cigar(aln);
+    int refPos = aln->core.pos + 1; // 目前 CIGAR op 起點的參考座標 (1-based)
+    int readPos = 0;                // 目前 CIGAR op 起點的 read 座標 (0-based)
+    int nextSite = 0;
+    for (uint32_t i = 0; i < aln->core.n_cigar; i++) {
+        // site 皆已處理且剩餘記錄都在視窗之後，提前結束
+        if (nextSite >= nSites && (nextMod >= nMods || refPos > callLimit))
+            break;
+        int op = bam_cigar_op(cigar[i]);
+        int len = bam_cigar_oplen(cigar[i]);
+        // 參考範圍內 (或之前) 的 site；位於刪除、跳過區段或 read 起點之前的 SNV site 維持 'N'
+        if (bam_cigar_type(op) & 2) {
+            while (nextSite < nSites && sitePos[nextSite] < refPos + len) {
+                int offset = sitePos[nextSite] - refPos;
+                const AlleleSet *alleles = siteAlleles ? siteAlleles[nextSite] : NULL;
+                if (alleles) {
+                    if (offset >= 0 && readLength > 0)
+                        siteBase[nextSite] = matchAllele(aln, i, refPos, readPos, sitePos[nextSite], *alleles);
+                } else if ((bam_cigar_type(op) & 1) && offset >= 0 && readPos + offset < readLength) {
+                    siteBase[nextSite] = "=ACMGRSVTWYHKDBN"[bam_seqi(seq, readPos + offset)];
+                }
+                nextSite++;
+            }
+        }
+        switch (op) {
+            case BAM_CMATCH:
+            case BAM_CEQUAL:
+            case BAM_CDIFF:
+                // 未篩選 CpG 時，op 內記錄的參考座標與 read 座標同步遞增，視窗內的記錄為連續區段，
+                // 以二分搜尋取得範圍後整段轉換座標；位於 op 之前 (插入或 soft clip) 的記錄直接略過
+                if (!cpg) {
+                    const int *modPos = modState.readPos.data();
+                    const int offset = refPos - readPos;
+                    const int *opBegin = std::lower_bound(modPos + nextMod, modPos + nMods, readPos);
+                    const int *opEnd = std::lower_bound(opBegin, modPos + nMods, readPos + len);
+                    const int *first = std::lower_bound(opBegin, opEnd, windowLo - offset);
+                    const int *last = std::upper_bound(first, opEnd, windowHi - offset);
+                    if (last > first) {
+                        const size_t base = calls.size();
+                        calls.resize(base + (last - first));
+                        SimdKernels::expandRun(first, modState.qual.data() + (first - modPos),
+                                               static_cast<int>(last - first), offset, calls.data() + base);
+                    }
+                    // 之後的記錄都在視窗之後
+                    nextMod = (last < opEnd) ? nMods : static_cast<size_t>(opEnd - modPos);
+                } else {
+                    // 位於插入或 soft clip 中的記錄沒有參考座標，直接略過
+                    while (nextMod < nMods && modState.readPos[nextMod] < readPos + len) {
+                        int modPos = modState.readPos[nextMod];
+                        if (modPos >= readPos) {
+                            int callRef = refPos + (modPos - readPos);
+                            if (callRef > callLimit) {
+                                nextMod = nMods;
+                                break;
+                            }
+                            // 非 CpG 的記錄不輸出；合併兩股後位置仍為非遞減
+                            if (cpg->locate(callRef) && callRef >= windowLo && callRef <= windowHi)
+                                calls.push_back({callRef, modState.qual[nextMod]});
+                        }
+                        nextMod++;
+                    }
+                }
+                readPos += len;
+                refPos += len;
+                break;
+            case BAM_CINS:
+            case BAM_CSOFT_CLIP:
+                readPos += len;
+                break;
+            case BAM_CDEL:
+            case BAM_CREF_SKIP:
+                refPos += len;
+                break;
+            default:
+                break;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef READ_DECODER_HPP
+#define READ_DECODER_HPP
+
+#include "htslib/sam.h"
+#include "ReferenceGenome.hpp"
+#include <string>
+#include <vector>
+
+// 單筆甲基化記錄
+struct MethylationRecord {
+    int refPos;    // 1-based 參考座標
+    int qual;      // ML 修飾機率 (0 ~ 255，機率 = qual / 255)
+};
+
+// 每個執行緒重複使用的 MM/ML 解碼暫存，避免每條 read 重新配置
+struct ModDecodeState {
+    std::vector<int> readPos;     // 5mC (C+m) 記錄的 read 座標 (0-based，遞增)
+    std::vector<uint8_t> qual;    // 對應的 ML 值
+};
+
+//--------------------------------------------------
+// indel、MNV 等非 SNV site 的 allele 序列 (REF 為第 0 個，ALT 依 VCF 順序，皆以 seq_nt16 編碼)
+// read 在 REF 範圍 [pos, pos + refSpan - 1] 內的鹼基，連同範圍內 (含最後一個位置之後) 的插入，
+// 與某個 allele 完全相同時標記為該 allele；比對於 CIGAR 走訪中直接進行，不建立字串
+//--------------------------------------------------
+static const int kMaxAlleles = 10;    // REF 加上至多 9 個 ALT，其餘 ALT 不比對
+static const char kNoAllele = '.';    // 與所有 allele 皆不符，或 read 未完整覆蓋 REF 範圍
+
+// allele 序號 (0 為 REF) 的標記，即 methyl_analy.txt 的 allele 欄
+inline char alleleLabel(int index) { return static_cast<char>('0' + index); }
+
+struct AlleleSet {
+    int refSpan = 0;
+    std::vector<uint8_t> codes;   // 各 allele 的編碼依序串接
+    std::vector<int> offsets;     // 第 i 個 allele 為 codes[offsets[i], offsets[i + 1])
+
+    // 由 REF 與 ALT (逗號分隔) 建立；所有 allele 皆為單一鹼基時回傳 false 並清空 (以 site 鹼基判斷即可)
+    bool build(const std::string &ref, const std::string &alts);
+    bool empty() const { return offsets.empty(); }
+    int size() const { return empty() ? 0 : static_cast<int>(offsets.size()) - 1; }
+};
+
+class ReadDecoder {
+public:
+    // 將 read 序列對應到參考座標 (1-based)；保留作為參考實作
+    static std::vector<int> buildReadToRefMap(const bam1_t* aln);
+    // 解析整條 read 的 MM/ML 標籤；保留作為參考實作
+    static std::vector<MethylationRecord> parseMethylation(const bam1_t* aln);
+
+    // read 名稱的 64 位元 FNV-1a 雜湊，與平台無關
+    static uint64_t readNameHash(const bam1_t* aln);
+
+    // 直接解析 MM/ML 標籤，只保留 5mC (C+m) 記錄；標籤缺失或格式錯誤時回傳 false
+    static bool parseCpGMods(const bam1_t* aln, ModDecodeState& state);
+    // 與 htslib bam_parse_basemod 的 C+m 結果逐筆比對，完全一致時回傳 true
+    static bool verifyCpGMods(const bam1_t* aln, ModDecodeState& state);
+
+    // 單次走訪 CIGAR 解碼 read，不建立完整的 read → 參考座標陣列
+    // sitePos：欲查詢的參考位置 (1-based，須遞增)，對應鹼基寫入 siteBase (未覆蓋為 'N')
+    // calls：只輸出參考座標落在 [windowLo, windowHi] 的 5mC 記錄，依 refPos 遞增 (可能重複)
+    // cpg：非 NULL 時只保留參考基因組 CpG 上的記錄，判斷於解碼當下進行
+    // siteAlleles：非 NULL 時，項目不為 NULL 的 site 改為寫入 read 符合的 allele 標記 (或 kNoAllele)
+    static void decodeRead(const bam1_t* aln,
+                           const int* sitePos, int nSites, char* siteBase,
+                           int windowLo, int windowHi,
+                           ModDecodeState& modState,
+                           std::vector<MethylationRecord>& calls,
+                           const CpGContext* cpg = NULL,
+                           const AlleleSet* const* siteAlleles = NULL);
+};
+
+#endif // READ_DECODER_HPP
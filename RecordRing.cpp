@@ -0,0 +1,113 @@
+#include "RecordRing.hpp"
+#include "Utility.hpp"
+#include <algorithm>
+
+RecordRing::RecordRing(int nTasks, int capacity, int batchRecords)
+    : storage(std::max(2, capacity)), queues(nTasks, TaskQueue{NULL, NULL, false}), nextTask(0),
+      queued(0) {
+    counters = RingStats{0, 0, 0.0, 0, 0.0, 0};
+    for (auto &batch : storage) {
+        batch.records.resize(batchRecords);
+        for (auto &aln : batch.records)
+            aln = bam_init1();
+        batch.count = 0;
+        batch.next = NULL;
+        freeList.push_back(&batch);
+    }
+}
+
+RecordRing::~RecordRing() {
+    for (auto &batch : storage)
+        for (auto aln : batch.records)
+            bam_destroy1(aln);
+}
+
+int RecordRing::beginTask() {
+    // 領取與加入 reading 須在同一個鎖內，確保讀取中編號最小的工作確實最早領取
+    std::lock_guard<std::mutex> lock(mutex);
+    if (nextTask >= static_cast<int>(queues.size()))
+        return -1;
+    reading.insert(nextTask);
+    return nextTask++;
+}
+
+RecordBatch *RecordRing::acquire(int task, double &waitSeconds) {
+    std::unique_lock<std::mutex> lock(mutex);
+    // 最後一個空批次只給讀取中編號最小的工作
+    auto ready = [&]() {
+        return !freeList.empty() && (freeList.size() > 1 || task == *reading.begin());
+    };
+    if (!ready()) {
+        Timer timer;
+        counters.producerStalls++;
+        freed.wait(lock, ready);
+        const double seconds = timer.stop();
+        counters.producerStallSeconds += seconds;
+        waitSeconds += seconds;
+    }
+    RecordBatch *batch = freeList.back();
+    freeList.pop_back();
+    batch->count = 0;
+    batch->next = NULL;
+    return batch;
+}
+
+void RecordRing::publish(int task, RecordBatch *batch) {
+    if (batch->count == 0) {
+        recycle(batch);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        TaskQueue &queue = queues[task];
+        if (queue.tail)
+            queue.tail->next = batch;
+        else
+            queue.head = batch;
+        queue.tail = batch;
+        counters.batches++;
+        counters.peakQueued = std::max(counters.peakQueued, ++queued);
+    }
+    filled.notify_all();
+}
+
+void RecordRing::endTask(int task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queues[task].done = true;
+        reading.erase(task);
+    }
+    filled.notify_all();
+    // 編號最小的工作改變，等待中的 I/O 執行緒可能可以取得最後一個空批次
+    freed.notify_all();
+}
+
+RecordBatch *RecordRing::next(int task, double &waitSeconds) {
+    std::unique_lock<std::mutex> lock(mutex);
+    TaskQueue &queue = queues[task];
+    auto ready = [&]() { return queue.head != NULL || queue.done; };
+    if (!ready()) {
+        Timer timer;
+        counters.consumerStalls++;
+        filled.wait(lock, ready);
+        const double seconds = timer.stop();
+        counters.consumerStallSeconds += seconds;
+        waitSeconds += seconds;
+    }
+    RecordBatch *batch = queue.head;
+    if (batch) {
+        queue.head = batch->next;
+        if (!queue.head)
+            queue.tail = NULL;
+        queued--;
+    }
+    return batch;
+}
+
+void RecordRing::recycle(RecordBatch *batch) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeList.push_back(batch);
+    }
+    freed.notify_all();
+}
@@ -0,0 +1,80 @@
+#ifndef RECORD_RING_HPP
+#define RECORD_RING_HPP
+
+#include "htslib/sam.h"
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <vector>
+
+//--------------------------------------------------
+// --prefetch-threads 的預讀管線
+// I/O 執行緒依工作順序讀取 (含 BGZF 解壓縮) 各工作的 read，填入固定數量的記錄批次；
+// 計算執行緒以相同順序領取工作並逐批處理，處理完的批次交還 ring 重複使用。
+// ring 已滿時 I/O 執行緒等待 (backpressure)，批次未到時計算執行緒等待 (I/O 不及)
+//--------------------------------------------------
+
+// 一批解壓縮後的 BAM 記錄；records 中的 bam1_t 跨批次重複使用
+struct RecordBatch {
+    std::vector<bam1_t *> records;
+    int count;           // 有效記錄數
+    RecordBatch *next;   // 同一工作的下一個待處理批次
+};
+
+// 管線的等待統計
+struct RingStats {
+    long long batches;             // I/O 執行緒送出的批次數
+    long long producerStalls;      // ring 已滿，I/O 執行緒等待空批次的次數
+    double producerStallSeconds;
+    long long consumerStalls;      // 批次未到，計算執行緒等待的次數
+    double consumerStallSeconds;
+    int peakQueued;                // 同時等待處理的最大批次數
+};
+
+class RecordRing {
+public:
+    // nTasks：工作數；capacity：批次數 (--queue-depth，至少 2)；batchRecords：每批記錄數
+    RecordRing(int nTasks, int capacity, int batchRecords);
+    ~RecordRing();
+
+    // I/O 端：依序領取下一個工作，全部領取後回傳 -1
+    // 讀取中編號最小的工作保證取得空批次，其他工作至少保留一個空批次給它，
+    // 因此計算端依序領取工作時不會互相等待而停住
+    int beginTask();
+    // 取得空批次；等待時累加至 waitSeconds
+    RecordBatch *acquire(int task, double &waitSeconds);
+    // 送出填好的批次 (count 可為 0，此時直接交還)
+    void publish(int task, RecordBatch *batch);
+    // 工作讀取完畢
+    void endTask(int task);
+
+    // 計算端：取得工作 task 的下一個批次，讀取完畢時回傳 NULL；等待時累加至 waitSeconds
+    RecordBatch *next(int task, double &waitSeconds);
+    void recycle(RecordBatch *batch);
+
+    RingStats stats() const { return counters; }
+    int capacity() const { return static_cast<int>(storage.size()); }
+
+private:
+    RecordRing(const RecordRing &);
+    RecordRing &operator=(const RecordRing &);
+
+    struct TaskQueue {
+        RecordBatch *head;
+        RecordBatch *tail;
+        bool done;
+    };
+
+    std::mutex mutex;
+    std::condition_variable freed;    // 有空批次或讀取中的工作改變
+    std::condition_variable filled;   // 有新批次或工作讀取完畢
+    std::vector<RecordBatch> storage;
+    std::vector<RecordBatch *> freeList;
+    std::vector<TaskQueue> queues;    // 每個工作一個佇列 (單向串列，不另配置記憶體)
+    std::set<int> reading;            // I/O 執行緒讀取中的工作
+    int nextTask;                     // 下一個待領取的工作
+    int queued;                       // 等待處理的批次數
+    RingStats counters;
+};
+
+#endif // RECORD_RING_HPP
@@ -0,0 +1,84 @@
+#include "ReferenceGenome.hpp"
+#include "htslib/faidx.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ReferenceGenome::ReferenceGenome() : data(NULL), dataSize(0) {}
+
+ReferenceGenome::~ReferenceGenome() {
+    if (data)
+        munmap(const_cast<unsigned char *>(data), dataSize);
+}
+
+bool ReferenceGenome::open(const std::string &fastaFile) {
+    int fd = ::open(fastaFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "錯誤：無法開啟參考基因組 " << fastaFile << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cerr << "錯誤：參考基因組 " << fastaFile << " 為空檔案" << std::endl;
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "錯誤：無法映射參考基因組 " << fastaFile << std::endl;
+        return false;
+    }
+    data = static_cast<const unsigned char *>(mapped);
+    dataSize = static_cast<size_t>(st.st_size);
+    // 隨機查詢 CpG，不需要預讀
+    madvise(mapped, dataSize, MADV_RANDOM);
+    if (dataSize >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+        std::cerr << "錯誤：參考基因組 " << fastaFile << " 為壓縮檔，請先解壓縮 (須為未壓縮的 FASTA 才能直接映射)" << std::endl;
+        return false;
+    }
+
+    const std::string faiFile = fastaFile + ".fai";
+    if (access(faiFile.c_str(), R_OK) != 0) {
+        std::cout << "建立參考基因組 index " << faiFile << "..." << std::endl;
+        if (fai_build(fastaFile.c_str()) != 0) {
+            std::cerr << "錯誤：無法建立參考基因組 index " << faiFile << std::endl;
+            return false;
+        }
+    }
+    std::ifstream fai(faiFile.c_str());
+    if (!fai) {
+        std::cerr << "錯誤：無法開啟參考基因組 index " << faiFile << std::endl;
+        return false;
+    }
+    contigs.clear();
+    contigIds.clear();
+    std::string line;
+    while (std::getline(fai, line)) {
+        if (line.empty())
+            continue;
+        std::istringstream fields(line);
+        std::string name;
+        FastaContig contig;
+        if (!(fields >> name >> contig.length >> contig.offset >> contig.lineBases >> contig.lineWidth) ||
+            contig.lineBases <= 0 || contig.lineWidth < contig.lineBases ||
+            contig.offset + (contig.length > 0 ? (contig.length - 1) / contig.lineBases * contig.lineWidth +
+                             (contig.length - 1) % contig.lineBases : 0) >= static_cast<int64_t>(dataSize)) {
+            std::cerr << "錯誤：參考基因組 index " << faiFile << " 格式錯誤或與 FASTA 不符: " << line << std::endl;
+            return false;
+        }
+        contigIds[name] = static_cast<int>(contigs.size());
+        contigs.push_back(contig);
+    }
+    std::cout << "參考基因組 " << fastaFile << ": " << contigs.size() << " 個 contig" << std::endl;
+    return true;
+}
+
+int ReferenceGenome::contigId(const std::string &name) const {
+    auto it = contigIds.find(name);
+    return it == contigIds.end() ? -1 : it->second;
+}
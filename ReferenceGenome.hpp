@@ -0,0 +1,72 @@
+#ifndef REFERENCE_GENOME_HPP
+#define REFERENCE_GENOME_HPP
+
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//--------------------------------------------------
+// 參考基因組：以 mmap 映射未壓縮的 FASTA，依 .fai index 計算鹼基位置
+// 所有執行緒共用同一份映射，只讀取實際查詢到的頁面
+//--------------------------------------------------
+class ReferenceGenome {
+public:
+    ReferenceGenome();
+    ~ReferenceGenome();
+    // 映射 FASTA 並讀取 .fai (不存在時以 htslib 建立)；失敗時輸出錯誤訊息並回傳 false
+    bool open(const std::string &fastaFile);
+
+    // contig 名稱轉為索引，不存在時回傳 -1
+    int contigId(const std::string &name) const;
+
+    // 1-based 位置的大寫鹼基，超出 contig 範圍時回傳 'N'
+    char base(int contig, int pos) const {
+        const FastaContig &c = contigs[contig];
+        if (pos < 1 || pos > c.length)
+            return 'N';
+        const int64_t p = pos - 1;
+        return static_cast<char>(toupper(data[c.offset + p / c.lineBases * c.lineWidth + p % c.lineBases]));
+    }
+
+private:
+    ReferenceGenome(const ReferenceGenome &);
+    ReferenceGenome &operator=(const ReferenceGenome &);
+
+    struct FastaContig {
+        int64_t length;
+        int64_t offset;      // 序列第一個鹼基在檔案中的位置
+        int64_t lineBases;   // 每行鹼基數
+        int64_t lineWidth;   // 每行位元組數 (含換行)
+    };
+
+    const unsigned char *data;
+    size_t dataSize;
+    std::vector<FastaContig> contigs;
+    std::unordered_map<std::string, int> contigIds;
+};
+
+//--------------------------------------------------
+// 解碼時的 CpG 篩選：只保留參考基因組中 CpG 的 C (正股) 或 G (反股) 上的記錄
+//--------------------------------------------------
+struct CpGContext {
+    const ReferenceGenome *reference;
+    int contig;              // 參考基因組中的 contig 索引
+    bool collapseStrands;    // 反股 G 上的記錄改記於同一 CpG 的 C 位置
+
+    // refPos 位於 CpG 時回傳 true，collapseStrands 時可能將 refPos 減一
+    bool locate(int &refPos) const {
+        const char b = reference->base(contig, refPos);
+        if (b == 'C')
+            return reference->base(contig, refPos + 1) == 'G';
+        if (b == 'G' && reference->base(contig, refPos - 1) == 'C') {
+            if (collapseStrands)
+                refPos--;
+            return true;
+        }
+        return false;
+    }
+};
+
+#endif // REFERENCE_GENOME_HPP
@@ -0,0 +1,299 @@
+#include "ResultStore.hpp"
+#include "BinaryIO.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+#include <unordered_set>
+
+// 結果庫的識別碼與格式版本；數值以本機位元組順序寫出，須於相同架構上讀取
+static const char kStoreMagic[8] = {'L', 'M', 'S', 'S', 'T', 'O', 'R', 'E'};
+static const uint32_t kStoreVersion = 3;
+
+// 輸入檔案的識別：路徑、大小與修改時間 (未指定的檔案皆為 0)
+struct FileIdentity {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+
+    bool operator==(const FileIdentity &other) const {
+        return path == other.path && size == other.size && mtime == other.mtime;
+    }
+};
+
+static FileIdentity identify(const std::string &path) {
+    FileIdentity id = {path, 0, 0};
+    struct stat st;
+    if (!path.empty() && stat(path.c_str(), &st) == 0) {
+        id.size = static_cast<uint64_t>(st.st_size);
+        id.mtime = static_cast<int64_t>(st.st_mtime);
+    }
+    return id;
+}
+
+// 結果庫檔頭記錄的完整 key
+struct StoreHeader {
+    int32_t window;
+    int32_t maxDepth;
+    uint8_t collapseStrands;
+    FileIdentity files[3];   // tumor、normal、參考基因組
+
+    bool operator==(const StoreHeader &other) const {
+        return window == other.window && maxDepth == other.maxDepth &&
+               collapseStrands == other.collapseStrands && files[0] == other.files[0] &&
+               files[1] == other.files[1] && files[2] == other.files[2];
+    }
+};
+
+static StoreHeader makeHeader(const StoreKey &key) {
+    StoreHeader header;
+    header.window = key.window;
+    header.maxDepth = key.maxDepth;
+    header.collapseStrands = key.collapseStrands ? 1 : 0;
+    header.files[0] = identify(key.tumorBam);
+    header.files[1] = identify(key.normalBam);
+    header.files[2] = identify(key.refFile);
+    return header;
+}
+
+static std::string siteKey(const SomaticSite &site) {
+    return site.chr + '\t' + std::to_string(site.pos) + '\t' + site.ref + '\t' + site.alt + '\t' + site.alts;
+}
+
+bool ResultStore::load(const std::string &filename, const StoreKey &key) {
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        if (errno == ENOENT) {
+            std::cout << "結果庫 " << filename << " 不存在，所有 site 皆重新計算" << std::endl;
+            return true;
+        }
+        std::cerr << "錯誤：無法開啟結果庫 " << filename << std::endl;
+        return false;
+    }
+    BinaryReader in(fp);
+    char magic[sizeof(kStoreMagic)];
+    in.raw(magic, sizeof(magic));
+    uint32_t version = in.value<uint32_t>();
+    if (!in.ok() || memcmp(magic, kStoreMagic, sizeof(magic)) != 0) {
+        std::cerr << "錯誤：" << filename << " 不是可辨識的結果庫" << std::endl;
+        fclose(fp);
+        return false;
+    }
+    StoreHeader stored;
+    stored.window = in.value<int32_t>();
+    stored.maxDepth = in.value<int32_t>();
+    stored.collapseStrands = in.value<uint8_t>();
+    for (auto &file : stored.files) {
+        file.path = in.string();
+        file.size = in.value<uint64_t>();
+        file.mtime = in.value<int64_t>();
+    }
+    // 舊版格式或 key 不同：保留檔案不讀取，結束時以本次結果改寫
+    if (version != kStoreVersion || !in.ok() || !(stored == makeHeader(key))) {
+        std::cout << "結果庫 " << filename << " 的視窗、輸入檔案或設定已改變，所有 site 皆重新計算" << std::endl;
+        fclose(fp);
+        return true;
+    }
+
+    uint32_t nContigs = in.value<uint32_t>();
+    for (uint32_t c = 0; c < nContigs && in.ok(); c++)
+        contigs.push_back(in.string());
+
+    uint64_t nRows = in.value<uint64_t>();
+    for (uint64_t r = 0; r < nRows && in.ok(); r++) {
+        SomaticSite site;
+        site.chr = in.string();
+        site.pos = in.value<int32_t>();
+        site.ref = in.string();
+        site.alt = in.string();
+        site.alts = in.string();
+        SomaticAnalyData row;
+        row.contig = in.value<int32_t>();
+        row.pos = in.value<int32_t>();
+        row.ref = in.string();
+        row.alt = in.string();
+        row.ref_count = in.value<int32_t>();
+        row.alt_count = in.value<int32_t>();
+        row.normal_ref_count = in.value<int32_t>();
+        row.normal_alt_count = in.value<int32_t>();
+        row.depth = in.value<int32_t>();
+        row.normal_depth = in.value<int32_t>();
+        row.ref_methyl_sum = in.value<double>();
+        row.alt_methyl_sum = in.value<double>();
+        row.normal_ref_methyl_sum = in.value<double>();
+        row.normal_alt_methyl_sum = in.value<double>();
+        // 平均值以與分析相同的方式計算
+        row.ref_methyl = methylMean(row.ref_methyl_sum, row.ref_count);
+        row.alt_methyl = methylMean(row.alt_methyl_sum, row.alt_count);
+        row.normal_ref_methyl = methylMean(row.normal_ref_methyl_sum, row.normal_ref_count);
+        row.normal_alt_methyl = methylMean(row.normal_alt_methyl_sum, row.normal_alt_count);
+        // 重複的 site 結果相同，只保留一份
+        if (rowIndex.insert(std::make_pair(siteKey(site), rows.size())).second)
+            rows.push_back(row);
+    }
+
+    uint64_t nPositions = in.value<uint64_t>();
+    for (uint64_t p = 0; p < nPositions && in.ok(); p++) {
+        std::string methylKey = in.string();
+        MethylRange range;
+        range.offset = in.value<uint64_t>();
+        range.count = in.value<uint64_t>();
+        positions[methylKey] = range;
+    }
+    uint64_t nMethyl = in.value<uint64_t>();
+    const uint64_t methylBytes = sizeof(int32_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint32_t);
+    if (in.ok() && nMethyl > in.remaining() / methylBytes) {
+        std::cerr << "錯誤：結果庫 " << filename << " 不完整" << std::endl;
+        fclose(fp);
+        return false;
+    }
+    if (in.ok()) {
+        methyl.resize(nMethyl);
+        in.column(methyl.contig);
+        in.column(methyl.key);
+        in.column(methyl.qualSum);
+        in.column(methyl.count);
+    }
+    bool ok = in.ok();
+    fclose(fp);
+    for (const auto &entry : positions) {
+        if (entry.second.offset + entry.second.count > methyl.size())
+            ok = false;
+    }
+    if (!ok) {
+        std::cerr << "錯誤：結果庫 " << filename << " 不完整" << std::endl;
+        return false;
+    }
+    usedRows.assign(rows.size(), 0);
+    return true;
+}
+
+bool ResultStore::lookup(const SomaticSite &site, SomaticAnalyData &row, MethylTable *methylOut) {
+    auto found = rowIndex.find(siteKey(site));
+    if (found == rowIndex.end())
+        return false;
+    const SomaticAnalyData &stored = rows[found->second];
+    const MethylRange *range = NULL;
+    if (stored.contig >= 0) {
+        auto position = positions.find(Analysis::methylSiteKey(site));
+        if (position == positions.end())
+            return false;
+        range = &position->second;
+    }
+    row = stored;
+    usedRows[found->second] = 1;
+    if (methylOut && range) {
+        for (uint64_t m = range->offset; m < range->offset + range->count; m++)
+            methylOut->push(methyl.contig[m], methyl.key[m], methyl.qualSum[m], methyl.count[m]);
+    }
+    return true;
+}
+
+size_t ResultStore::used() const {
+    return static_cast<size_t>(std::count(usedRows.begin(), usedRows.end(), 1));
+}
+
+bool ResultStore::save(const std::string &filename, const StoreKey &key,
+                       const std::vector<SomaticSite> &sites, const AnalysisResult &result) {
+    // 每個 methylSiteKey 取第一個 site 輸出的資料列 (其餘重複的 site 未輸出)；沒有資料列的也須記錄
+    std::vector<std::string> methylKeys;
+    std::vector<MethylRange> sourceRanges;
+    std::unordered_set<std::string> seenKeys;
+    for (size_t r = 0; r < sites.size(); r++) {
+        if (result.somaticData[r].contig < 0)
+            continue;
+        std::string methylKey = Analysis::methylSiteKey(sites[r]);
+        if (!seenKeys.insert(methylKey).second)
+            continue;
+        methylKeys.push_back(std::move(methylKey));
+        sourceRanges.push_back(result.siteMethyl[r]);
+    }
+
+    const std::string tmpFile = filename + ".tmp";
+    FILE *fp = fopen(tmpFile.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "錯誤：無法開啟檔案 " << tmpFile << " 進行輸出" << std::endl;
+        return false;
+    }
+    BinaryWriter out(fp);
+    out.raw(kStoreMagic, sizeof(kStoreMagic));
+    out.value(kStoreVersion);
+    const StoreHeader header = makeHeader(key);
+    out.value(header.window);
+    out.value(header.maxDepth);
+    out.value(header.collapseStrands);
+    for (const auto &file : header.files) {
+        out.string(file.path);
+        out.value(file.size);
+        out.value(file.mtime);
+    }
+
+    out.value(static_cast<uint32_t>(result.contigNames.size()));
+    for (const auto &name : result.contigNames)
+        out.string(name);
+
+    // 未分析的 site (contig 不在 BAM 中，或 --cache 略過的非 SNV site) 不保存，下次重新計算；
+    // 快取模式與 BAM 模式的 key 相同，保存空白列會使之後以 BAM 分析時沿用
+    uint64_t nRows = 0;
+    for (const auto &row : result.somaticData)
+        nRows += (row.contig >= 0);
+    out.value(nRows);
+    for (size_t r = 0; r < sites.size(); r++) {
+        const SomaticSite &site = sites[r];
+        const SomaticAnalyData &row = result.somaticData[r];
+        if (row.contig < 0)
+            continue;
+        out.string(site.chr);
+        out.value(static_cast<int32_t>(site.pos));
+        out.string(site.ref);
+        out.string(site.alt);
+        out.string(site.alts);
+        out.value(static_cast<int32_t>(row.contig));
+        out.value(static_cast<int32_t>(row.pos));
+        out.string(row.ref);
+        out.string(row.alt);
+        out.value(static_cast<int32_t>(row.ref_count));
+        out.value(static_cast<int32_t>(row.alt_count));
+        out.value(static_cast<int32_t>(row.normal_ref_count));
+        out.value(static_cast<int32_t>(row.normal_alt_count));
+        out.value(static_cast<int32_t>(row.depth));
+        out.value(static_cast<int32_t>(row.normal_depth));
+        out.value(row.ref_methyl_sum);
+        out.value(row.alt_methyl_sum);
+        out.value(row.normal_ref_methyl_sum);
+        out.value(row.normal_alt_methyl_sum);
+    }
+
+    // 各鍵的 methylation 資料列依記錄順序連續排列
+    const MethylTable &src = result.methylData;
+    MethylTable grouped;
+    out.value(static_cast<uint64_t>(methylKeys.size()));
+    for (size_t p = 0; p < methylKeys.size(); p++) {
+        const MethylRange &range = sourceRanges[p];
+        out.string(methylKeys[p]);
+        out.value(static_cast<uint64_t>(grouped.size()));
+        out.value(range.count);
+        for (uint64_t m = range.offset; m < range.offset + range.count; m++)
+            grouped.push(src.contig[m], src.key[m], src.qualSum[m], src.count[m]);
+    }
+    out.value(static_cast<uint64_t>(grouped.size()));
+    out.column(grouped.contig);
+    out.column(grouped.key);
+    out.column(grouped.qualSum);
+    out.column(grouped.count);
+
+    bool ok = out.ok();
+    if (fclose(fp) != 0)
+        ok = false;
+    // 完整寫出後才取代舊的結果庫，中斷時舊檔仍然可用
+    if (!ok || rename(tmpFile.c_str(), filename.c_str()) != 0) {
+        std::cerr << "錯誤：寫入結果庫 " << filename << " 失敗" << std::endl;
+        remove(tmpFile.c_str());
+        return false;
+    }
+    std::cout << filename << " 輸出完成 (" << nRows << " 個 site, "
+              << methylKeys.size() << " 個位置)" << std::endl;
+    return true;
+}
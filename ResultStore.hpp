@@ -0,0 +1,61 @@
+#ifndef RESULT_STORE_HPP
+#define RESULT_STORE_HPP
+
+#include "Analysis.hpp"
+#include "CommonTypes.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//--------------------------------------------------
+// 增量分析的結果庫 (--store)
+// 保存每個 site (chr, pos, ref, alt) 的統計列，以及每個 Analysis::methylSiteKey 的 methylation 資料列。
+// 視窗、輸入 BAM 的識別 (路徑、大小與修改時間) 與影響結果的設定為所有項目共同的 key，
+// 記錄於檔頭，任何一項不同時整個結果庫失效。重新執行時只計算新增或改變的 site，
+// 結果庫以本次 VCF 的全部結果改寫 (先寫暫存檔再 rename)，VCF 中已刪除的 site 隨之移除
+//--------------------------------------------------
+
+// 結果庫共同的 key (檔案另記錄大小與修改時間)
+struct StoreKey {
+    int window;
+    int maxDepth;
+    bool collapseStrands;
+    std::string tumorBam;
+    std::string normalBam;   // 空字串表示無 normal BAM
+    std::string refFile;     // 空字串表示未使用 -r
+};
+
+class ResultStore {
+public:
+    ResultStore() {}
+
+    // 讀取結果庫並比對 key；檔案不存在或 key 不同時結果庫為空並回傳 true，
+    // 內容損毀時輸出錯誤訊息並回傳 false
+    bool load(const std::string &filename, const StoreKey &key);
+
+    size_t size() const { return rows.size(); }
+    // 結果庫內 contig ID 對應的名稱 (與 key 中的 tumor BAM header 相同)
+    const std::vector<std::string> &contigNames() const { return contigs; }
+
+    // 查詢 site 的統計列；methyl 非 NULL 時附加與其 methylSiteKey 相同的 site 的 methylation 資料列
+    // 找不到時回傳 false (由呼叫端重新計算)
+    bool lookup(const SomaticSite &site, SomaticAnalyData &row, MethylTable *methyl);
+    // 查詢成功過的 site 數，其餘的 site 改寫時即被移除
+    size_t used() const;
+
+    // 以本次 VCF 的全部 site 改寫結果庫：sites 與 result.somaticData、result.siteMethyl 逐列對應，
+    // 每個 methylSiteKey 的第一個 site 含其 methylation 資料列；未分析 (contig 為 -1) 的列不保存
+    static bool save(const std::string &filename, const StoreKey &key,
+                     const std::vector<SomaticSite> &sites, const AnalysisResult &result);
+
+private:
+    std::vector<std::string> contigs;
+    std::vector<SomaticAnalyData> rows;
+    std::vector<char> usedRows;
+    std::unordered_map<std::string, size_t> rowIndex;        // "chr\tpos\tref\talt" → rows 索引
+    std::unordered_map<std::string, MethylRange> positions;  // methylSiteKey → methyl 範圍
+    MethylTable methyl;                                      // 依 positions 的範圍排列
+};
+
+#endif // RESULT_STORE_HPP
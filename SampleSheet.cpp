@@ -0,0 +1,46 @@
+#include "SampleSheet.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+std::vector<SampleInfo> SampleSheet::parse(const std::string &sheetFile) {
+    std::ifstream in(sheetFile.c_str());
+    if (!in) {
+        std::cerr << "錯誤：無法開啟樣本表 " << sheetFile << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::vector<SampleInfo> samples;
+    std::set<std::string> names;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        std::istringstream fields(line);
+        SampleInfo sample;
+        if (!(fields >> sample.name) || sample.name[0] == '#')
+            continue;
+        std::string extra;
+        if (!(fields >> sample.tumorBam) || ((fields >> sample.normalBam) && (fields >> extra))) {
+            std::cerr << "錯誤：樣本表 " << sheetFile << " 第 " << lineNumber
+                      << " 列格式須為 <name> <tumor.bam> [normal.bam]" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // 名稱作為輸出子資料夾，不允許路徑字元
+        if (sample.name.find('/') != std::string::npos || sample.name == "." || sample.name == "..") {
+            std::cerr << "錯誤：樣本名稱 " << sample.name << " 不可作為資料夾名稱" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!names.insert(sample.name).second) {
+            std::cerr << "錯誤：樣本名稱 " << sample.name << " 重複" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        samples.push_back(sample);
+    }
+    if (samples.empty()) {
+        std::cerr << "錯誤：樣本表 " << sheetFile << " 沒有任何樣本" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return samples;
+}
@@ -0,0 +1,21 @@
+#ifndef SAMPLE_SHEET_HPP
+#define SAMPLE_SHEET_HPP
+
+#include <string>
+#include <vector>
+
+// 樣本表的一列：樣本名稱、tumor BAM 與可選的 normal BAM
+struct SampleInfo {
+    std::string name;
+    std::string tumorBam;
+    std::string normalBam;   // 空字串表示無 normal BAM
+};
+
+class SampleSheet {
+public:
+    // 解析樣本表：每列 "<name> <tumor.bam> [normal.bam]"，以 tab 或空白分隔，# 開頭為註解
+    // 名稱須唯一，並作為輸出子資料夾名稱
+    static std::vector<SampleInfo> parse(const std::string &sheetFile);
+};
+
+#endif // SAMPLE_SHEET_HPP
@@ -0,0 +1,272 @@
+#include "ShardHandler.hpp"
+#include "BinaryIO.hpp"
+#include "OutputHandler.hpp"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// 部分結果檔的識別碼與格式版本；數值以本機位元組順序寫出，須於相同架構上合併
+static const char kPartialMagic[8] = {'L', 'M', 'S', 'P', 'A', 'R', 'T', '\0'};
+static const uint32_t kPartialVersion = 3;
+
+//--------------------------------------------------
+// 分片指派：FNV-1a 雜湊，與平台和編譯器無關
+//--------------------------------------------------
+static const int kShardBinSize = 1000000;
+
+int ShardHandler::shardOf(const SomaticSite &site, int shardCount) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (unsigned char c : site.chr) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    uint64_t bin = static_cast<uint64_t>(site.pos / kShardBinSize);
+    for (int b = 0; b < 8; b++) {
+        hash ^= (bin >> (8 * b)) & 0xFF;
+        hash *= 1099511628211ULL;
+    }
+    return static_cast<int>(hash % static_cast<uint64_t>(shardCount));
+}
+
+std::string ShardHandler::partialFileName(int shardIndex, int shardCount) {
+    return "shard_" + std::to_string(shardIndex) + "-of-" + std::to_string(shardCount) + ".part";
+}
+
+bool ShardHandler::writePartial(const std::string &filename, const ShardPartial &partial) {
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "錯誤：無法開啟檔案 " << filename << " 進行輸出" << std::endl;
+        return false;
+    }
+    BinaryWriter out(fp);
+    out.raw(kPartialMagic, sizeof(kPartialMagic));
+    out.value(kPartialVersion);
+    out.value(static_cast<int32_t>(partial.shardIndex));
+    out.value(static_cast<int32_t>(partial.shardCount));
+    out.value(static_cast<int32_t>(partial.window));
+    out.value(static_cast<uint8_t>(partial.result.hasNormal));
+    out.value(static_cast<int32_t>(partial.result.maxDepth));
+    out.value(partial.totalSites);
+    out.string(partial.tumorBam);
+    out.string(partial.normalBam);
+
+    const AnalysisResult &result = partial.result;
+    out.value(static_cast<uint32_t>(result.contigNames.size()));
+    for (const auto &name : result.contigNames)
+        out.string(name);
+
+    out.value(static_cast<uint64_t>(result.somaticData.size()));
+    for (size_t r = 0; r < result.somaticData.size(); r++) {
+        const SomaticAnalyData &row = result.somaticData[r];
+        out.value(partial.siteIndex[r]);
+        out.value(static_cast<int32_t>(row.contig));
+        out.value(static_cast<int32_t>(row.pos));
+        out.string(row.ref);
+        out.string(row.alt);
+        out.value(static_cast<int32_t>(row.ref_count));
+        out.value(static_cast<int32_t>(row.alt_count));
+        out.value(static_cast<int32_t>(row.normal_ref_count));
+        out.value(static_cast<int32_t>(row.normal_alt_count));
+        out.value(static_cast<int32_t>(row.depth));
+        out.value(static_cast<int32_t>(row.normal_depth));
+        out.value(row.ref_methyl_sum);
+        out.value(row.alt_methyl_sum);
+        out.value(row.normal_ref_methyl_sum);
+        out.value(row.normal_alt_methyl_sum);
+    }
+
+    const MethylTable &methyl = result.methylData;
+    out.value(static_cast<uint64_t>(methyl.size()));
+    out.column(methyl.contig);
+    out.column(methyl.key);
+    out.column(methyl.qualSum);
+    out.column(methyl.count);
+
+    bool ok = out.ok();
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok) {
+        std::cerr << "錯誤：寫入檔案 " << filename << " 失敗" << std::endl;
+        return false;
+    }
+    std::cout << filename << " 輸出完成 (" << result.somaticData.size() << " 個 site)" << std::endl;
+    return true;
+}
+
+bool ShardHandler::readPartial(const std::string &filename, ShardPartial &partial) {
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        std::cerr << "錯誤：無法開啟分片結果 " << filename << std::endl;
+        return false;
+    }
+    BinaryReader in(fp);
+    char magic[sizeof(kPartialMagic)];
+    in.raw(magic, sizeof(magic));
+    uint32_t version = in.value<uint32_t>();
+    if (!in.ok() || memcmp(magic, kPartialMagic, sizeof(magic)) != 0 || version != kPartialVersion) {
+        std::cerr << "錯誤：" << filename << " 不是可辨識的分片結果檔" << std::endl;
+        fclose(fp);
+        return false;
+    }
+    partial.shardIndex = in.value<int32_t>();
+    partial.shardCount = in.value<int32_t>();
+    partial.window = in.value<int32_t>();
+    AnalysisResult &result = partial.result;
+    result.hasNormal = in.value<uint8_t>() != 0;
+    result.maxDepth = in.value<int32_t>();
+    partial.totalSites = in.value<uint64_t>();
+    partial.tumorBam = in.string();
+    partial.normalBam = in.string();
+    if (in.ok() && (partial.shardCount < 1 || partial.shardIndex < 0 || partial.shardIndex >= partial.shardCount)) {
+        std::cerr << "錯誤：分片結果 " << filename << " 已損壞 (分片 " << partial.shardIndex << "/"
+                  << partial.shardCount << ")" << std::endl;
+        fclose(fp);
+        return false;
+    }
+
+    uint32_t nContigs = in.value<uint32_t>();
+    result.contigNames.clear();
+    for (uint32_t c = 0; c < nContigs && in.ok(); c++)
+        result.contigNames.push_back(in.string());
+
+    uint64_t nRows = in.value<uint64_t>();
+    partial.siteIndex.clear();
+    result.somaticData.clear();
+    for (uint64_t r = 0; r < nRows && in.ok(); r++) {
+        SomaticAnalyData row;
+        partial.siteIndex.push_back(in.value<uint64_t>());
+        row.contig = in.value<int32_t>();
+        row.pos = in.value<int32_t>();
+        row.ref = in.string();
+        row.alt = in.string();
+        row.ref_count = in.value<int32_t>();
+        row.alt_count = in.value<int32_t>();
+        row.normal_ref_count = in.value<int32_t>();
+        row.normal_alt_count = in.value<int32_t>();
+        row.depth = in.value<int32_t>();
+        row.normal_depth = in.value<int32_t>();
+        row.ref_methyl_sum = in.value<double>();
+        row.alt_methyl_sum = in.value<double>();
+        row.normal_ref_methyl_sum = in.value<double>();
+        row.normal_alt_methyl_sum = in.value<double>();
+        // 平均值以與單一程序相同的方式計算
+        row.ref_methyl = methylMean(row.ref_methyl_sum, row.ref_count);
+        row.alt_methyl = methylMean(row.alt_methyl_sum, row.alt_count);
+        row.normal_ref_methyl = methylMean(row.normal_ref_methyl_sum, row.normal_ref_count);
+        row.normal_alt_methyl = methylMean(row.normal_alt_methyl_sum, row.normal_alt_count);
+        result.somaticData.push_back(row);
+    }
+
+    uint64_t nMethyl = in.value<uint64_t>();
+    const uint64_t methylBytes = sizeof(int32_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint32_t);
+    if (in.ok() && nMethyl > in.remaining() / methylBytes) {
+        std::cerr << "錯誤：分片結果 " << filename << " 已損壞 (甲基化記錄數 " << nMethyl
+                  << " 超過檔案大小)" << std::endl;
+        fclose(fp);
+        return false;
+    }
+    if (in.ok()) {
+        result.methylData.resize(nMethyl);
+        in.column(result.methylData.contig);
+        in.column(result.methylData.key);
+        in.column(result.methylData.qualSum);
+        in.column(result.methylData.count);
+    }
+    bool ok = in.ok();
+    fclose(fp);
+    if (!ok) {
+        std::cerr << "錯誤：分片結果 " << filename << " 不完整" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//--------------------------------------------------
+// 合併分片：檢查各分片來自同一組參數，且 N 個分片恰好各出現一次
+//--------------------------------------------------
+bool ShardHandler::merge(const std::vector<std::string> &partialFiles,
+                         const std::string &outputFolder, bool bgzip) {
+    if (partialFiles.empty()) {
+        std::cerr << "錯誤：未指定分片結果檔" << std::endl;
+        return false;
+    }
+    // 先讀取並檢查所有分片，各分片的列數總和等於 VCF 的 site 數後才配置合併結果
+    std::vector<ShardPartial> partials(partialFiles.size());
+    std::vector<char> seenShard;
+    uint64_t nRows = 0;
+    for (size_t f = 0; f < partialFiles.size(); f++) {
+        ShardPartial &partial = partials[f];
+        if (!readPartial(partialFiles[f], partial))
+            return false;
+        const ShardPartial &first = partials[0];
+        if (f == 0) {
+            // 每個分片須恰好一個檔案，分片數多於檔案數時必有缺漏
+            if (partial.shardCount > static_cast<int>(partialFiles.size())) {
+                std::cerr << "錯誤：" << partialFiles[f] << " 屬於 " << partial.shardCount << " 個分片的結果，但只指定了 "
+                          << partialFiles.size() << " 個檔案" << std::endl;
+                return false;
+            }
+            seenShard.assign(first.shardCount, 0);
+        } else if (partial.shardCount != first.shardCount || partial.totalSites != first.totalSites ||
+                   partial.window != first.window || partial.tumorBam != first.tumorBam ||
+                   partial.normalBam != first.normalBam ||
+                   partial.result.hasNormal != first.result.hasNormal ||
+                   partial.result.maxDepth != first.result.maxDepth ||
+                   partial.result.contigNames != first.result.contigNames) {
+            std::cerr << "錯誤：" << partialFiles[f] << " 與 " << partialFiles[0]
+                      << " 的分析參數或輸入檔案不同，無法合併" << std::endl;
+            return false;
+        }
+        if (partial.shardIndex < 0 || partial.shardIndex >= first.shardCount ||
+            seenShard[partial.shardIndex]) {
+            std::cerr << "錯誤：分片 " << partial.shardIndex << "/" << partial.shardCount
+                      << " 重複或無效 (" << partialFiles[f] << ")" << std::endl;
+            return false;
+        }
+        seenShard[partial.shardIndex] = 1;
+        nRows += partial.siteIndex.size();
+    }
+    const ShardPartial &first = partials[0];
+    for (int s = 0; s < first.shardCount; s++) {
+        if (!seenShard[s]) {
+            std::cerr << "錯誤：缺少分片 " << s << "/" << first.shardCount << " 的結果" << std::endl;
+            return false;
+        }
+    }
+    if (nRows != first.totalSites) {
+        std::cerr << "錯誤：分片結果共 " << nRows << " 個 site，與 VCF 的 " << first.totalSites
+                  << " 個 site 不符" << std::endl;
+        return false;
+    }
+
+    // 列數總和等於 site 數，索引皆有效且不重複時每個 site 恰好出現一次
+    std::vector<SomaticAnalyData> somaticData(first.totalSites);
+    std::vector<char> filled(first.totalSites, 0);
+    MethylTable methylData;
+    for (size_t f = 0; f < partials.size(); f++) {
+        ShardPartial &partial = partials[f];
+        for (size_t r = 0; r < partial.siteIndex.size(); r++) {
+            uint64_t i = partial.siteIndex[r];
+            if (i >= first.totalSites || filled[i]) {
+                std::cerr << "錯誤：" << partialFiles[f] << " 含有無效或重複的 site 索引 " << i << std::endl;
+                return false;
+            }
+            somaticData[i] = std::move(partial.result.somaticData[r]);
+            filled[i] = 1;
+        }
+        // 輸出前會依 (contig, 位置) 排序，合併順序不影響結果
+        const MethylTable &src = partial.result.methylData;
+        for (size_t m = 0; m < src.size(); m++)
+            methylData.push(src.contig[m], src.key[m], src.qualSum[m], src.count[m]);
+        // 已併入合併結果，釋放分片的資料
+        std::vector<SomaticAnalyData>().swap(partial.result.somaticData);
+        partial.result.methylData = MethylTable();
+    }
+
+    bool writeSomaticSuccess = OutputHandler::writeSomaticAnaly(somaticData, first.result.contigNames,
+                                                                outputFolder, first.result.hasNormal,
+                                                                first.result.maxDepth);
+    bool writeMethylSuccess = OutputHandler::writeMethylAnaly(methylData, first.result.contigNames,
+                                                              outputFolder, bgzip);
+    return writeSomaticSuccess && writeMethylSuccess;
+}
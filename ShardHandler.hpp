@@ -0,0 +1,40 @@
+#ifndef SHARD_HANDLER_HPP
+#define SHARD_HANDLER_HPP
+
+#include "Analysis.hpp"
+#include "CommonTypes.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//--------------------------------------------------
+// 分片執行的部分結果
+// 各 site 只由一個分片處理，部分結果保存平均前的總和與筆數，合併後與單一程序的輸出完全相同
+//--------------------------------------------------
+struct ShardPartial {
+    int shardIndex;
+    int shardCount;
+    uint64_t totalSites;              // 整個 VCF 的 site 數
+    int window;
+    std::string tumorBam;
+    std::string normalBam;
+    std::vector<uint64_t> siteIndex;  // result.somaticData 每列對應的 VCF 索引
+    AnalysisResult result;
+};
+
+class ShardHandler {
+public:
+    // site 所屬的分片：依 (contig, 1 Mb 區間) 雜湊，相同位置的 site 必在同一分片
+    static int shardOf(const SomaticSite &site, int shardCount);
+    // 分片的部分結果檔名 (位於輸出資料夾)
+    static std::string partialFileName(int shardIndex, int shardCount);
+
+    static bool writePartial(const std::string &filename, const ShardPartial &partial);
+    static bool readPartial(const std::string &filename, ShardPartial &partial);
+
+    // 合併全部 N 個分片的部分結果，輸出 Somatic_analy.txt 與 methyl_analy.txt
+    static bool merge(const std::vector<std::string> &partialFiles,
+                      const std::string &outputFolder, bool bgzip);
+};
+
+#endif // SHARD_HANDLER_HPP
@@ -0,0 +1,338 @@
+#include "SimdKernels.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LMS_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// sumQual 與 expandRun 直接以 {refPos, qual} 兩個 int 的配置讀寫
+static_assert(sizeof(MethylationRecord) == 2 * sizeof(int), "MethylationRecord 須為兩個 int");
+
+// 相鄰記錄的目標鹼基常在數個鹼基之內，先逐一比對少數鹼基再改以整段遮罩計數
+static const int kScalarPrologue = 4;
+
+//--------------------------------------------------
+// 純量實作
+//--------------------------------------------------
+static int findNthBaseScalar(const uint8_t *seq, int begin, int end, int code, long n) {
+    for (int i = begin; i < end; i++) {
+        if (bam_seqi(seq, i) == code) {
+            if (n == 0)
+                return i;
+            n--;
+        }
+    }
+    return -1;
+}
+
+static int findNthBaseReverseScalar(const uint8_t *seq, int begin, int end, int code, long n) {
+    for (int i = end - 1; i >= begin; i--) {
+        if (bam_seqi(seq, i) == code) {
+            if (n == 0)
+                return i;
+            n--;
+        }
+    }
+    return -1;
+}
+
+static uint64_t sumQualScalar(const MethylationRecord *first, const MethylationRecord *last) {
+    uint64_t sum = 0;
+    for (const MethylationRecord *rec = first; rec != last; ++rec)
+        sum += static_cast<uint64_t>(rec->qual);
+    return sum;
+}
+
+static void expandRunScalar(const int *readPos, const uint8_t *qual, int n, int offset,
+                            MethylationRecord *out) {
+    for (int i = 0; i < n; i++) {
+        out[i].refPos = readPos[i] + offset;
+        out[i].qual = qual[i];
+    }
+}
+
+#ifdef LMS_SIMD_X86
+// 將 32 位元遮罩的第 i 位移至第 2i 位
+static inline uint64_t spreadBits(uint64_t x) {
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
+
+// 區段內符合的鹼基遮罩 (第 i 位為區段第 i 個鹼基)，由低位往高位第 n 個 / 由高位往低位第 n 個
+__attribute__((target("popcnt")))
+static int nthSetBit(uint64_t mask, long n) {
+    for (; n > 0; n--)
+        mask &= mask - 1;
+    return __builtin_ctzll(mask);
+}
+
+__attribute__((target("popcnt")))
+static int nthSetBitReverse(uint64_t mask, long n) {
+    for (; n > 0; n--)
+        mask &= ~(1ULL << (63 - __builtin_clzll(mask)));
+    return 63 - __builtin_clzll(mask);
+}
+
+//--------------------------------------------------
+// SSE4.1：每次 16 bytes (32 個鹼基、2 筆記錄或 4 個座標)
+// 每個 byte 的高 4 位元為偶數位置、低 4 位元為奇數位置的鹼基，兩者分別比對後交錯為鹼基遮罩
+//--------------------------------------------------
+__attribute__((target("sse4.1")))
+static uint64_t baseMask32(const uint8_t *bytes, __m128i target) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+    const __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    const __m128i low = _mm_and_si128(v, nibble);
+    const uint64_t highMask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(high, target)));
+    const uint64_t lowMask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(low, target)));
+    return spreadBits(highMask) | (spreadBits(lowMask) << 1);
+}
+
+__attribute__((target("sse4.1,popcnt")))
+static int findNthBaseSSE41(const uint8_t *seq, int begin, int end, int code, long n) {
+    int i = begin;
+    for (const int stop = std::min(end, begin + kScalarPrologue); i < stop || (i & 1); i++) {
+        if (i >= end)
+            return -1;
+        if (bam_seqi(seq, i) == code) {
+            if (n == 0)
+                return i;
+            n--;
+        }
+    }
+    // i 為偶數，每段 32 個鹼基從 byte 邊界開始
+    const __m128i target = _mm_set1_epi8(static_cast<char>(code));
+    for (; i + 32 <= end; i += 32) {
+        const uint64_t mask = baseMask32(seq + i / 2, target);
+        const int count = __builtin_popcountll(mask);
+        if (n < count)
+            return i + nthSetBit(mask, n);
+        n -= count;
+    }
+    return findNthBaseScalar(seq, i, end, code, n);
+}
+
+__attribute__((target("sse4.1,popcnt")))
+static int findNthBaseReverseSSE41(const uint8_t *seq, int begin, int end, int code, long n) {
+    int i = end;   // 尚未比對的範圍為 [begin, i)
+    for (const int stop = std::max(begin, end - kScalarPrologue); i > stop || (i & 1); i--) {
+        if (i <= begin)
+            return -1;
+        if (bam_seqi(seq, i - 1) == code) {
+            if (n == 0)
+                return i - 1;
+            n--;
+        }
+    }
+    const __m128i target = _mm_set1_epi8(static_cast<char>(code));
+    for (; i - 32 >= begin; i -= 32) {
+        const uint64_t mask = baseMask32(seq + (i - 32) / 2, target);
+        const int count = __builtin_popcountll(mask);
+        if (n < count)
+            return i - 32 + nthSetBitReverse(mask, n);
+        n -= count;
+    }
+    return findNthBaseReverseScalar(seq, begin, i, code, n);
+}
+
+__attribute__((target("sse4.1")))
+static uint64_t sumQualSSE41(const MethylationRecord *first, const MethylationRecord *last) {
+    const size_t n = last - first;
+    size_t i = 0;
+    // 每筆記錄為一個 64 位元 lane，qual 位於高 32 位元
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 2 <= n; i += 2) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first + i));
+        acc = _mm_add_epi64(acc, _mm_srli_epi64(v, 32));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+    return lanes[0] + lanes[1] + sumQualScalar(first + i, last);
+}
+
+__attribute__((target("sse4.1")))
+static void expandRunSSE41(const int *readPos, const uint8_t *qual, int n, int offset,
+                           MethylationRecord *out) {
+    const __m128i shift = _mm_set1_epi32(offset);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int packed;
+        memcpy(&packed, qual + i, sizeof(packed));
+        const __m128i q = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+        const __m128i pos = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(readPos + i)), shift);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_unpacklo_epi32(pos, q));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 2), _mm_unpackhi_epi32(pos, q));
+    }
+    expandRunScalar(readPos + i, qual + i, n - i, offset, out + i);
+}
+
+//--------------------------------------------------
+// AVX2：每次 32 bytes (64 個鹼基、4 筆記錄或 8 個座標)
+//--------------------------------------------------
+__attribute__((target("avx2")))
+static uint64_t baseMask64(const uint8_t *bytes, __m256i target) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bytes));
+    const __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    const __m256i low = _mm256_and_si256(v, nibble);
+    const uint64_t highMask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, target)));
+    const uint64_t lowMask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, target)));
+    return spreadBits(highMask) | (spreadBits(lowMask) << 1);
+}
+
+__attribute__((target("avx2,popcnt")))
+static int findNthBaseAVX2(const uint8_t *seq, int begin, int end, int code, long n) {
+    int i = begin;
+    for (const int stop = std::min(end, begin + kScalarPrologue); i < stop || (i & 1); i++) {
+        if (i >= end)
+            return -1;
+        if (bam_seqi(seq, i) == code) {
+            if (n == 0)
+                return i;
+            n--;
+        }
+    }
+    const __m256i target = _mm256_set1_epi8(static_cast<char>(code));
+    for (; i + 64 <= end; i += 64) {
+        const uint64_t mask = baseMask64(seq + i / 2, target);
+        const int count = __builtin_popcountll(mask);
+        if (n < count)
+            return i + nthSetBit(mask, n);
+        n -= count;
+    }
+    return findNthBaseScalar(seq, i, end, code, n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static int findNthBaseReverseAVX2(const uint8_t *seq, int begin, int end, int code, long n) {
+    int i = end;
+    for (const int stop = std::max(begin, end - kScalarPrologue); i > stop || (i & 1); i--) {
+        if (i <= begin)
+            return -1;
+        if (bam_seqi(seq, i - 1) == code) {
+            if (n == 0)
+                return i - 1;
+            n--;
+        }
+    }
+    const __m256i target = _mm256_set1_epi8(static_cast<char>(code));
+    for (; i - 64 >= begin; i -= 64) {
+        const uint64_t mask = baseMask64(seq + (i - 64) / 2, target);
+        const int count = __builtin_popcountll(mask);
+        if (n < count)
+            return i - 64 + nthSetBitReverse(mask, n);
+        n -= count;
+    }
+    return findNthBaseReverseScalar(seq, begin, i, code, n);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sumQualAVX2(const MethylationRecord *first, const MethylationRecord *last) {
+    const size_t n = last - first;
+    size_t i = 0;
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 4 <= n; i += 4) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first + i));
+        acc = _mm256_add_epi64(acc, _mm256_srli_epi64(v, 32));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumQualScalar(first + i, last);
+}
+
+__attribute__((target("avx2")))
+static void expandRunAVX2(const int *readPos, const uint8_t *qual, int n, int offset,
+                          MethylationRecord *out) {
+    const __m256i shift = _mm256_set1_epi32(offset);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i q = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(qual + i)));
+        const __m256i pos = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(readPos + i)), shift);
+        // unpack 於各 128 位元半部內交錯：lo = {0, 1 | 4, 5}，hi = {2, 3 | 6, 7}
+        const __m256i lo = _mm256_unpacklo_epi32(pos, q);
+        const __m256i hi = _mm256_unpackhi_epi32(pos, q);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 4), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    expandRunScalar(readPos + i, qual + i, n - i, offset, out + i);
+}
+#endif // LMS_SIMD_X86
+
+//--------------------------------------------------
+// 執行期選擇
+//--------------------------------------------------
+struct KernelTable {
+    int (*findNthBase)(const uint8_t *, int, int, int, long);
+    int (*findNthBaseReverse)(const uint8_t *, int, int, int, long);
+    uint64_t (*sumQual)(const MethylationRecord *, const MethylationRecord *);
+    void (*expandRun)(const int *, const uint8_t *, int, int, MethylationRecord *);
+};
+
+static const KernelTable kTables[] = {
+    {findNthBaseScalar, findNthBaseReverseScalar, sumQualScalar, expandRunScalar},
+#ifdef LMS_SIMD_X86
+    {findNthBaseSSE41, findNthBaseReverseSSE41, sumQualSSE41, expandRunSSE41},
+    {findNthBaseAVX2, findNthBaseReverseAVX2, sumQualAVX2, expandRunAVX2},
+#endif
+};
+
+static SimdLevel activeLevel = SimdKernels::detect();
+static const KernelTable *active = &kTables[activeLevel];
+
+SimdLevel SimdKernels::detect() {
+#ifdef LMS_SIMD_X86
+    // 於靜態初始化期間呼叫，須先初始化 CPU 資訊
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("popcnt"))
+        return kSimdScalar;
+    if (__builtin_cpu_supports("avx2"))
+        return kSimdAVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return kSimdSSE41;
+#endif
+    return kSimdScalar;
+}
+
+SimdLevel SimdKernels::level() {
+    return activeLevel;
+}
+
+SimdLevel SimdKernels::setLevel(SimdLevel level) {
+    activeLevel = std::min(level, detect());
+    active = &kTables[activeLevel];
+    return activeLevel;
+}
+
+const char *SimdKernels::levelName(SimdLevel level) {
+    switch (level) {
+        case kSimdAVX2:
+            return "avx2";
+        case kSimdSSE41:
+            return "sse4.1";
+        default:
+            return "scalar";
+    }
+}
+
+int SimdKernels::findNthBase(const uint8_t *seq, int begin, int end, int code, long n) {
+    return active->findNthBase(seq, begin, end, code, n);
+}
+
+int SimdKernels::findNthBaseReverse(const uint8_t *seq, int begin, int end, int code, long n) {
+    return active->findNthBaseReverse(seq, begin, end, code, n);
+}
+
+uint64_t SimdKernels::sumQual(const MethylationRecord *first, const MethylationRecord *last) {
+    return active->sumQual(first, last);
+}
+
+void SimdKernels::expandRun(const int *readPos, const uint8_t *qual, int n, int offset,
+                            MethylationRecord *out) {
+    active->expandRun(readPos, qual, n, offset, out);
+}
@@ -0,0 +1,41 @@
+#ifndef SIMD_KERNELS_HPP
+#define SIMD_KERNELS_HPP
+
+#include "ReadDecoder.hpp"
+#include <cstdint>
+
+//--------------------------------------------------
+// read 層級的向量化核心 (SSE4.1 / AVX2，執行期依 CPU 選擇，其他平台使用純量實作)
+// 各核心只做整數運算，所有實作的結果逐位元相同
+//--------------------------------------------------
+
+enum SimdLevel {
+    kSimdScalar = 0,
+    kSimdSSE41,
+    kSimdAVX2
+};
+
+class SimdKernels {
+public:
+    // CPU 支援的最高等級
+    static SimdLevel detect();
+    // 目前使用的等級 (預設為 detect())
+    static SimdLevel level();
+    // 指定使用的等級，超過 CPU 支援時降為 detect()；須於分析開始前呼叫
+    static SimdLevel setLevel(SimdLevel level);
+    static const char *levelName(SimdLevel level);
+
+    // packed 4-bit 序列 seq 在 [begin, end) 中第 n 個 (0-based) 編碼為 code 的位置；
+    // findNthBase 由 begin 往後、findNthBaseReverse 由 end - 1 往前計數，不足 n + 1 個時回傳 -1
+    static int findNthBase(const uint8_t *seq, int begin, int end, int code, long n);
+    static int findNthBaseReverse(const uint8_t *seq, int begin, int end, int code, long n);
+
+    // [first, last) 的 ML 值整數總和
+    static uint64_t sumQual(const MethylationRecord *first, const MethylationRecord *last);
+
+    // 同一個 CIGAR 比對區段內的記錄轉為參考座標：out[i] = {readPos[i] + offset, qual[i]}
+    static void expandRun(const int *readPos, const uint8_t *qual, int n, int offset,
+                          MethylationRecord *out);
+};
+
+#endif // SIMD_KERNELS_HPP
@@ -0,0 +1,211 @@
+#include "SyntheticData.hpp"
+#include "htslib/faidx.h"
+#include "htslib/sam.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+static const char kBases[] = "ACGT";
+
+static char complement(char base) {
+    switch (base) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        default:  return 'N';
+    }
+}
+
+// 附加 CIGAR op，與前一個相同的 op 合併
+static void pushCigar(std::vector<uint32_t> &cigar, int op, int len) {
+    if (len <= 0)
+        return;
+    if (!cigar.empty() && bam_cigar_op(cigar.back()) == static_cast<uint32_t>(op))
+        cigar.back() += static_cast<uint32_t>(len) << BAM_CIGAR_SHIFT;
+    else
+        cigar.push_back(bam_cigar_gen(len, op));
+}
+
+//--------------------------------------------------
+// 依原始定序方向產生 C+m 的 MM/ML 標籤
+// 約 3/4 的 C 有記錄，其餘以 '?' 表示未知；ML 值為高/低甲基化的雙峰分布
+//--------------------------------------------------
+static void buildModTags(const std::string &original, std::mt19937 &rng,
+                         std::string &mm, std::vector<uint8_t> &ml) {
+    mm = "C+m?";
+    ml.clear();
+    int skipped = 0;
+    for (char base : original) {
+        if (base != 'C')
+            continue;
+        if ((rng() & 3) == 0) {
+            skipped++;
+            continue;
+        }
+        mm += ',';
+        mm += std::to_string(skipped);
+        skipped = 0;
+        ml.push_back(static_cast<uint8_t>((rng() & 1) ? 200 + rng() % 56 : rng() % 56));
+    }
+    mm += ';';
+}
+
+SyntheticDataset SyntheticData::generate(const SyntheticConfig &config,
+                                         const std::string &folder,
+                                         const std::string &prefix) {
+    mkdir(folder.c_str(), 0755);
+    SyntheticDataset dataset;
+    dataset.bamPath = folder + "/" + prefix + ".bam";
+    dataset.cramPath = folder + "/" + prefix + ".cram";
+    dataset.refPath = folder + "/" + prefix + ".fa";
+    dataset.vcfPath = folder + "/" + prefix + ".vcf";
+    dataset.nReads = 0;
+    dataset.nBases = 0;
+    dataset.nSites = 0;
+
+    std::mt19937 rng(config.seed);
+    const int contigLength = config.contigLength;
+    std::string reference(contigLength, 'N');
+    for (int i = 0; i < contigLength; i++)
+        reference[i] = kBases[rng() & 3];
+
+    // 參考基因組 FASTA (每行 60 bp)，CRAM 以此壓縮序列
+    FILE *fasta = fopen(dataset.refPath.c_str(), "w");
+    if (!fasta) {
+        std::cerr << "錯誤：無法建立參考基因組 " << dataset.refPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fasta, ">%s\n", config.contig.c_str());
+    for (int i = 0; i < contigLength; i += 60)
+        fprintf(fasta, "%s\n", reference.substr(i, 60).c_str());
+    if (fclose(fasta) != 0 || fai_build(dataset.refPath.c_str()) != 0) {
+        std::cerr << "錯誤：無法建立參考基因組 index " << dataset.refPath << ".fai" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // somatic site：間距在 0.5 ~ 1.5 倍 siteSpacing 間變動，alt 為 ref 之外的鹼基
+    std::vector<char> altAt(contigLength, 0);
+    const int spacing = std::max(1, config.siteSpacing);
+    FILE *vcf = fopen(dataset.vcfPath.c_str(), "w");
+    if (!vcf) {
+        std::cerr << "錯誤：無法建立 VCF 檔案 " << dataset.vcfPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    fprintf(vcf, "##fileformat=VCFv4.2\n");
+    fprintf(vcf, "##contig=<ID=%s,length=%d>\n", config.contig.c_str(), contigLength);
+    fprintf(vcf, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+    for (long long pos = spacing / 2; pos < contigLength; pos += spacing / 2 + rng() % (spacing + 1)) {
+        char ref = reference[pos];
+        char alt = kBases[(std::find(kBases, kBases + 4, ref) - kBases + 1 + rng() % 3) & 3];
+        altAt[pos] = alt;
+        fprintf(vcf, "%s\t%lld\t.\t%c\t%c\t.\tPASS\t.\n", config.contig.c_str(), pos + 1, ref, alt);
+        dataset.nSites++;
+    }
+    fclose(vcf);
+
+    // 同一組記錄同時寫入 BAM 與 CRAM，供比較兩種格式的讀取吞吐量
+    samFile *out = sam_open(dataset.bamPath.c_str(), "wb");
+    samFile *cramOut = sam_open(dataset.cramPath.c_str(), "wc");
+    if (!out || !cramOut || hts_set_fai_filename(cramOut, dataset.refPath.c_str()) != 0) {
+        std::cerr << "錯誤：無法建立 BAM/CRAM 檔案 " << dataset.bamPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    sam_hdr_t *header = sam_hdr_init();
+    std::string headerText = "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:" + config.contig +
+                             "\tLN:" + std::to_string(contigLength) + "\n";
+    if (sam_hdr_add_lines(header, headerText.c_str(), headerText.size()) < 0 ||
+        sam_hdr_write(out, header) < 0 || sam_hdr_write(cramOut, header) < 0) {
+        std::cerr << "錯誤：無法寫入 BAM/CRAM header " << dataset.bamPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // read 起點均勻分布並排序，使輸出為 coordinate-sorted
+    const int readLength = std::max(2, config.readLength);
+    long long nReads = static_cast<long long>(config.depth) * contigLength / readLength;
+    std::vector<int> starts(nReads);
+    for (long long r = 0; r < nReads; r++)
+        starts[r] = static_cast<int>(rng() % contigLength);
+    std::sort(starts.begin(), starts.end());
+
+    bam1_t *aln = bam_init1();
+    std::string seq, original, mm;
+    std::vector<uint32_t> cigar;
+    std::vector<uint8_t> ml;
+    for (long long r = 0; r < nReads; r++) {
+        const int start = starts[r];
+        const int end = std::min(contigLength, start + readLength / 2 + static_cast<int>(rng() % (readLength + 1)));
+        const bool altHaplotype = rng() & 1;
+        seq.clear();
+        cigar.clear();
+
+        // 兩端 soft clip，中間每 200 ~ 800 bp 穿插短插入或刪除
+        int clip = rng() % 50;
+        for (int i = 0; i < clip; i++)
+            seq += kBases[rng() & 3];
+        pushCigar(cigar, BAM_CSOFT_CLIP, clip);
+        int refPos = start;
+        int nextEvent = start + 200 + rng() % 600;
+        while (refPos < end) {
+            if (refPos == nextEvent && end - refPos > 10) {
+                if (rng() & 1) {
+                    seq += kBases[rng() & 3];
+                    seq += kBases[rng() & 3];
+                    pushCigar(cigar, BAM_CINS, 2);
+                } else {
+                    refPos += 3;
+                    pushCigar(cigar, BAM_CDEL, 3);
+                }
+                nextEvent = refPos + 200 + rng() % 600;
+                continue;
+            }
+            int runEnd = (nextEvent > refPos) ? std::min(end, nextEvent) : end;
+            for (int p = refPos; p < runEnd; p++)
+                seq += (altHaplotype && altAt[p]) ? altAt[p] : reference[p];
+            pushCigar(cigar, BAM_CMATCH, runEnd - refPos);
+            refPos = runEnd;
+        }
+        clip = rng() % 50;
+        for (int i = 0; i < clip; i++)
+            seq += kBases[rng() & 3];
+        pushCigar(cigar, BAM_CSOFT_CLIP, clip);
+
+        // 反向 read 的 MM 以反向互補 (原始定序方向) 計數
+        const bool reverse = rng() & 1;
+        if (reverse) {
+            original.assign(seq.rbegin(), seq.rend());
+            for (auto &base : original)
+                base = complement(base);
+        } else {
+            original = seq;
+        }
+        buildModTags(original, rng, mm, ml);
+
+        std::string qname = prefix + "_" + std::to_string(r);
+        if (bam_set1(aln, qname.size(), qname.c_str(), reverse ? BAM_FREVERSE : 0, 0, start, 60,
+                     cigar.size(), cigar.data(), -1, -1, 0, seq.size(), seq.c_str(), NULL,
+                     mm.size() + ml.size() + 16) < 0 ||
+            bam_aux_append(aln, "MM", 'Z', static_cast<int>(mm.size() + 1),
+                           reinterpret_cast<const uint8_t *>(mm.c_str())) < 0 ||
+            bam_aux_update_array(aln, "ML", 'C', static_cast<uint32_t>(ml.size()), ml.data()) < 0 ||
+            sam_write1(out, header, aln) < 0 || sam_write1(cramOut, header, aln) < 0) {
+            std::cerr << "錯誤：寫入 BAM/CRAM 記錄失敗 " << dataset.bamPath << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        dataset.nReads++;
+        dataset.nBases += seq.size();
+    }
+    bam_destroy1(aln);
+    bam_hdr_destroy(header);
+    if (sam_close(out) < 0 || sam_index_build(dataset.bamPath.c_str(), 0) < 0 ||
+        sam_close(cramOut) < 0 || sam_index_build(dataset.cramPath.c_str(), 0) < 0) {
+        std::cerr << "錯誤：無法建立 BAM/CRAM index " << dataset.bamPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return dataset;
+}
@@ -0,0 +1,35 @@
+#ifndef SYNTHETIC_DATA_HPP
+#define SYNTHETIC_DATA_HPP
+
+#include <string>
+
+// 合成資料參數：單一 contig 的長讀段 BAM/CRAM (含 MM/ML 標籤) 與對應的 somatic VCF
+struct SyntheticConfig {
+    std::string contig;   // contig 名稱
+    int contigLength;     // contig 長度 (bp)
+    int readLength;       // 平均 read 長度 (bp)，實際長度介於 0.5 ~ 1.5 倍
+    int depth;            // 平均覆蓋深度
+    int siteSpacing;      // 相鄰 somatic site 的平均間距 (bp)
+    unsigned seed;        // 亂數種子，相同參數產生相同檔案
+};
+
+// 產生的檔案與規模
+struct SyntheticDataset {
+    std::string bamPath;  // 已排序並建立 .bai index
+    std::string cramPath; // 與 BAM 相同的記錄，已建立 .crai index
+    std::string refPath;  // 參考基因組 FASTA (含 .fai)，解碼 CRAM 時使用
+    std::string vcfPath;
+    long long nReads;
+    long long nBases;
+    int nSites;
+};
+
+class SyntheticData {
+public:
+    // 於 folder 產生 <prefix>.bam、<prefix>.cram (含 index)、<prefix>.fa 與 <prefix>.vcf
+    static SyntheticDataset generate(const SyntheticConfig &config,
+                                     const std::string &folder,
+                                     const std::string &prefix);
+};
+
+#endif // SYNTHETIC_DATA_HPP
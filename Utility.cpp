@@ -1,5 +1,6 @@
 #include "Utility.hpp"
 #include <chrono>
+#include <cstdio>
 
 Timer::Timer() {
     start();
@@ -14,3 +15,24 @@ double Timer::stop() {
     std::chrono::duration<double> elapsed = end_time - start_time;
     return elapsed.count();
 }
+
+void appendInt(std::string &out, long long value) {
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *p = end;
+    unsigned long long v = (value < 0) ? 0ULL - static_cast<unsigned long long>(value)
+                                       : static_cast<unsigned long long>(value);
+    do {
+        *--p = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    if (value < 0)
+        *--p = '-';
+    out.append(p, end - p);
+}
+
+void appendDouble(std::string &out, double value) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%g", value);
+    out.append(buf, n);
+}
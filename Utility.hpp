@@ -2,6 +2,7 @@
 #define UTILITY_HPP
 
 #include <chrono>
+#include <string>
 
 class Timer {
 public:
@@ -12,4 +13,9 @@ private:
     std::chrono::time_point<std::chrono::high_resolution_clock> start_time;
 };
 
+// 文字輸出格式化：直接附加至緩衝區，避免 iostream 逐欄位格式化的開銷
+void appendInt(std::string &out, long long value);
+// 與 std::ostream 預設格式 (%g，6 位有效數字) 相同
+void appendDouble(std::string &out, double value);
+
 #endif // UTILITY_HPP
@@ -1,33 +1,132 @@
 #include "VCFHandler.hpp"
 #include <iostream>
-#include "htslib/vcf.h"
+#include <cstdlib>
+#include <unistd.h>
 #include "htslib/hts.h"
 
-std::vector<SomaticSite> VCFHandler::parseSomaticSites(const std::string &vcfFile) {
-    std::vector<SomaticSite> sites;
-    
-    // 開啟 VCF 檔案
-    htsFile *vcfFp = bcf_open(vcfFile.c_str(), "r");
-    if (!vcfFp) {
+VCFReader::VCFReader(const std::string &vcfFile, const VCFFilter &filter)
+    : path(vcfFile), filter(filter), file(NULL), header(NULL), record(NULL), synced(NULL),
+      nRecords(0), nKept(0) {
+    if (!filter.regions.empty()) {
+        // 以 index 只讀取指定區段；區段可為字串或檔案
+        synced = bcf_sr_init();
+        bcf_sr_set_opt(synced, BCF_SR_REQUIRE_IDX);
+        bool isFile = access(filter.regions.c_str(), R_OK) == 0;
+        if (bcf_sr_set_regions(synced, filter.regions.c_str(), isFile ? 1 : 0) < 0) {
+            std::cerr << "錯誤：無法解析區段 " << filter.regions << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!bcf_sr_add_reader(synced, vcfFile.c_str())) {
+            std::cerr << "錯誤：無法開啟 VCF 檔案或其 index " << vcfFile << " ("
+                      << bcf_sr_strerror(synced->errnum) << ")" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    file = bcf_open(vcfFile.c_str(), "r");
+    if (!file) {
         std::cerr << "錯誤：無法開啟 VCF 檔案 " << vcfFile << std::endl;
         exit(EXIT_FAILURE);
     }
-    bcf_hdr_t *header = bcf_hdr_read(vcfFp);
-    bcf1_t *record = bcf_init();
-    
-    // 逐筆讀取 VCF 記錄
-    while (bcf_read(vcfFp, header, record) == 0) {
-        bcf_unpack(record, BCF_UN_ALL);
-        SomaticSite site;
-        site.chr = bcf_hdr_id2name(header, record->rid);
-        site.pos = record->pos + 1; // VCF pos 為 0-based，轉為 1-based
-        site.ref = record->d.allele[0];
-        site.alt = (record->d.m_allele > 1) ? record->d.allele[1] : "";
-        sites.push_back(site);
+    header = bcf_hdr_read(file);
+    if (!header) {
+        std::cerr << "錯誤：無法讀取 VCF header " << vcfFile << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    record = bcf_init();
+}
+
+VCFReader::~VCFReader() {
+    if (synced)
+        bcf_sr_destroy(synced);
+    if (record)
+        bcf_destroy(record);
+    if (header)
+        bcf_hdr_destroy(header);
+    if (file)
+        bcf_close(file);
+}
+
+bool VCFReader::keep(const bcf_hdr_t *hdr, bcf1_t *rec) const {
+    if (filter.passOnly && bcf_has_filter(hdr, rec, const_cast<char *>("PASS")) != 1)
+        return false;
+    return true;
+}
+
+bool VCFReader::nextBatch(size_t maxSites, std::vector<SomaticSite> &batch) {
+    batch.clear();
+    // 只解開 REF/ALT (與 FILTER)，略過 INFO 與各樣本的 FORMAT 欄位
+    const int unpack = filter.passOnly ? (BCF_UN_STR | BCF_UN_FLT) : BCF_UN_STR;
+    size_t nRecordsKept = 0;
+    while (nRecordsKept < maxSites) {
+        const bcf_hdr_t *hdr;
+        bcf1_t *rec;
+        if (synced) {
+            if (bcf_sr_next_line(synced) <= 0)
+                break;
+            hdr = bcf_sr_get_header(synced, 0);
+            rec = bcf_sr_get_line(synced, 0);
+        } else {
+            if (bcf_read(file, header, record) != 0)
+                break;
+            hdr = header;
+            rec = record;
+        }
+        nRecords++;
+        bcf_unpack(rec, unpack);
+        if (!keep(hdr, rec))
+            continue;
+        std::string alts;
+        for (int a = 1; a < rec->n_allele; a++) {
+            if (a > 1)
+                alts += ',';
+            alts += rec->d.allele[a];
+        }
+        const size_t before = batch.size();
+        // VCF pos 為 0-based，轉為 1-based
+        VCFHandler::appendSites(bcf_hdr_id2name(hdr, rec->rid), rec->pos + 1, rec->d.allele[0], alts,
+                                filter.snvOnly, batch);
+        if (batch.size() > before)
+            nRecordsKept++;
+        nKept += batch.size() - before;
+    }
+    return !batch.empty();
+}
+
+void VCFHandler::appendSites(const std::string &chr, int pos, const std::string &ref,
+                             const std::string &alts, bool snvOnly, std::vector<SomaticSite> &sites) {
+    SomaticSite site;
+    site.chr = chr;
+    site.pos = pos;
+    site.ref = ref;
+    // 單一 ALT 時 alts 留空，與只有 alt 相同
+    if (alts.find(',') != std::string::npos)
+        site.alts = alts;
+    size_t begin = 0;
+    while (begin <= alts.size()) {
+        size_t end = alts.find(',', begin);
+        if (end == std::string::npos)
+            end = alts.size();
+        site.alt = alts.substr(begin, end - begin);
+        if (site.alt == ".")
+            site.alt.clear();
+        bool keep = true;
+        if (snvOnly)
+            keep = ref.size() == 1 && site.alt.size() == 1 && site.alt != "*";
+        if (keep)
+            sites.push_back(site);
+        begin = end + 1;
     }
-    
-    bcf_destroy(record);
-    bcf_hdr_destroy(header);
-    bcf_close(vcfFp);
+}
+
+std::vector<SomaticSite> VCFHandler::parseSomaticSites(const std::string &vcfFile) {
+    VCFFilter filter;
+    filter.passOnly = false;
+    filter.snvOnly = false;
+    VCFReader reader(vcfFile, filter);
+    std::vector<SomaticSite> sites;
+    std::vector<SomaticSite> batch;
+    while (reader.nextBatch(65536, batch))
+        sites.insert(sites.end(), batch.begin(), batch.end());
     return sites;
 }
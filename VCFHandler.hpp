@@ -2,13 +2,58 @@
 #define VCF_HANDLER_HPP
 
 #include "CommonTypes.hpp"
+#include "htslib/vcf.h"
+#include "htslib/synced_bcf_reader.h"
+#include <cstdint>
 #include <string>
 #include <vector>
 
+// 讀取 VCF 時套用的篩選條件
+struct VCFFilter {
+    std::string regions;  // 限制區段 ("chr1:100-200,chr2" 或區段檔)，空字串表示不限制；需要 .tbi/.csi index
+    bool passOnly;        // 只保留 FILTER 為 PASS (或 .) 的記錄
+    bool snvOnly;         // 只保留 REF 與 ALT 皆為單一鹼基的 allele
+};
+
+//--------------------------------------------------
+// 串流讀取 VCF：每次讀取一批通過篩選的 site，記憶體用量與批次大小成正比
+// 只解開實際使用的欄位 (CHROM/POS/REF/ALT，需要時加上 FILTER)
+// 多 ALT 的記錄拆為每個 ALT 一個 site，同一記錄的 site 必在同一批
+//--------------------------------------------------
+class VCFReader {
+public:
+    VCFReader(const std::string &vcfFile, const VCFFilter &filter);
+    ~VCFReader();
+
+    // 以至多 maxSites 筆記錄的 site 覆寫 batch (拆開多 ALT 後可能略多)；沒有更多 site 時回傳 false
+    bool nextBatch(size_t maxSites, std::vector<SomaticSite> &batch);
+    uint64_t recordsRead() const { return nRecords; }
+    uint64_t sitesKept() const { return nKept; }
+
+private:
+    VCFReader(const VCFReader &);
+    VCFReader &operator=(const VCFReader &);
+
+    bool keep(const bcf_hdr_t *header, bcf1_t *record) const;
+
+    std::string path;
+    VCFFilter filter;
+    htsFile *file;        // 無 --regions 時依序讀取
+    bcf_hdr_t *header;
+    bcf1_t *record;
+    bcf_srs_t *synced;    // 有 --regions 時以 index 查詢
+    uint64_t nRecords;
+    uint64_t nKept;
+};
+
 class VCFHandler {
 public:
     // 解析 VCF 檔案，回傳所有 somatic mutation 位點資訊
     static std::vector<SomaticSite> parseSomaticSites(const std::string &vcfFile);
+    // 將一筆記錄的每個 ALT (alts 以逗號分隔) 附加為一個 site；沒有 ALT 時附加 alt 為空字串的一列
+    // snvOnly 時只附加 REF 與 ALT 皆為單一鹼基的 allele
+    static void appendSites(const std::string &chr, int pos, const std::string &ref,
+                            const std::string &alts, bool snvOnly, std::vector<SomaticSite> &sites);
 };
 
 #endif // VCF_HANDLER_HPP
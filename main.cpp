@@ -1,14 +1,128 @@
 #include "ArgParser.hpp"
 #include "VCFHandler.hpp"
 #include "Analysis.hpp"
+#include "BamReader.hpp"
+#include "MethylCache.hpp"
 #include "OutputHandler.hpp"
+#include "Profiler.hpp"
+#include "QueryServer.hpp"
+#include "ReferenceGenome.hpp"
+#include "ResultStore.hpp"
+#include "ShardHandler.hpp"
+#include "SampleSheet.hpp"
+#include "SimdKernels.hpp"
 #include "Utility.hpp"
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <unordered_set>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+// 將一批的結果附加至累計結果 (contig ID 皆以第一個樣本的 tumor BAM header 為準)
+static void appendResult(AnalysisResult &total, AnalysisResult &batch) {
+    if (total.contigNames.empty())
+        total.contigNames.swap(batch.contigNames);
+    total.somaticData.insert(total.somaticData.end(),
+                             std::make_move_iterator(batch.somaticData.begin()),
+                             std::make_move_iterator(batch.somaticData.end()));
+    for (const auto &range : batch.siteMethyl)
+        total.siteMethyl.push_back(MethylRange{range.offset + total.methylData.size(), range.count});
+    total.methylData.append(batch.methylData);
+}
+
+// 增量模式 (--store)：結果庫中已有的 site 直接取用 (含其位置的 methylation 資料列)，
+// 只分析其餘的 site；結果依 sites 順序排列，與全部重新分析相同
+template <typename AnalyzeFn>
+static AnalysisResult analyzeIncremental(const std::vector<SomaticSite> &sites, const std::vector<char> &emitMask,
+                                         ResultStore &store, AnalyzeFn analyze, size_t &nComputed) {
+    AnalysisResult merged;
+    merged.somaticData.resize(sites.size());
+    merged.siteMethyl.assign(sites.size(), MethylRange{0, 0});
+    std::vector<SomaticSite> missing;
+    std::vector<char> missingMask;
+    std::vector<int> source(sites.size(), -1);
+    for (size_t k = 0; k < sites.size(); k++) {
+        const uint64_t offset = merged.methylData.size();
+        if (store.lookup(sites[k], merged.somaticData[k], emitMask[k] ? &merged.methylData : NULL)) {
+            merged.siteMethyl[k] = MethylRange{offset, merged.methylData.size() - offset};
+            continue;
+        }
+        source[k] = static_cast<int>(missing.size());
+        missing.push_back(sites[k]);
+        missingMask.push_back(emitMask[k]);
+    }
+    nComputed += missing.size();
+    if (missing.empty()) {
+        // contig ID 沿用結果庫 (與相同 BAM 的 header 一致)
+        merged.contigNames = store.contigNames();
+        return merged;
+    }
+    AnalysisResult computed = std::move(analyze(missing, missingMask)[0]);
+    for (size_t k = 0; k < sites.size(); k++) {
+        if (source[k] >= 0) {
+            merged.somaticData[k] = std::move(computed.somaticData[source[k]]);
+            const MethylRange &range = computed.siteMethyl[source[k]];
+            merged.siteMethyl[k] = MethylRange{range.offset + merged.methylData.size(), range.count};
+        }
+    }
+    merged.methylData.append(computed.methylData);
+    merged.contigNames.swap(computed.contigNames);
+    return merged;
+}
+
 int main(int argc, char* argv[]) {
+    // merge 子命令：合併各分片的部分結果
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        MergeArgs mergeArgs = ArgParser::parseMerge(argc, argv);
+        Timer mergeTimer;
+        if (!ShardHandler::merge(mergeArgs.partialFiles, mergeArgs.outputFolder, mergeArgs.bgzip)) {
+            std::cerr << "錯誤：分片結果合併失敗" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "合併耗時: " << mergeTimer.stop() << " 秒" << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    // extract 子命令：擷取 site 視窗內的 read 與甲基化記錄至快取檔，供不同 -w 重複分析
+    if (argc > 1 && strcmp(argv[1], "extract") == 0) {
+        ExtractArgs extractArgs = ArgParser::parseExtract(argc, argv);
+#ifdef _OPENMP
+        omp_set_num_threads(extractArgs.maxThreads);
+#endif
+        Timer extractTimer;
+        VCFFilter filter;
+        filter.regions = extractArgs.regions;
+        filter.passOnly = extractArgs.passOnly;
+        filter.snvOnly = extractArgs.snvOnly;
+        VCFReader vcfReader(extractArgs.vcfFile, filter);
+        std::vector<SomaticSite> sites, batch;
+        while (vcfReader.nextBatch(65536, batch))
+            sites.insert(sites.end(), batch.begin(), batch.end());
+        std::cout << "VCF 共 " << vcfReader.recordsRead() << " 筆記錄, 通過篩選 " << sites.size() << " 筆" << std::endl;
+        int nReaders = std::max(1, std::min(extractArgs.maxThreads, static_cast<int>(sites.size())));
+        // 快取保存 read 名稱雜湊，CRAM 須解碼 read 名稱
+        CramOptions cram;
+        cram.refFile = extractArgs.refFile;
+        BamReaderPool readers(extractArgs.bamFile, nReaders, extractArgs.htsThreads, cram);
+        if (!MethylCache::extract(sites, readers, extractArgs.window, extractArgs.cacheFile)) {
+            std::cerr << "錯誤：快取擷取失敗" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "擷取耗時: " << extractTimer.stop() << " 秒" << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    // serve 子命令：常駐並於 Unix socket 接受 site 查詢；query 子命令：送出查詢的用戶端
+    if (argc > 1 && strcmp(argv[1], "serve") == 0)
+        return QueryServer::serve(ArgParser::parseServe(argc, argv));
+    if (argc > 1 && strcmp(argv[1], "query") == 0)
+        return QueryServer::query(ArgParser::parseQuery(argc, argv));
+
     // 解析命令列參數
     Args args = ArgParser::parse(argc, argv);
 #ifdef _OPENMP
@@ -18,30 +132,294 @@ int main(int argc, char* argv[]) {
     // 總計時
     Timer totalTimer;
 
-    // 解析 VCF 檔案，取得 somatic mutation 資訊
-    std::cout << "開始解析 VCF 檔案..." << std::endl;
+    // 樣本清單：--samples 樣本表，或 -t/-n 指定的單一樣本
+    const bool multiSample = !args.sampleSheet.empty();
+    std::vector<SampleInfo> samples;
+    if (multiSample) {
+        samples = SampleSheet::parse(args.sampleSheet);
+        std::cout << "樣本表共 " << samples.size() << " 個樣本" << std::endl;
+    } else {
+        SampleInfo sample;
+        sample.tumorBam = args.tumorBam;
+        sample.normalBam = args.normalBam;
+        samples.push_back(sample);
+    }
+
+    // 快取模式：由 extract 產生的快取檔取代讀取 BAM
+    const bool useCache = !args.cacheFile.empty();
+    MethylCache tumorCache, normalCache;
+    if (useCache) {
+        const std::string *files[2] = {&args.cacheFile, &args.normalCacheFile};
+        MethylCache *caches[2] = {&tumorCache, &normalCache};
+        std::string *bams[2] = {&samples[0].tumorBam, &samples[0].normalBam};
+        for (int role = 0; role < 2; role++) {
+            if (files[role]->empty())
+                continue;
+            if (!caches[role]->open(*files[role]))
+                return EXIT_FAILURE;
+            if (args.window > caches[role]->window()) {
+                std::cerr << "錯誤：分析範圍 (-w " << args.window << ") 大於快取 " << *files[role]
+                          << " 的擷取範圍 (" << caches[role]->window() << ")" << std::endl;
+                return EXIT_FAILURE;
+            }
+            // 指定 -t 時確認快取由同一個 BAM 擷取，且 BAM 之後未被修改
+            if (role == 0 && !args.tumorBam.empty() && !caches[role]->matchesBam(args.tumorBam)) {
+                std::cerr << "錯誤：快取 " << *files[role] << " 與 " << args.tumorBam
+                          << " 不符 (檔案大小或修改時間不同)，請重新執行 extract" << std::endl;
+                return EXIT_FAILURE;
+            }
+            *bams[role] = caches[role]->bamPath();
+        }
+        std::cout << "使用快取 " << args.cacheFile << " (擷取範圍 " << tumorCache.window() << ")" << std::endl;
+    }
+
+    // 串流讀取 VCF：先讀取第一批 site，之後每批分析時於背景讀取下一批
+    std::cout << "開始讀取 VCF 檔案..." << std::endl;
+    VCFFilter filter;
+    filter.regions = args.regions;
+    filter.passOnly = args.passOnly;
+    filter.snvOnly = args.snvOnly;
     Timer vcfTimer;
-    auto somaticSites = VCFHandler::parseSomaticSites(args.vcfFile);
-    std::cout << "VCF 解析耗時: " << vcfTimer.stop() << " 秒, 取得 " 
-              << somaticSites.size() << " 筆 mutation" << std::endl;
+    VCFReader vcfReader(args.vcfFile, filter);
+    std::vector<SomaticSite> batch, nextBatch;
+    bool hasBatch = vcfReader.nextBatch(args.batchSize, batch);
+    double vcfSeconds = vcfTimer.stop();
+
+    // 每個執行緒開啟一組 BAM reader (header 與 index 只載入一次)
+    // 多樣本時 reader 於分析中延遲開啟，所有 BAM 共用一組解壓縮執行緒
+    std::cout << "開始載入 BAM index..." << std::endl;
+    Timer readerTimer;
+    int nReaders = std::max(1, std::min(args.maxThreads, static_cast<int>(batch.size())));
+    SharedHtsThreadPool sharedPool(multiSample ? args.htsThreads : 0);
+    std::vector<std::unique_ptr<BamReaderPool>> readerPools;
+    std::vector<SampleInput> inputs(samples.size());
+    // CRAM 以 --cram-ref (未指定時為 -r) 重建序列；read 名稱只有 --max-depth 抽樣時需要
+    CramOptions cram;
+    cram.refFile = args.cramRefFile.empty() ? args.refFile : args.cramRefFile;
+    cram.readNames = (args.maxDepth > 0);
+    for (size_t s = 0; s < samples.size() && !useCache; s++) {
+        // normal BAM 使用相同數量的 reader，與 tumor 於同一平行迴圈中交錯讀取
+        const std::string *paths[2] = {&samples[s].tumorBam, &samples[s].normalBam};
+        for (int role = 0; role < 2; role++) {
+            if (paths[role]->empty())
+                continue;
+            if (multiSample)
+                readerPools.emplace_back(new BamReaderPool(*paths[role], nReaders, sharedPool.get(), cram));
+            else
+                readerPools.emplace_back(new BamReaderPool(*paths[role], nReaders, args.htsThreads, cram));
+            (role == 0 ? inputs[s].tumor : inputs[s].normal) = readerPools.back().get();
+        }
+    }
+    double readerSeconds = readerTimer.stop();
+    if (!multiSample && !useCache) {
+        std::cout << "BAM index 載入耗時: " << readerSeconds << " 秒, 共 "
+                  << nReaders << " 個 reader" << std::endl;
+    }
+
+    // 參考基因組：所有執行緒共用同一份 mmap 映射，解碼時即排除非 CpG 的記錄
+    ReferenceGenome reference;
+    if (!args.refFile.empty() && !reference.open(args.refFile))
+        return EXIT_FAILURE;
 
     // 執行 BAM 分析：解析 CIGAR、MD 與 MM/ML 標籤，統計甲基化資訊
-    std::cout << "開始執行分析..." << std::endl;
-    Timer analysisTimer;
-    AnalysisResult analysisResult = Analysis::compute(somaticSites, args.tumorBam, args.normalBam, args.window);
-    std::cout << "分析耗時: " << analysisTimer.stop() << " 秒" << std::endl;
+    std::cout << "開始執行分析... (SIMD 核心: " << SimdKernels::levelName(SimdKernels::level()) << ")" << std::endl;
+    AnalysisOptions options;
+    options.window = args.window;
+    options.sweep = args.sweep;
+    options.verifyMods = args.verifyMods;
+    options.reference = args.refFile.empty() ? NULL : &reference;
+    options.collapseStrands = args.collapseStrands;
+    options.maxDepth = args.maxDepth;
+    // 預讀的 I/O 執行緒使用前 prefetchThreads 個 reader，不另外開啟 BAM
+    options.prefetchThreads = useCache ? 0 : std::min(args.prefetchThreads, nReaders);
+    options.queueDepth = args.queueDepth;
+    options.quiet = false;
+    // --profile：各執行緒的計數器與工作耗時，結束時輸出 JSON 報告
+    std::unique_ptr<Profiler> profiler;
+    if (!args.profileFile.empty()) {
+        profiler.reset(new Profiler(nReaders + options.prefetchThreads));
+        profiler->addStage("index_load", readerSeconds);
+    }
+    options.profiler = profiler.get();
+    std::vector<AnalysisResult> results(samples.size());
+    for (size_t s = 0; s < samples.size(); s++) {
+        results[s].hasNormal = !samples[s].normalBam.empty();
+        results[s].maxDepth = args.maxDepth;
+    }
+    // 分片模式記錄本分片各 site 在 (篩選後) VCF 中的索引
+    uint64_t totalSites = 0;
+    std::vector<uint64_t> siteIndex;
+    size_t nAnalyzed = 0;
+    int nBatches = 0;
+    // methylSiteKey 相同的 site 可能分屬不同批次，跨批次只輸出第一筆的 methylation 資料
+    std::unordered_set<std::string> seenMethylSites;
+    double analysisSeconds = 0.0;
+    double vcfWaitSeconds = 0.0;
+    // --store：載入結果庫，結束時以本次 VCF 的全部 site 改寫
+    const bool useStore = !args.storeFile.empty();
+    StoreKey storeKey;
+    storeKey.window = args.window;
+    storeKey.maxDepth = args.maxDepth;
+    storeKey.collapseStrands = args.collapseStrands;
+    storeKey.tumorBam = samples[0].tumorBam;
+    storeKey.normalBam = samples[0].normalBam;
+    storeKey.refFile = args.refFile;
+    ResultStore store;
+    if (useStore && !store.load(args.storeFile, storeKey))
+        return EXIT_FAILURE;
+    std::vector<SomaticSite> storeSites;
+    size_t nComputed = 0;
+    auto analyze = [&](const std::vector<SomaticSite> &subset,
+                       const std::vector<char> &mask) -> std::vector<AnalysisResult> {
+        if (!useCache)
+            return Analysis::computeSamples(subset, inputs, options, &mask);
+        std::vector<AnalysisResult> cached;
+        cached.push_back(Analysis::computeFromCache(subset, tumorCache,
+                                                    args.normalCacheFile.empty() ? NULL : &normalCache,
+                                                    options, nReaders, &mask));
+        return cached;
+    };
+    while (hasBatch) {
+        bool hasNext = false;
+        double prefetchSeconds = 0.0;
+        std::future<void> prefetch = std::async(std::launch::async, [&]() {
+            Timer prefetchTimer;
+            hasNext = vcfReader.nextBatch(args.batchSize, nextBatch);
+            prefetchSeconds = prefetchTimer.stop();
+        });
+
+        std::vector<SomaticSite> sites;
+        std::vector<char> emitMask;
+        sites.reserve(batch.size());
+        emitMask.reserve(batch.size());
+        for (const auto &site : batch) {
+            uint64_t index = totalSites++;
+            if (args.shardCount > 0) {
+                if (ShardHandler::shardOf(site, args.shardCount) != args.shardIndex)
+                    continue;
+                siteIndex.push_back(index);
+            }
+            emitMask.push_back(seenMethylSites.insert(Analysis::methylSiteKey(site)).second);
+            sites.push_back(site);
+        }
+        if (!sites.empty()) {
+            Timer batchTimer;
+            std::vector<AnalysisResult> batchResults;
+            if (useStore) {
+                batchResults.push_back(analyzeIncremental(sites, emitMask, store, analyze, nComputed));
+                storeSites.insert(storeSites.end(), sites.begin(), sites.end());
+            } else {
+                batchResults = analyze(sites, emitMask);
+            }
+            analysisSeconds += batchTimer.stop();
+            for (size_t s = 0; s < samples.size(); s++)
+                appendResult(results[s], batchResults[s]);
+            nAnalyzed += sites.size();
+        }
+
+        Timer waitTimer;
+        prefetch.get();
+        vcfWaitSeconds += waitTimer.stop();
+        vcfSeconds += prefetchSeconds;
+        batch.swap(nextBatch);
+        hasBatch = hasNext;
+        nBatches++;
+    }
+    std::cout << "VCF 共 " << vcfReader.recordsRead() << " 筆記錄, 通過篩選 " << vcfReader.sitesKept()
+              << " 筆, 分 " << nBatches << " 批" << std::endl;
+    if (args.shardCount > 0) {
+        std::cout << "分片 " << args.shardIndex << "/" << args.shardCount << ": "
+                  << nAnalyzed << " 筆 mutation" << std::endl;
+    }
+    std::cout << "VCF 讀取耗時: " << vcfSeconds << " 秒 (與分析重疊，等待 " << vcfWaitSeconds << " 秒)" << std::endl;
+    std::cout << "分析耗時: " << analysisSeconds << " 秒" << std::endl;
+    if (useStore) {
+        std::cout << "增量分析: 沿用結果庫 " << nAnalyzed - nComputed << " 個 site, 重新計算 " << nComputed
+                  << " 個, 移除 " << store.size() - store.used() << " 個" << std::endl;
+        if (!ResultStore::save(args.storeFile, storeKey, storeSites, results[0]))
+            return EXIT_FAILURE;
+    }
+    // --max-depth：各 site 是否抽樣見 Somatic_analy.txt 的 capped 欄位
+    if (args.maxDepth > 0) {
+        for (size_t s = 0; s < samples.size(); s++) {
+            size_t capped = 0;
+            for (const auto &row : results[s].somaticData) {
+                if (row.depth > args.maxDepth || row.normal_depth > args.maxDepth)
+                    capped++;
+            }
+            std::cout << (multiSample ? "樣本 " + samples[s].name + ": " : std::string())
+                      << capped << " 個 site 深度超過 " << args.maxDepth << "，已抽樣" << std::endl;
+        }
+    }
+    if (profiler) {
+        profiler->addStage("analysis", analysisSeconds);
+        profiler->addStage("vcf_read", vcfSeconds);
+        profiler->addStage("vcf_wait", vcfWaitSeconds);
+    }
+    // 原本每個 site 都會重新開啟 BAM 並載入 header 與 index，依此估計節省的時間
+    if (!multiSample && !useCache && nAnalyzed > static_cast<size_t>(nReaders)) {
+        double perOpen = readerSeconds / (inputs[0].normal ? 2 * nReaders : nReaders);
+        std::cout << "重複使用 BAM reader 估計節省: "
+                  << perOpen * (nAnalyzed - nReaders) << " 秒" << std::endl;
+    }
+
+    // 報告使用的名稱 (輸出時結果可能被移出)
+    std::vector<std::string> contigNames = results[0].contigNames;
+    std::vector<std::string> sampleNames;
+    for (const auto &sample : samples)
+        sampleNames.push_back(sample.name.empty() ? sample.tumorBam : sample.name);
 
-    // 輸出結果
+    // 輸出結果：多樣本時各樣本輸出至 <output>/<name>/
     std::cout << "開始輸出結果..." << std::endl;
     Timer outputTimer;
-    bool writeSomaticSuccess = OutputHandler::writeSomaticAnaly(analysisResult.somaticData, args.outputFolder);
-    bool writeMethylSuccess = OutputHandler::writeMethylAnaly(analysisResult.methylData, args.outputFolder);
-    if (!writeSomaticSuccess || !writeMethylSuccess) {
+    OutputHandler::createDirectory(args.outputFolder);
+    bool writeSuccess = true;
+    for (size_t s = 0; s < samples.size(); s++) {
+        const std::string folder = multiSample ? args.outputFolder + "/" + samples[s].name : args.outputFolder;
+        AnalysisResult &analysisResult = results[s];
+        if (args.shardCount > 0) {
+            // 分片模式輸出部分結果，由 merge 子命令合併
+            ShardPartial partial;
+            partial.shardIndex = args.shardIndex;
+            partial.shardCount = args.shardCount;
+            partial.totalSites = totalSites;
+            partial.window = args.window;
+            partial.tumorBam = samples[s].tumorBam;
+            partial.normalBam = samples[s].normalBam;
+            partial.siteIndex = siteIndex;
+            partial.result = std::move(analysisResult);
+            OutputHandler::createDirectory(folder);
+            std::string filename = folder + "/" + ShardHandler::partialFileName(args.shardIndex, args.shardCount);
+            if (!ShardHandler::writePartial(filename, partial))
+                writeSuccess = false;
+            continue;
+        }
+        if (multiSample)
+            std::cout << "樣本 " << samples[s].name << ":" << std::endl;
+        bool writeSomaticSuccess = OutputHandler::writeSomaticAnaly(analysisResult.somaticData,
+                                                                    analysisResult.contigNames, folder,
+                                                                    analysisResult.hasNormal,
+                                                                    analysisResult.maxDepth);
+        bool writeMethylSuccess = OutputHandler::writeMethylAnaly(analysisResult.methylData,
+                                                                  analysisResult.contigNames, folder,
+                                                                  args.bgzip);
+        if (!writeSomaticSuccess || !writeMethylSuccess)
+            writeSuccess = false;
+    }
+    if (!writeSuccess) {
         std::cerr << "錯誤：結果輸出失敗" << std::endl;
         return EXIT_FAILURE;
     }
-    std::cout << "輸出耗時: " << outputTimer.stop() << " 秒" << std::endl;
+    double outputSeconds = outputTimer.stop();
+    std::cout << "輸出耗時: " << outputSeconds << " 秒" << std::endl;
 
-    std::cout << "總執行時間: " << totalTimer.stop() << " 秒" << std::endl;
+    double totalSeconds = totalTimer.stop();
+    std::cout << "總執行時間: " << totalSeconds << " 秒" << std::endl;
+    if (profiler) {
+        profiler->addStage("output", outputSeconds);
+        profiler->addStage("total", totalSeconds);
+        if (!profiler->writeJson(args.profileFile, sampleNames, contigNames, args.profileTop))
+            return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }